@@ -0,0 +1,281 @@
+/** \file cmdstats.c
+* \brief Fiscal printers daemon's per-command latency statistics
+*
+* V1.200. Written by Andrej Pakhutin
+*
+* Drivers record the time of each printer's exchange phase by command code.
+* Histograms are log-linear, so recording is a few shifts and increments under device's stats_lock.
+* Report is given by STATS command and dumped to syslog on SIGUSR1.
+****************************************************/
+#define CMDSTATS_C
+#include "fprnconfig.h"
+#include "cmdstats.h"
+
+//=======================================================================
+/** \brief Internal. Finds histogram's bucket for the value
+ *
+ * \param v uint32_t - usec
+ * \return int - bucket index
+*/
+static int bucket_of(uint32_t v)
+{
+  int e;
+
+  if ( v < (1 << CMDSTATS_SUB_BITS) )
+    return v;
+
+  e = 31 - __builtin_clz(v); // highest bit set
+
+  return ((e - CMDSTATS_SUB_BITS + 1) << CMDSTATS_SUB_BITS) | ((v >> (e - CMDSTATS_SUB_BITS)) & ((1 << CMDSTATS_SUB_BITS) - 1));
+}
+
+//=======================================================================
+/** \brief Internal. Upper bound of bucket's values
+ *
+ * \param b int - bucket index
+ * \return uint32_t - usec
+*/
+static uint32_t bucket_top(int b)
+{
+  int shift;
+
+  if ( b < (1 << CMDSTATS_SUB_BITS) )
+    return b;
+
+  shift = (b >> CMDSTATS_SUB_BITS) - 1;
+
+  return ((uint32_t)((1 << CMDSTATS_SUB_BITS) | (b & ((1 << CMDSTATS_SUB_BITS) - 1))) << shift) + ((1u << shift) - 1);
+}
+
+//=======================================================================
+static void hist_add(t_latency_hist *h, int64_t v)
+{
+  if ( v < 0 )
+    return;
+
+  if ( v > UINT32_MAX )
+    v = UINT32_MAX;
+
+  ++h->count;
+  h->sum += v;
+
+  if ( v > h->max )
+    h->max = v;
+
+  ++h->buckets[bucket_of(v)];
+}
+
+//=======================================================================
+/** \brief Internal. Value at the given percentile
+ *
+ * \param h t_latency_hist * - histogram
+ * \param pct int - percentile, 1..100
+ * \return uint32_t - usec. upper bound of the bucket, but not above the max seen
+*/
+static uint32_t hist_percentile(t_latency_hist *h, int pct)
+{
+  uint64_t rank, seen;
+  int b;
+
+  if ( h->count == 0 )
+    return 0;
+
+  rank = ((uint64_t)h->count * pct + 99) / 100;
+
+  for ( b = 0, seen = 0; b < CMDSTATS_BUCKETS; ++b )
+  {
+    seen += h->buckets[b];
+
+    if ( seen >= rank )
+      return ( bucket_top(b) < h->max ) ? bucket_top(b) : h->max;
+  }
+
+  return h->max;
+}
+
+//=======================================================================
+/** \brief Internal. Gets device's stats block for the command code, allocating it on first use
+ *
+ * \param dev struct t_device * - device. its stats_lock is held
+ * \param code int - command code
+ * \return t_cmd_stats * - or NULL if code is out of range
+*/
+static t_cmd_stats *cmd_stats_of(struct t_device *dev, int code)
+{
+  if ( code < 0 || code > 255 )
+    return NULL;
+
+  if ( dev->cmd_stats[code] == NULL )
+  {
+    dev->cmd_stats[code] = getmem(sizeof(t_cmd_stats), "cmdstats: malloc");
+    memset(dev->cmd_stats[code], 0, sizeof(t_cmd_stats));
+  }
+
+  return dev->cmd_stats[code];
+}
+
+//=======================================================================
+/** \brief Records the timing of single exchange with printer
+ *
+ * \param dev struct t_device * - device
+ * \param code int - command code
+ * \param ack_usec int64_t - time till command was acknowledged by printer or -1
+ * \param answer_usec int64_t - time till the answer was read or -1
+ * \return void
+ *
+ * Called by drivers from worker thread
+*/
+void cmdstats_record(struct t_device *dev, int code, int64_t ack_usec, int64_t answer_usec)
+{
+  t_cmd_stats *cs;
+
+  pthread_mutex_lock(&dev->stats_lock);
+
+  if ( NULL != (cs = cmd_stats_of(dev, code)) )
+  {
+    hist_add(&cs->ack, ack_usec);
+    hist_add(&cs->answer, answer_usec);
+  }
+
+  pthread_mutex_unlock(&dev->stats_lock);
+}
+
+//=======================================================================
+/** \brief Counts exchange's trouble
+ *
+ * \param dev struct t_device * - device
+ * \param code int - command code
+ * \param event int - CMDSTATS_*
+ * \return void
+*/
+void cmdstats_count(struct t_device *dev, int code, int event)
+{
+  t_cmd_stats *cs;
+
+  pthread_mutex_lock(&dev->stats_lock);
+
+  if ( NULL != (cs = cmd_stats_of(dev, code)) )
+  {
+    switch ( event )
+    {
+      case CMDSTATS_NAK:     ++cs->naks; break;
+      case CMDSTATS_RETRY:   ++cs->retries; break;
+      case CMDSTATS_TIMEOUT: ++cs->timeouts; break;
+    }
+  }
+
+  pthread_mutex_unlock(&dev->stats_lock);
+}
+
+//=======================================================================
+/** \brief Answer time percentile of the command. Used by drivers to learn timeouts
+ *
+ * \param dev struct t_device * - device
+ * \param code int - command code
+ * \param pct int - percentile, 1..100
+ * \param min_count unsigned - least count of answers to trust
+ * \return int64_t - usec or -1 if there is not enough data
+*/
+int64_t cmdstats_answer_percentile(struct t_device *dev, int code, int pct, unsigned min_count)
+{
+  int64_t v;
+
+  if ( code < 0 || code > 255 || dev->cmd_stats[code] == NULL )
+    return -1;
+
+  pthread_mutex_lock(&dev->stats_lock);
+
+  if ( dev->cmd_stats[code]->answer.count < min_count )
+    v = -1;
+  else
+    v = hist_percentile(&dev->cmd_stats[code]->answer, pct);
+
+  pthread_mutex_unlock(&dev->stats_lock);
+
+  return v;
+}
+
+//=======================================================================
+/** \brief Appends text report of device's commands to the buffer
+ *
+ * \param dev struct t_device * - device or NULL for all devices
+ * \param buf char ** - buffer. re-allocated as needed
+ * \param buf_size int * - its size
+ * \param len int - data length in buffer already
+ * \return int - new data length
+ *
+ * One line per command code used. All times are in usec:
+ * dev <id> cmd <code> ack <count> <p50> <p90> <p99> <max> answer <count> <p50> <p90> <p99> <max> <avg> naks <n> retries <n> timeouts <n>
+*/
+int cmdstats_format(struct t_device *dev, char **buf, int *buf_size, int len)
+{
+  t_cmd_stats cs;
+  int i, code;
+
+  if ( dev == NULL )
+  {
+    for ( i = 0; i < devices_count; ++i )
+      len = cmdstats_format(&devices[i], buf, buf_size, len);
+
+    return len;
+  }
+
+  for ( code = 0; code < 256; ++code )
+  {
+    if ( dev->cmd_stats[code] == NULL ) // pointer is set once, so it is safe to peek without lock
+      continue;
+
+    pthread_mutex_lock(&dev->stats_lock);
+    cs = *dev->cmd_stats[code];
+    pthread_mutex_unlock(&dev->stats_lock);
+
+    if ( ! check_buf_size(buf, buf_size, &len, 256) )
+    {
+      dosyslog(LOG_ERR, "cmdstats_format: realloc for +256: %m");
+      exit(1);
+    }
+
+    len += snprintf(*buf + len, 256, "dev %d cmd %#04x ack %u %u %u %u %u answer %u %u %u %u %u %u naks %u retries %u timeouts %u\n",
+                    dev->id, code,
+                    cs.ack.count, hist_percentile(&cs.ack, 50), hist_percentile(&cs.ack, 90), hist_percentile(&cs.ack, 99), cs.ack.max,
+                    cs.answer.count, hist_percentile(&cs.answer, 50), hist_percentile(&cs.answer, 90), hist_percentile(&cs.answer, 99), cs.answer.max,
+                    (unsigned)( cs.answer.count ? cs.answer.sum / cs.answer.count : 0 ),
+                    cs.naks, cs.retries, cs.timeouts);
+  }
+
+  return len;
+}
+
+//=======================================================================
+/** \brief Writes report of all devices to syslog
+ *
+ * \param void
+ * \return void
+*/
+void cmdstats_dump(void)
+{
+  char *buf, *line, *next;
+  int buf_size, len;
+
+  buf = NULL;
+  buf_size = 0;
+  len = cmdstats_format(NULL, &buf, &buf_size, 0);
+
+  if ( len == 0 )
+  {
+    dosyslog(LOG_NOTICE, "cmdstats: no commands were sent yet");
+    return;
+  }
+
+  buf[len] = '\0'; // there is always room left after snprintf
+
+  for ( line = buf; line != NULL && *line != '\0'; line = next )
+  {
+    if ( NULL != (next = strchr(line, '\n')) )
+      *next++ = '\0';
+
+    dosyslog(LOG_NOTICE, "cmdstats: %s", line);
+  }
+
+  free(buf);
+}
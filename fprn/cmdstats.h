@@ -0,0 +1,54 @@
+/** \file cmdstats.h
+* \brief Fiscal printers daemon's per-command latency statistics
+*
+* V1.200. Written by Andrej Pakhutin
+****************************************************/
+#ifndef CMDSTATS_H
+#define CMDSTATS_H
+
+#include <stdint.h>
+
+/* log-linear (HDR-like) histogram of microseconds.
+   values below 2^CMDSTATS_SUB_BITS have own buckets, the others have 2^CMDSTATS_SUB_BITS buckets per power of 2,
+   so the error is 1/2^CMDSTATS_SUB_BITS (12.5%) at most
+*/
+#define CMDSTATS_SUB_BITS 3
+#define CMDSTATS_BUCKETS ((32 - CMDSTATS_SUB_BITS + 1) << CMDSTATS_SUB_BITS)
+
+typedef struct t_latency_hist
+{
+  uint32_t count;
+  uint32_t max; // usec
+  uint64_t sum; // usec
+  uint32_t buckets[CMDSTATS_BUCKETS];
+} t_latency_hist;
+
+// per-device, per-command code data. allocated on the first use of the code
+typedef struct t_cmd_stats
+{
+  t_latency_hist ack; // from the start of exchange till printer has acknowledged the command
+  t_latency_hist answer; // --"-- till the answer is read
+  uint32_t naks; // command frame rejected by printer
+  uint32_t retries; // command frame re-sent
+  uint32_t timeouts; // no acknowledge or answer in time
+} t_cmd_stats;
+
+// events for cmdstats_count()
+#define CMDSTATS_NAK     1
+#define CMDSTATS_RETRY   2
+#define CMDSTATS_TIMEOUT 3
+
+struct t_device;
+
+#ifndef CMDSTATS_C
+// driver side. code is the command code, the same as the answer_timeouts[] index. usec since exchange start (ap_evloop_now() based), -1 for the phase not reached
+extern void cmdstats_record(struct t_device *dev, int code, int64_t ack_usec, int64_t answer_usec);
+extern void cmdstats_count(struct t_device *dev, int code, int event);
+// answer time percentile of the code in usec or -1 if there are less than min_count answers recorded
+extern int64_t cmdstats_answer_percentile(struct t_device *dev, int code, int pct, unsigned min_count);
+// appends text report of device(s) to the buffer. dev == NULL for all devices. returns new data length
+extern int cmdstats_format(struct t_device *dev, char **buf, int *buf_size, int len);
+extern void cmdstats_dump(void); // all devices to syslog. used on SIGUSR1
+#endif
+
+#endif
@@ -0,0 +1,292 @@
+/** \file devsched.c
+* \brief Fiscal printers daemon's per-device scheduling of competing clients - leases and wait queue
+*
+* V1.200. Written by Andrej Pakhutin
+*
+* Client takes device's lease for multi-command transaction, like open cheque - positions - close cheque,
+* so the commands of the other clients are not interleaved with it. The others' commands and lease requests
+* wait in device's queue, higher priority first and FIFO within the same one, and are let go when lease is dropped.
+* Lease expires after lease_timeout of holder's silence, so the vanished client does not block the device forever.
+* Event loop's thread only.
+****************************************************/
+#define DEVSCHED_C
+#include "devsched.h"
+
+static void (*lease_handler)(int conn_idx, struct t_device *dev) = NULL;
+
+static void dispatch(struct t_device *dev);
+
+//=======================================================================
+/** \brief Device's sched_timer handler. Lets the queue go after lease is dropped
+ *
+ * \param timer ap_evloop_timer_t * - device's sched_timer
+ * \param data void* - ptr to t_device
+ * \return void
+ *
+ * Dispatch is deferred to event loop, so releasing connection does not get the others answered from its own handler
+*/
+static void sched_timer_event(ap_evloop_timer_t *timer, void *data)
+{
+  dispatch((struct t_device *)data);
+}
+
+//=======================================================================
+/** \brief Device's lease_timer handler. Holder was silent for too long
+ *
+ * \param timer ap_evloop_timer_t * - device's lease_timer
+ * \param data void* - ptr to t_device
+ * \return void
+*/
+static void lease_expired(ap_evloop_timer_t *timer, void *data)
+{
+  struct t_device *dev;
+
+  dev = (struct t_device *)data;
+
+  dosyslog(LOG_WARNING, "dev %d: lease of tcp conn %d expired after %d sec of silence", dev->id, dev->lease_conn, lease_timeout);
+
+  dev->lease_conn = -1;
+  dispatch(dev);
+}
+
+//=======================================================================
+/** \brief Sets up devices' timers. Should be called after config is read
+ *
+ * \param on_lease void (*)(int, struct t_device *) - called when queued lease request is granted
+ * \return void
+*/
+void devsched_module_init(void (*on_lease)(int conn_idx, struct t_device *dev))
+{
+  int i;
+
+  lease_handler = on_lease;
+
+  for ( i = 0; i < devices_count; ++i )
+  {
+    devices[i].lease_conn = -1;
+    devices[i].lease_busy = 0;
+    devices[i].sched_head = NULL;
+    ap_evloop_timer_init(&devices[i].lease_timer, lease_expired, &devices[i]);
+    ap_evloop_timer_init(&devices[i].sched_timer, sched_timer_event, &devices[i]);
+  }
+}
+
+//=======================================================================
+/** \brief Internal. Makes connection the lease holder
+ *
+ * \param dev struct t_device * - device
+ * \param conn_idx int - connection index
+ * \return void
+*/
+static void grant(struct t_device *dev, int conn_idx)
+{
+  if ( dev->lease_conn != conn_idx )
+    dev->lease_busy = 0;
+
+  dev->lease_conn = conn_idx;
+
+  if ( dev->lease_busy == 0 ) // repeated request of the holder does not revoke it from under its command
+    ap_evloop_timer_start(&dev->lease_timer, lease_timeout * 1000);
+
+  if (debug_want(3))
+    debuglog("dev %d: lease granted to tcp conn %d\n", dev->id, conn_idx);
+}
+
+//=======================================================================
+/** \brief Internal. Puts request to device's queue after the ones with the same or higher priority
+ *
+ * \param dev struct t_device * - device
+ * \param conn_idx int - requester or -1
+ * \param prio int - SCHED_PRIO_*
+ * \param job t_dev_job * - job or NULL for lease request
+ * \return void
+*/
+static void enqueue(struct t_device *dev, int conn_idx, int prio, t_dev_job *job)
+{
+  t_sched_wait *w, **pw;
+
+  w = getmem(sizeof(t_sched_wait), "devsched: malloc");
+  w->prio = prio;
+  w->conn_idx = conn_idx;
+  w->job = job;
+
+  for ( pw = &dev->sched_head; *pw != NULL && (*pw)->prio >= prio; pw = &(*pw)->next );
+
+  w->next = *pw;
+  *pw = w;
+
+  if (debug_want(3))
+    debuglog("dev %d: %s of tcp conn %d waits for lease of conn %d\n", dev->id, (job == NULL ? "lease" : "command"), conn_idx, dev->lease_conn);
+}
+
+//=======================================================================
+/** \brief Internal. Passes the queue to worker until the next lease request, which is granted then
+ *
+ * \param dev struct t_device * - device
+ * \return void
+*/
+static void dispatch(struct t_device *dev)
+{
+  t_sched_wait *w;
+  int conn_idx;
+
+  while ( dev->lease_conn == -1 && NULL != (w = dev->sched_head) )
+  {
+    dev->sched_head = w->next;
+    conn_idx = w->conn_idx;
+
+    if ( w->job != NULL )
+      devworker_submit(w->job);
+    else
+    {
+      grant(dev, conn_idx);
+      free(w);
+
+      if ( lease_handler != NULL )
+        lease_handler(conn_idx, dev); // holder could release it at once, but that is re-dispatched from event loop
+
+      return;
+    }
+
+    free(w);
+  }
+}
+
+//=======================================================================
+/** \brief Takes device's lease or queues the request if device is leased or other requests wait
+ *
+ * \param dev struct t_device * - device
+ * \param conn_idx int - connection index
+ * \param prio int - SCHED_PRIO_*
+ * \return int - boolean. lease is granted now. on_lease handler is called later otherwise
+ *
+ * Repeated request of the holder just restarts the lease timeout
+*/
+int devsched_lease(struct t_device *dev, int conn_idx, int prio)
+{
+  if ( dev->lease_conn == conn_idx || (dev->lease_conn == -1 && dev->sched_head == NULL) )
+  {
+    grant(dev, conn_idx);
+    return 1;
+  }
+
+  enqueue(dev, conn_idx, prio, NULL);
+
+  return 0;
+}
+
+//=======================================================================
+/** \brief Drops device's lease. Waiting requests are dispatched from event loop
+ *
+ * \param dev struct t_device * - device
+ * \param conn_idx int - connection index
+ * \return int - boolean. connection was the holder
+*/
+int devsched_release(struct t_device *dev, int conn_idx)
+{
+  if ( dev->lease_conn != conn_idx )
+    return 0;
+
+  if (debug_want(3))
+    debuglog("dev %d: lease released by tcp conn %d\n", dev->id, conn_idx);
+
+  dev->lease_conn = -1;
+  dev->lease_busy = 0;
+  ap_evloop_timer_stop(&dev->lease_timer);
+
+  if ( dev->sched_head != NULL )
+    ap_evloop_timer_start(&dev->sched_timer, 0);
+
+  return 1;
+}
+
+//=======================================================================
+/** \brief Queues printer command to device's worker now or after lease holder is done
+ *
+ * \param job t_dev_job * - job. job->sched_conn is requester or -1
+ * \param prio int - SCHED_PRIO_*
+ * \return void
+ *
+ * Holder's commands and the ones to free device with no one waiting go to worker at once.
+ * Waiting job belongs to its answer's connection (job->conn_idx), so the async one survives requester's disconnect
+*/
+void devsched_submit(t_dev_job *job, int prio)
+{
+  struct t_device *dev;
+
+  dev = job->dev;
+
+  if ( (job->sched_conn != -1 && dev->lease_conn == job->sched_conn) || (dev->lease_conn == -1 && dev->sched_head == NULL) )
+  {
+    devworker_submit(job);
+    return;
+  }
+
+  enqueue(dev, job->conn_idx, prio, job);
+}
+
+//=======================================================================
+/** \brief Holds lease timeout while holder's commands are in work and restarts it after the last answer
+ *
+ * \param dev struct t_device * - device
+ * \param conn_idx int - connection index
+ * \param busy int - boolean. command is started
+ * \return void
+ *
+ * Holder could have several SUBMIT'ted commands in work, so they are counted
+*/
+void devsched_activity(struct t_device *dev, int conn_idx, int busy)
+{
+  if ( dev->lease_conn != conn_idx )
+    return;
+
+  if ( busy )
+  {
+    ++dev->lease_busy;
+    ap_evloop_timer_stop(&dev->lease_timer);
+    return;
+  }
+
+  if ( dev->lease_busy > 0 )
+    --dev->lease_busy;
+
+  if ( dev->lease_busy == 0 )
+    ap_evloop_timer_start(&dev->lease_timer, lease_timeout * 1000);
+}
+
+//=======================================================================
+/** \brief Drops the leases and waiting requests of connection. Called when connection is closed
+ *
+ * \param conn_idx int - connection index
+ * \return void
+ *
+ * Waiting commands were not given to worker yet, so they are freed here
+*/
+void devsched_conn_gone(int conn_idx)
+{
+  t_sched_wait *w, **pw;
+  int i;
+
+  for ( i = 0; i < devices_count; ++i )
+  {
+    for ( pw = &devices[i].sched_head; *pw != NULL; )
+    {
+      w = *pw;
+
+      if ( w->conn_idx != conn_idx )
+      {
+        pw = &w->next;
+        continue;
+      }
+
+      *pw = w->next;
+
+      if ( w->job != NULL )
+        devjob_free(w->job);
+
+      free(w);
+    }
+
+    devsched_release(&devices[i], conn_idx);
+  }
+}
@@ -0,0 +1,35 @@
+/** \file devsched.h
+* \brief Fiscal printers daemon's per-device scheduling of competing clients - leases and wait queue
+*
+* V1.200. Written by Andrej Pakhutin
+****************************************************/
+#ifndef DEVSCHED_H
+#define DEVSCHED_H
+
+#include "devworker.h"
+
+// wait queue priorities. higher goes first, FIFO within the same one
+#define SCHED_PRIO_REPORT 0
+#define SCHED_PRIO_NORMAL 1
+#define SCHED_PRIO_FISCAL 2
+
+// lease request or printer command that waits for device's lease holder to finish
+typedef struct t_sched_wait
+{
+  struct t_sched_wait *next;
+  int prio; // SCHED_PRIO_*
+  int conn_idx; // requester. -1 for async job
+  t_dev_job *job; // command to queue to worker when it is our turn. NULL for lease request
+} t_sched_wait;
+
+#ifndef DEVSCHED_C
+// sets up devices' timers. on_lease is called from event loop when queued lease request is granted
+extern void devsched_module_init(void (*on_lease)(int conn_idx, struct t_device *dev));
+extern int  devsched_lease(struct t_device *dev, int conn_idx, int prio); // takes the lease or queues the request. returns boolean: granted now
+extern int  devsched_release(struct t_device *dev, int conn_idx); // drops the lease. returns boolean: connection was the holder
+extern void devsched_submit(t_dev_job *job, int prio); // queues job to worker now or after lease holder is done. job->sched_conn is requester
+extern void devsched_activity(struct t_device *dev, int conn_idx, int busy); // holder's command started (busy) or answered. lease does not expire while busy
+extern void devsched_conn_gone(int conn_idx); // drops connection's leases and waiting requests
+#endif
+
+#endif
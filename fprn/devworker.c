@@ -0,0 +1,387 @@
+/** \file devworker.c
+* \brief Fiscal printers daemon's per-device worker threads
+*
+* V1.200. Written by Andrej Pakhutin
+*
+* Each configured device gets its own thread that owns device's tty and runs driver methods.
+* Network thread only parses requests and queues jobs here, so slow printer never stalls
+* other clients or other printers. Finished jobs are passed back to event loop via eventfd.
+****************************************************/
+#define DEVWORKER_C
+#include "devworker.h"
+#include "flightrec.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+static void (*job_done_handler)(t_dev_job *job) = NULL;
+
+// finished jobs, waiting for event loop
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_dev_job *done_head = NULL, *done_tail = NULL;
+static int done_fd = -1;
+
+//=======================================================================
+/** \brief Allocates new job
+ *
+ * \param type int - DEVJOB_*
+ * \param dev struct t_device * - target device
+ * \return t_dev_job *
+ *
+ * Terminates program on memory shortage
+*/
+t_dev_job *devjob_new(int type, struct t_device *dev)
+{
+  t_dev_job *job;
+
+  job = getmem(sizeof(t_dev_job), "devjob_new: malloc");
+  memset(job, 0, sizeof(t_dev_job));
+
+  job->type = type;
+  job->dev = dev;
+  job->conn_idx = -1;
+  job->sched_conn = -1;
+
+  return job;
+}
+
+//=======================================================================
+void devjob_free(t_dev_job *job)
+{
+  if ( job->data != NULL )
+    free(job->data);
+
+  if ( job->answer != NULL )
+    free(job->answer);
+
+  free(job);
+}
+
+//=======================================================================
+/** \brief Wakes up event loop. Used both for the finished jobs and device state changes
+ *
+ * \param job t_dev_job * - finished job or NULL
+ * \return void
+*/
+static void notify_loop(t_dev_job *job)
+{
+  uint64_t one = 1;
+
+  if ( job != NULL )
+  {
+    job->next = NULL;
+
+    pthread_mutex_lock(&done_lock);
+
+    if ( done_tail == NULL )
+      done_head = job;
+    else
+      done_tail->next = job;
+
+    done_tail = job;
+
+    pthread_mutex_unlock(&done_lock);
+  }
+
+  if ( sizeof(one) != write(done_fd, &one, sizeof(one)) )
+    dosyslog(LOG_ERR, "devworker: write to completion eventfd: %m");
+}
+
+//=======================================================================
+/** \brief Event loop handler for completion eventfd. Passes all finished jobs to on_done handler
+ *
+ * \param fd int - eventfd
+ * \param events uint32_t - EPOLL* mask
+ * \param data void* - unused
+ * \return void
+*/
+static void jobs_done_event(int fd, uint32_t events, void *data)
+{
+  uint64_t cnt;
+  t_dev_job *job, *next;
+
+  if ( sizeof(cnt) != read(done_fd, &cnt, sizeof(cnt)) )
+    return;
+
+  pthread_mutex_lock(&done_lock);
+  job = done_head;
+  done_head = done_tail = NULL;
+  pthread_mutex_unlock(&done_lock);
+
+  for ( ; job != NULL; job = next )
+  {
+    next = job->next;
+    job_done_handler(job);
+  }
+
+  job_done_handler(NULL); // device state could be changed without a job
+}
+
+//=======================================================================
+/** \brief Creates jobs completion channel
+ *
+ * \param on_done void (*)(t_dev_job *) - called in event loop thread for each finished job, and with NULL at the end of batch
+ * \return int - boolean success
+ *
+ * on_done handler owns the job passed and should free it
+*/
+int devworker_module_init(void (*on_done)(t_dev_job *job))
+{
+  job_done_handler = on_done;
+
+  if ( -1 == (done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) )
+  {
+    dosyslog(LOG_ERR, "devworker: eventfd(): %m");
+    return 0;
+  }
+
+  return ap_evloop_add(done_fd, EPOLLIN, jobs_done_event, NULL);
+}
+
+//=======================================================================
+/** \brief Queues the job to its device's worker
+ *
+ * \param job t_dev_job * - job. worker owns it until it is passed back to on_done handler
+ * \return void
+*/
+void devworker_submit(t_dev_job *job)
+{
+  struct t_device *dev;
+  uint64_t one = 1;
+
+  dev = job->dev;
+  job->next = NULL;
+
+  pthread_mutex_lock(&dev->queue_lock);
+
+  if ( dev->queue_tail == NULL )
+    dev->queue_head = job;
+  else
+    dev->queue_tail->next = job;
+
+  dev->queue_tail = job;
+
+  pthread_mutex_unlock(&dev->queue_lock);
+
+  if ( sizeof(one) != write(dev->wake_fd, &one, sizeof(one)) )
+    dosyslog(LOG_ERR, "devworker: dev %d: write to wake eventfd: %m", dev->id);
+}
+
+//=======================================================================
+static t_dev_job *dequeue(struct t_device *dev)
+{
+  t_dev_job *job;
+
+  pthread_mutex_lock(&dev->queue_lock);
+
+  job = dev->queue_head;
+
+  if ( job != NULL )
+  {
+    dev->queue_head = job->next;
+
+    if ( dev->queue_head == NULL )
+      dev->queue_tail = NULL;
+  }
+
+  pthread_mutex_unlock(&dev->queue_lock);
+
+  return job;
+}
+
+//=======================================================================
+/** \brief Worker's internal. Executes single job with device's driver
+ *
+ * \param dev struct t_device * - device
+ * \param job t_dev_job * - job
+ * \return void
+*/
+static void run_job(struct t_device *dev, t_dev_job *job)
+{
+  switch ( job->type )
+  {
+    case DEVJOB_SEND:
+      job->errcode = dev->device_type->func_send_command(dev->id, job->data, job->data_size);
+
+      if ( job->errcode == 0 )
+      {
+        job->answer_len = dev->buf_ptr;
+        job->answer = getmem(job->answer_len + 1, "devworker: answer malloc");
+        memcpy(job->answer, dev->buf, job->answer_len);
+      }
+
+      break;
+
+    case DEVJOB_GETSTATE:
+      job->errcode = dev->device_type->func_get_state(dev->id);
+
+      if ( job->errcode == 0 )
+      {
+        job->answer_len = strlen((char*)(dev->buf));
+        job->answer = getmem(job->answer_len + 1, "devworker: answer malloc");
+        memcpy(job->answer, dev->buf, job->answer_len + 1);
+      }
+
+      break;
+
+    case DEVJOB_TRANSACTION: // result text is there on failure too
+      job->errcode = dev->device_type->func_transaction(dev->id, (struct t_fiscal_doc *)job->data);
+      job->answer_len = strlen((char*)(dev->buf));
+      job->answer = getmem(job->answer_len + 1, "devworker: answer malloc");
+      memcpy(job->answer, dev->buf, job->answer_len + 1);
+      break;
+
+    case DEVJOB_SHUTDOWN:
+      if ( dev->device_type->func_shutdown != NULL )
+        job->errcode = dev->device_type->func_shutdown(dev->id);
+
+      break;
+
+    case DEVJOB_INIT:
+      dosyslog(LOG_NOTICE, "fprn devworker: init of dev %d (%s) requested", dev->id, dev->tty);
+
+      job->errcode = dev->device_type->func_port_init(dev->id);
+
+      if ( job->errcode == 0 )
+      {
+        if (debug_want(1)) debuglog("port %s initialized\n", dev->tty);
+      }
+      else
+        DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
+
+      dev->next_attempt = ap_evloop_now() + 9 * 1000000;
+      break;
+  }
+
+  job->dev_state = DEV_STATE(dev);
+}
+
+//=======================================================================
+/** \brief Worker's internal. Reads and drops the data that printer sent on its own between commands
+ *
+ * \param dev struct t_device * - device
+ * \param revents short - poll() events on device's tty
+ * \return void
+ *
+ * Hang up of the line leads to device re-initialization.
+*/
+static void idle_tty_event(struct t_device *dev, short revents)
+{
+  unsigned char junk[256];
+  int n;
+
+  if ( revents & (POLLHUP | POLLERR | POLLNVAL) )
+  {
+    dosyslog(LOG_ERR, "fprn devworker: dev %d (%s): line hang up or error. re-init requested", dev->id, dev->tty);
+    DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
+    notify_loop(NULL); // housekeeping will plan re-init
+    return;
+  }
+
+  n = read(dev->fd, junk, sizeof(junk));
+
+  if ( n > 0 && debug_want(6) )
+  {
+    debuglog("? dev %d (%s): %d byte(s) of unsolicited data dropped:%c", dev->id, dev->tty, n, (n > 10 ? '\n' : ' '));
+    memdump(junk, n);
+  }
+}
+
+//=======================================================================
+/** \brief Worker thread's main loop
+ *
+ * \param arg void* - ptr to the device
+ * \return void*
+ *
+ * Sleeps until there is a new job in the queue or something is coming from idle printer.
+*/
+static void *worker_main(void *arg)
+{
+  struct t_device *dev;
+  t_dev_job *job;
+  struct pollfd fds[2];
+  uint64_t cnt;
+  int nfds;
+
+  dev = (struct t_device *)arg;
+  ap_log_context(LOGCAT_DRIVER, dev->id); // for MON subscribers' filters
+
+  for(;;)
+  {
+    fds[0].fd = dev->wake_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    nfds = 1;
+
+    if ( dev->fd > 0 && DEV_STATE(dev) != STATE_NEEDRECONNECT )
+    {
+      fds[1].fd = dev->fd;
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+      nfds = 2;
+    }
+
+    if ( -1 == poll(fds, nfds, -1) )
+    {
+      if ( errno != EINTR )
+        dosyslog(LOG_ERR, "fprn devworker: dev %d: poll(): %m", dev->id);
+
+      continue;
+    }
+
+    if ( nfds == 2 && fds[1].revents != 0 )
+      idle_tty_event(dev, fds[1].revents);
+
+    if ( fds[0].revents == 0 )
+      continue;
+
+    if ( sizeof(cnt) != read(dev->wake_fd, &cnt, sizeof(cnt)) )
+      continue;
+
+    while ( NULL != (job = dequeue(dev)) )
+    {
+      run_job(dev, job);
+      notify_loop(job);
+    }
+  }
+
+  return NULL;
+}
+
+//=======================================================================
+/** \brief Starts worker thread for device
+ *
+ * \param dev struct t_device * - device
+ * \return int - boolean success
+*/
+int devworker_start(struct t_device *dev)
+{
+  int errcode;
+
+  dev->queue_head = dev->queue_tail = NULL;
+  pthread_mutex_init(&dev->queue_lock, NULL);
+  pthread_mutex_init(&dev->status_lock, NULL);
+  pthread_mutex_init(&dev->stats_lock, NULL);
+
+  // bulky and rarely touched. out of line, so the device table walks stay in cache
+  dev->status_text = getmem(DEV_STATUS_MAX, "devworker_start: malloc status");
+  dev->cmd_stats = getmem(256 * sizeof(struct t_cmd_stats *), "devworker_start: malloc cmd_stats");
+  memset(dev->cmd_stats, 0, 256 * sizeof(struct t_cmd_stats *));
+
+  flightrec_init(dev);
+
+  if ( -1 == (dev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) )
+  {
+    dosyslog(LOG_ERR, "devworker: dev %d: eventfd(): %m", dev->id);
+    return 0;
+  }
+
+  if ( 0 != (errcode = pthread_create(&dev->worker, NULL, worker_main, dev)) )
+  {
+    errno = errcode;
+    dosyslog(LOG_ERR, "devworker: dev %d: pthread_create(): %m", dev->id);
+    return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,53 @@
+/** \file devworker.h
+* \brief Fiscal printers daemon's per-device worker threads - jobs and queues
+*
+* V1.200. Written by Andrej Pakhutin
+****************************************************/
+#ifndef DEVWORKER_H
+#define DEVWORKER_H
+
+#include "fprnconfig.h"
+
+// job types
+#define DEVJOB_SEND     1 // send command to printer. data is raw command
+#define DEVJOB_GETSTATE 2 // query printer status
+#define DEVJOB_INIT     3 // (re-)initialize the port
+#define DEVJOB_TRANSACTION 4 // print whole fiscal document. data is t_fiscal_doc, answer is driver's result text
+#define DEVJOB_SHUTDOWN 5 // save driver's state before exit
+
+typedef struct t_dev_job
+{
+  struct t_dev_job *next; // queue link
+  int type; // DEVJOB_*
+  struct t_device *dev;
+
+  // requester. conn_idx == -1 if job is internal
+  int conn_idx;
+  int sched_conn; // connection whose device's lease the job may use, see devsched.c. -1 if none. differs from conn_idx for async jobs
+
+  char *data; // command for printer. malloc'd, freed with job
+  size_t data_size;
+
+  // results. filled by worker
+  int errcode; // driver's method return code
+  unsigned dev_state; // device->state after the job
+  unsigned char *answer; // copy of device->buf. malloc'd, freed with job
+  int answer_len;
+
+  // asynchronous (SUBMIT'ted) jobs only. see tcpanswer.c
+  unsigned id; // job id given to peer. 0 for the jobs answered right to the requesting connection
+  int done; // worker finished it
+  ap_evloop_timer_t keep_timer; // drops finished job's result after job_keep_time
+  struct t_dev_job *async_next; // link in the async jobs list
+} t_dev_job;
+
+#ifndef DEVWORKER_C
+// creates completion channel within event loop. on_done is called in event loop's thread for each finished job
+extern int devworker_module_init(void (*on_done)(t_dev_job *job));
+extern int devworker_start(struct t_device *dev); // starts worker thread for device
+extern t_dev_job *devjob_new(int type, struct t_device *dev); // allocates and zeroes new job
+extern void devjob_free(t_dev_job *job);
+extern void devworker_submit(t_dev_job *job); // queues job to its device's worker
+#endif
+
+#endif
@@ -0,0 +1,257 @@
+/** \file fiscaldoc.c
+* \brief Fiscal printers daemon's whole fiscal document for TRANSACTION command
+*
+* V1.200. Written by Andrej Pakhutin
+*
+* Document comes as TRANSACTION's data lines, one keyword each:
+*   TYPE sell|buy|sellret|buyret
+*   PASSWORD <operator's password>
+*   HEADER <text>
+*   POS <qty 1/1000> <price kopecks> <division> <tax1> <tax2> <tax3> <tax4> <text>
+*   PAY <kind 1..4> <sum kopecks>    kind 1 is cash
+*   FOOTER <text>
+*   TOTAL <sum kopecks>
+* Texts are passed to printer as is, so they should be in printer's codepage already.
+* Empty and blank lines are skipped.
+* Totals are checked before anything goes to printer, so the wrong document is not even opened.
+****************************************************/
+#define FISCALDOC_C
+#include "fprnconfig.h"
+#include "fiscaldoc.h"
+
+//=======================================================================
+/** \brief Creates empty document
+ *
+ * \param void
+ * \return t_fiscal_doc* - malloc'd document with room for a few positions
+*/
+t_fiscal_doc *fdoc_new(void)
+{
+  t_fiscal_doc *doc;
+
+  doc = getmem(sizeof(t_fiscal_doc) + 8 * sizeof(t_fiscal_pos), "fdoc_new: malloc");
+  memset(doc, 0, sizeof(t_fiscal_doc));
+  doc->type = -1;
+  doc->password = -1;
+  doc->declared_total = -1;
+  doc->pos_size = 8;
+
+  return doc;
+}
+
+//=======================================================================
+/** \brief Internal. Parses unsigned decimal number token
+ *
+ * \param s char* - token or NULL
+ * \param max uint64_t - max value allowed
+ * \param out uint64_t* - set to the value
+ * \return int - boolean
+*/
+static int parse_number(char *s, uint64_t max, uint64_t *out)
+{
+  char *sp;
+
+  if ( s == NULL || *s < '0' || *s > '9' )
+    return 0;
+
+  errno = 0;
+  *out = strtoull(s, &sp, 10);
+
+  return ( errno == 0 && *sp == '\0' && *out <= max );
+}
+
+//=======================================================================
+/** \brief Internal. Copies printer's line text
+ *
+ * \param dst char* - FDOC_TEXT_MAX + 1 bytes
+ * \param s char* - text or NULL
+ * \return int - boolean. false if it is too long
+*/
+static int copy_text(char *dst, char *s)
+{
+  if ( s == NULL )
+    s = "";
+
+  if ( strlen(s) > FDOC_TEXT_MAX )
+    return 0;
+
+  strcpy(dst, s);
+
+  return 1;
+}
+
+//=======================================================================
+/** \brief Adds TRANSACTION's data line to the document
+ *
+ * \param pdoc t_fiscal_doc** - document. it is re-allocated when positions are added
+ * \param line char* - zero-terminated line. it is altered
+ * \return int - boolean. false if line is malformed or exceeds the limits
+*/
+int fdoc_parse_line(t_fiscal_doc **pdoc, char *line)
+{
+  t_fiscal_doc *doc;
+  t_fiscal_pos *pos;
+  char *token, *s;
+  uint64_t u;
+  int i;
+
+  doc = *pdoc;
+  line += strspn(line, " \t");
+
+  if ( *line == '\0' ) // blank line
+    return 1;
+
+  token = strsep(&line, " \t");
+
+  if ( 0 == strcasecmp(token, "TYPE") )
+  {
+    s = strsep(&line, " \t");
+
+    if ( s == NULL )
+      return 0;
+    else if ( 0 == strcasecmp(s, "sell") )
+      doc->type = FDOC_SELL;
+    else if ( 0 == strcasecmp(s, "buy") )
+      doc->type = FDOC_BUY;
+    else if ( 0 == strcasecmp(s, "sellret") )
+      doc->type = FDOC_SELLRET;
+    else if ( 0 == strcasecmp(s, "buyret") )
+      doc->type = FDOC_BUYRET;
+    else
+      return 0;
+  }
+  else if ( 0 == strcasecmp(token, "PASSWORD") )
+  {
+    if ( ! parse_number(strsep(&line, " \t"), 0xFFFFFFFFUL, &u) )
+      return 0;
+
+    doc->password = u;
+  }
+  else if ( 0 == strcasecmp(token, "HEADER") )
+  {
+    if ( doc->header_count == FDOC_LINES_MAX || ! copy_text(doc->header[doc->header_count], line) )
+      return 0;
+
+    doc->header_count++;
+  }
+  else if ( 0 == strcasecmp(token, "FOOTER") )
+  {
+    if ( doc->footer_count == FDOC_LINES_MAX || ! copy_text(doc->footer[doc->footer_count], line) )
+      return 0;
+
+    doc->footer_count++;
+  }
+  else if ( 0 == strcasecmp(token, "POS") )
+  {
+    if ( doc->pos_count == FDOC_POS_MAX )
+      return 0;
+
+    if ( doc->pos_count == doc->pos_size )
+    {
+      i = doc->pos_size * 2;
+
+      if ( NULL == (doc = realloc(doc, sizeof(t_fiscal_doc) + i * sizeof(t_fiscal_pos))) )
+      {
+        dosyslog(LOG_ERR, "fdoc_parse_line: realloc for %d positions: %m", i);
+        exit(1);
+      }
+
+      doc->pos_size = i;
+      *pdoc = doc;
+    }
+
+    pos = &doc->pos[doc->pos_count];
+
+    // the limits keep qty * price and the sum of positions within 64 bit
+    if ( ! parse_number(strsep(&line, " \t"), 1000000000ULL, &pos->qty) || pos->qty == 0 )
+      return 0;
+
+    if ( ! parse_number(strsep(&line, " \t"), 10000000000ULL, &pos->price) )
+      return 0;
+
+    if ( ! parse_number(strsep(&line, " \t"), 16, &u) )
+      return 0;
+
+    pos->division = u;
+
+    for ( i = 0; i < 4; ++i )
+    {
+      if ( ! parse_number(strsep(&line, " \t"), 4, &u) )
+        return 0;
+
+      pos->tax[i] = u;
+    }
+
+    if ( line == NULL || *line == '\0' || ! copy_text(pos->text, line) )
+      return 0;
+
+    doc->pos_count++;
+  }
+  else if ( 0 == strcasecmp(token, "PAY") )
+  {
+    if ( ! parse_number(strsep(&line, " \t"), FDOC_PAY_KINDS, &u) || u == 0 )
+      return 0;
+
+    i = u - 1;
+
+    if ( ! parse_number(strsep(&line, " \t"), FDOC_SUM_MAX, &u) )
+      return 0;
+
+    doc->payment[i] = u;
+  }
+  else if ( 0 == strcasecmp(token, "TOTAL") )
+  {
+    if ( ! parse_number(strsep(&line, " \t"), FDOC_SUM_MAX, &u) )
+      return 0;
+
+    doc->declared_total = u;
+  }
+  else
+    return 0;
+
+  return 1;
+}
+
+//=======================================================================
+/** \brief Checks that document is complete and its totals are consistent. Sets doc->total
+ *
+ * \param doc t_fiscal_doc* - document
+ * \return int - boolean
+ *
+ * Position's sum is rounded to kopecks as printer does. Non-cash payments can't exceed the total,
+ * the change is given from cash only. Without any PAY the total is paid in cash exactly.
+*/
+int fdoc_validate(t_fiscal_doc *doc)
+{
+  uint64_t paid;
+  int i;
+
+  if ( doc->type == -1 || doc->pos_count == 0 )
+    return 0;
+
+  doc->total = 0;
+
+  for ( i = 0; i < doc->pos_count; ++i )
+    doc->total += (doc->pos[i].qty * doc->pos[i].price + 500) / 1000;
+
+  if ( doc->total > FDOC_SUM_MAX )
+    return 0;
+
+  if ( doc->declared_total != -1 && (uint64_t)doc->declared_total != doc->total )
+    return 0;
+
+  paid = 0;
+
+  for ( i = 1; i < FDOC_PAY_KINDS; ++i )
+    paid += doc->payment[i];
+
+  if ( paid > doc->total )
+    return 0;
+
+  if ( paid + doc->payment[0] == 0 )
+    doc->payment[0] = doc->total;
+  else if ( paid + doc->payment[0] < doc->total )
+    return 0;
+
+  return 1;
+}
@@ -0,0 +1,53 @@
+/** \file fiscaldoc.h
+* \brief Fiscal printers daemon's whole fiscal document for TRANSACTION command
+*
+* V1.200. Written by Andrej Pakhutin
+****************************************************/
+#ifndef FISCALDOC_H
+#define FISCALDOC_H
+
+#include <stdint.h>
+
+#define FDOC_TEXT_MAX  40 // printer's line length
+#define FDOC_LINES_MAX 8 // header or footer lines
+#define FDOC_POS_MAX   256
+#define FDOC_PAY_KINDS 4 // payment[0] is cash, the rest are the printer's other payment types
+#define FDOC_SUM_MAX   0xFFFFFFFFFFULL // printer's 5 byte field
+
+// document types. the same codes as Shtrih's "open cheque" has
+#define FDOC_SELL    0
+#define FDOC_BUY     1
+#define FDOC_SELLRET 2
+#define FDOC_BUYRET  3
+
+typedef struct t_fiscal_pos
+{
+  uint64_t qty; // 1/1000 of unit
+  uint64_t price; // kopecks
+  int division; // 0..16
+  int tax[4]; // tax group indexes 0..4. 0 - none
+  char text[FDOC_TEXT_MAX + 1];
+} t_fiscal_pos;
+
+// single malloc'd block, so it is freed as job's data
+typedef struct t_fiscal_doc
+{
+  int type; // FDOC_*. -1 until TYPE line
+  long password; // operator's. -1 - driver's configured one
+  int header_count, footer_count;
+  char header[FDOC_LINES_MAX][FDOC_TEXT_MAX + 1]; // printed before document is opened
+  char footer[FDOC_LINES_MAX][FDOC_TEXT_MAX + 1]; // printed before document is closed
+  uint64_t payment[FDOC_PAY_KINDS]; // kopecks. all zero - exact cash
+  int64_t declared_total; // TOTAL line, kopecks. -1 if none
+  uint64_t total; // kopecks. sum of positions as printer counts it, set by fdoc_validate()
+  int pos_count, pos_size;
+  t_fiscal_pos pos[]; // pos_size allocated
+} t_fiscal_doc;
+
+#ifndef FISCALDOC_C
+extern t_fiscal_doc *fdoc_new(void); // empty document
+extern int fdoc_parse_line(t_fiscal_doc **doc, char *line); // adds TRANSACTION's data line. doc can be re-allocated. returns boolean
+extern int fdoc_validate(t_fiscal_doc *doc); // checks completeness and totals. returns boolean
+#endif
+
+#endif
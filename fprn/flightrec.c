@@ -0,0 +1,316 @@
+/** \file flightrec.c
+* \brief Fiscal printers daemon's flight recorder: per-device ring buffer of serial frames and protocol events
+*
+* V1.200. Written by Andrej Pakhutin
+*
+* Always-on binary trace of the serial exchange. Recording is a clock read and memcpy under device's ring lock,
+* nothing is formatted on the way. The oldest records are overwritten.
+* Ring is dumped to file in statedir by FLIGHTREC command or SIGUSR2. "fprn -r file" decodes the dump.
+* See flightrec.h for the file format.
+****************************************************/
+#define FLIGHTREC_C
+#include "fprnconfig.h"
+#include "flightrec.h"
+#include "printers_common.h"
+#include <time.h>
+
+int flightrec_size = 65536;
+
+typedef struct t_flightrec
+{
+  pthread_mutex_t lock; // worker writes, event loop dumps
+  unsigned char *ring;
+  uint32_t size;
+  uint64_t head, tail; // total bytes written and the start of the oldest record. ring index is modulo size
+  uint32_t seq; // number of the next record
+} t_flightrec;
+
+//=======================================================================
+/** \brief Allocates device's ring if recorder is on
+ *
+ * \param dev struct t_device * - device
+ * \return void
+*/
+void flightrec_init(struct t_device *dev)
+{
+  t_flightrec *fr;
+
+  dev->flightrec = NULL;
+
+  if ( flightrec_size == 0 )
+    return;
+
+  fr = getmem(sizeof(t_flightrec), "flightrec_init: malloc");
+  fr->ring = getmem(flightrec_size, "flightrec_init: malloc ring");
+  fr->size = flightrec_size;
+  fr->head = fr->tail = 0;
+  fr->seq = 0;
+  pthread_mutex_init(&fr->lock, NULL);
+
+  dev->flightrec = fr;
+}
+
+//=======================================================================
+/** \brief Internal. Copies data into the ring at its head
+ *
+ * \param fr t_flightrec * - ring. locked
+ * \param data const void * - data
+ * \param len uint32_t - its length
+ * \return void
+*/
+static void ring_put(t_flightrec *fr, const void *data, uint32_t len)
+{
+  uint32_t pos, n;
+
+  pos = fr->head % fr->size;
+  n = ( fr->size - pos < len ) ? fr->size - pos : len;
+
+  memcpy(fr->ring + pos, data, n);
+  memcpy(fr->ring, (const unsigned char *)data + n, len - n);
+
+  fr->head += len;
+}
+
+//=======================================================================
+/** \brief Internal. Copies data out of the ring
+ *
+ * \param fr t_flightrec * - ring. locked
+ * \param at uint64_t - position in total bytes count
+ * \param data void * - destination
+ * \param len uint32_t - its length
+ * \return void
+*/
+static void ring_get(t_flightrec *fr, uint64_t at, void *data, uint32_t len)
+{
+  uint32_t pos, n;
+
+  pos = at % fr->size;
+  n = ( fr->size - pos < len ) ? fr->size - pos : len;
+
+  memcpy(data, fr->ring + pos, n);
+  memcpy((unsigned char *)data + n, fr->ring, len - n);
+}
+
+//=======================================================================
+/** \brief Records an event with data
+ *
+ * \param dev struct t_device * - device
+ * \param type int - FR_*
+ * \param data const void * - payload
+ * \param len int - its length. cut to FR_MAX_PAYLOAD
+ * \return void
+ *
+ * Called from worker thread on each serial IO, so it is kept cheap
+*/
+void flightrec_add(struct t_device *dev, int type, const void *data, int len)
+{
+  t_flightrec *fr;
+  t_fr_record_hdr rh;
+  t_fr_record_hdr old;
+  struct timespec ts;
+
+  if ( NULL == (fr = dev->flightrec) || len < 0 )
+    return;
+
+  if ( len > FR_MAX_PAYLOAD )
+    len = FR_MAX_PAYLOAD;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rh.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  rh.len = len;
+  rh.type = type;
+  rh.dev_state = DEV_STATE(dev);
+
+  pthread_mutex_lock(&fr->lock);
+
+  rh.seq = fr->seq++;
+
+  // dropping the oldest records to make room
+  while ( fr->head + sizeof(rh) + len - fr->tail > fr->size )
+  {
+    ring_get(fr, fr->tail, &old, sizeof(old));
+    fr->tail += sizeof(old) + old.len;
+  }
+
+  ring_put(fr, &rh, sizeof(rh));
+  ring_put(fr, data, len);
+
+  pthread_mutex_unlock(&fr->lock);
+}
+
+//=======================================================================
+/** \brief Records text event. For errors and protocol events, not for the data path
+ *
+ * \param dev struct t_device * - device
+ * \param type int - FR_ERROR or FR_EVENT
+ * \param fmt const char * - printf-like format
+ * \param ... - its args
+ * \return void
+*/
+void flightrec_event(struct t_device *dev, int type, const char *fmt, ...)
+{
+  va_list vl;
+  char buf[256];
+  int len;
+
+  if ( dev->flightrec == NULL )
+    return;
+
+  va_start(vl, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, vl);
+  va_end(vl);
+
+  if ( len >= (int)sizeof(buf) )
+    len = sizeof(buf) - 1;
+
+  flightrec_add(dev, type, buf, len);
+}
+
+//=======================================================================
+/** \brief Writes device's ring to file in statedir
+ *
+ * \param dev struct t_device * - device
+ * \param path char * - buffer for the file name
+ * \param path_size size_t - its size
+ * \return int - boolean success
+ *
+ * File is named flightrec-<date-time>.<tty name>. Ring is copied under lock and written after
+*/
+int flightrec_dump(struct t_device *dev, char *path, size_t path_size)
+{
+  t_flightrec *fr;
+  t_fr_file_hdr fh;
+  unsigned char *data;
+  char kind[64];
+  time_t now;
+  FILE *f;
+  int ok;
+
+  if ( NULL == (fr = dev->flightrec) )
+    return 0;
+
+  now = time(NULL);
+  strftime(kind, sizeof(kind), "flightrec-%Y%m%d-%H%M%S", localtime(&now));
+
+  if ( ! dev_state_path(dev, kind, path, path_size) )
+    return 0;
+
+  memset(&fh, 0, sizeof(fh));
+  memcpy(fh.magic, FLIGHTREC_MAGIC, sizeof(fh.magic));
+  fh.dev_id = dev->id;
+  strncpy(fh.tty, dev->tty, sizeof(fh.tty) - 1);
+
+  data = getmem(fr->size, "flightrec_dump: malloc");
+
+  pthread_mutex_lock(&fr->lock);
+  fh.data_len = fr->head - fr->tail;
+  ring_get(fr, fr->tail, data, fh.data_len);
+  pthread_mutex_unlock(&fr->lock);
+
+  if ( NULL == (f = fopen(path, "w")) )
+  {
+    dosyslog(LOG_ERR, "flightrec_dump: dev %d: fopen(%s): %m", dev->id, path);
+    free(data);
+    return 0;
+  }
+
+  ok = ( 1 == fwrite(&fh, sizeof(fh), 1, f) && fh.data_len == fwrite(data, 1, fh.data_len, f) );
+
+  if ( 0 != fclose(f) || ! ok )
+  {
+    dosyslog(LOG_ERR, "flightrec_dump: dev %d: write to %s: %m", dev->id, path);
+    ok = 0;
+  }
+
+  free(data);
+
+  if ( ok )
+    dosyslog(LOG_NOTICE, "flightrec: dev %d: %u bytes dumped to %s", dev->id, fh.data_len, path);
+
+  return ok;
+}
+
+//=======================================================================
+/** \brief Writes rings of all devices
+ *
+ * \param void
+ * \return void
+*/
+void flightrec_dump_all(void)
+{
+  char path[1024];
+  int i;
+
+  for ( i = 0; i < devices_count; ++i )
+    flightrec_dump(&devices[i], path, sizeof(path));
+}
+
+//=======================================================================
+/** \brief Prints dump file in human readable form to stdout
+ *
+ * \param file const char * - dump file name
+ * \return int - boolean success
+*/
+int flightrec_decode(const char *file)
+{
+  static const char *types[] = { "?", "TX", "RX", "TIMEOUT", "ERROR", "EVENT" };
+  t_fr_file_hdr fh;
+  t_fr_record_hdr rh;
+  unsigned char data[FR_MAX_PAYLOAD + 1];
+  int32_t tmo[3];
+  uint32_t done;
+  char tstr[32];
+  time_t t;
+  FILE *f;
+
+  if ( NULL == (f = fopen(file, "r")) )
+  {
+    perror(file);
+    return 0;
+  }
+
+  if ( 1 != fread(&fh, sizeof(fh), 1, f) || 0 != memcmp(fh.magic, FLIGHTREC_MAGIC, sizeof(fh.magic)) )
+  {
+    fprintf(stderr, "%s: not a flight recorder dump\n", file);
+    fclose(f);
+    return 0;
+  }
+
+  fh.tty[sizeof(fh.tty) - 1] = '\0';
+  printf("device %d, tty %s, %u bytes of records\n", fh.dev_id, fh.tty, fh.data_len);
+
+  for ( done = 0; done < fh.data_len; done += sizeof(rh) + rh.len )
+  {
+    if ( 1 != fread(&rh, sizeof(rh), 1, f) || rh.len > FR_MAX_PAYLOAD || rh.len != fread(data, 1, rh.len, f) )
+    {
+      fprintf(stderr, "%s: truncated or broken at offset %u\n", file, done);
+      fclose(f);
+      return 0;
+    }
+
+    t = rh.usec / 1000000;
+    strftime(tstr, sizeof(tstr), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%s.%06u #%u state %u %s", tstr, (unsigned)(rh.usec % 1000000), rh.seq, rh.dev_state, types[rh.type <= FR_EVENT ? rh.type : 0]);
+
+    if ( rh.type == FR_TX || rh.type == FR_RX )
+    {
+      printf(" %u bytes:%c", rh.len, (rh.len > 16 || rh.len == 0 ? '\n' : ' '));
+      fflush(stdout);
+      memdumpfd(fileno(stdout), data, rh.len);
+    }
+    else if ( rh.type == FR_TIMEOUT && rh.len == sizeof(tmo) )
+    {
+      memcpy(tmo, data, sizeof(tmo));
+      printf(" wanted %d, got %d bytes in %d msec\n", tmo[0], tmo[1], tmo[2]);
+    }
+    else
+    {
+      data[rh.len] = '\0';
+      printf(": %s\n", data);
+    }
+  }
+
+  fclose(f);
+
+  return 1;
+}
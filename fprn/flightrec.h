@@ -0,0 +1,56 @@
+/** \file flightrec.h
+* \brief Fiscal printers daemon's flight recorder: per-device ring buffer of serial frames and protocol events
+*
+* V1.200. Written by Andrej Pakhutin
+****************************************************/
+#ifndef FLIGHTREC_H
+#define FLIGHTREC_H
+
+#include <stdint.h>
+
+/* dump file format. all numbers are in host byte order:
+   t_fr_file_hdr, then records from the oldest one: t_fr_record_hdr and len bytes of payload right after it
+*/
+#define FLIGHTREC_MAGIC "FPRNFR01"
+
+typedef struct t_fr_file_hdr
+{
+  char magic[8]; // FLIGHTREC_MAGIC
+  int32_t dev_id;
+  uint32_t data_len; // bytes of records that follow
+  char tty[64]; // zero-terminated, may be cut
+} t_fr_file_hdr;
+
+typedef struct t_fr_record_hdr
+{
+  uint64_t usec; // wall clock, usec since the Epoch
+  uint32_t seq; // record number. gaps are not possible in dump, but the first one shows how many were overwritten
+  uint16_t len; // payload bytes
+  uint8_t type; // FR_*
+  uint8_t dev_state; // device's state at the time. see STATE_*
+} t_fr_record_hdr;
+
+// record types and their payload
+#define FR_TX      1 // bytes written to printer
+#define FR_RX      2 // bytes read from printer
+#define FR_TIMEOUT 3 // read is timed out: int32 bytes wanted, int32 bytes got, int32 timeout msec
+#define FR_ERROR   4 // text. IO errors
+#define FR_EVENT   5 // text. protocol events from driver, like bad CRC
+
+#define FR_MAX_PAYLOAD 512 // longer data is cut
+
+struct t_device;
+
+#ifndef FLIGHTREC_C
+extern int flightrec_size; // bytes of ring per device. 0 - off. "flightrec" config keyword
+
+extern void flightrec_init(struct t_device *dev); // allocates device's ring if it is on
+extern void flightrec_add(struct t_device *dev, int type, const void *data, int len);
+extern void flightrec_event(struct t_device *dev, int type, const char *fmt, ...); // formatted FR_ERROR/FR_EVENT
+// writes device's ring to statedir. path gets the file name. returns boolean success
+extern int flightrec_dump(struct t_device *dev, char *path, size_t path_size);
+extern void flightrec_dump_all(void); // used on SIGUSR2
+extern int flightrec_decode(const char *file); // prints dump file to stdout. "fprn -r". returns boolean success
+#endif
+
+#endif
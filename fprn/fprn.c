@@ -6,7 +6,12 @@
 ****************************************************/
 #define FPRN_C
 #include "fprnconfig.h"
+#include "devworker.h"
+#include "cmdstats.h"
+#include "flightrec.h"
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -14,27 +19,43 @@
 #include <unistd.h>
 
 //************ Prototypes ***************
-void timer_event(int a); // sigalarm
-void open_ports(void); // initializes the devices
+void open_ports(void); // queues initialization of the devices to their workers
+void device_plan(struct t_device *dev); // arms device's timer for the next re-init attempt or status poll
+void listener_event(int fd, uint32_t events, void *data); // accepts new tcp connections
+void tcp_conn_event(int fd, uint32_t events, void *data); // data or hang up on tcp connection
+void tcp_connection_opened(int conn_idx); // ap_tcp_open_hook. adds connection to event loop
+void tcp_connection_closed(int conn_idx); // ap_tcp_close_hook. drops connection from event loop
+void device_job_done(t_dev_job *job); // device worker finished the job
+void signal_event(int fd, uint32_t events, void *data); // SIGUSR1: statistics dump, SIGUSR2: flight recorder dump, SIGTERM/SIGINT: shutdown
+static void shutdown_begin(void); // asks device drivers to save their state and exits when they are done
+static void shutdown_timer(ap_evloop_timer_t *timer, void *data); // drivers are not done in time. exit anyway
+static void device_timer(ap_evloop_timer_t *timer, void *data); // device re-init attempt or status poll is due
+extern void tcp_answer_init(void);
 extern void tcp_answer(int idx); // answering PHP side inquiries. idx is dev index
-void tcp_close_connection(int idx, char *msg); // close tcp connection by index, msg !=NULL to post some answer before close
+extern int tcp_answer_pending(int idx); // connection waits for device's answer
+extern void tcp_session_reset(int idx);
+extern void tcp_peer_closed(int idx); // peer will not send anymore. close after answers are delivered
+extern void tcp_job_done(t_dev_job *job); // sends the job's result to the peer
+
+static int lsock; // listener socket
+static int sigfd; // signalfd for the signals handled in event loop
+static int shutdown_pending = -1; // DEVJOB_SHUTDOWN jobs not finished yet. -1 if shutdown is not started
+static ap_evloop_timer_t shutdown_deadline;
+
+#define SHUTDOWN_TIMEOUT 15000 // msec to wait for the drivers. busy printer could hold the worker for a while
 
 //=======================================================================
 int main(int argc, char **argv)
 {
-  struct itimerval timer_val;
-  int lsock; // listener socket
   int n;
   FILE *fpidf; // /var/run/PID
   struct sigaction sigact;
+  sigset_t sigmask;
 
   openlog(NULL, LOG_PID, LOG_DAEMON);
   getconfig(argc, argv);
 
-  if (debug_level)
-    debuglog("Initializing ports\n");
-
-  open_ports();
+  tcp_answer_init();
 
   if ( -1 == ( lsock = socket( AF_INET, SOCK_STREAM, 0 ) ) )
   {
@@ -58,6 +79,14 @@ int main(int argc, char **argv)
     sleep(bind_retry_sleep);
   }
 
+  if ( listen( lsock, (listen_backlog > 0 ? listen_backlog : ap_tcp_max_connections) ) )
+  {
+    dosyslog(LOG_ERR, "listen(): %m");
+    exit(1);
+  }
+
+  fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+
   //*******************************************
 
   if ( daemonize && (debug_to_tty == 0) ) // daemonizing
@@ -80,7 +109,6 @@ int main(int argc, char **argv)
     }
   }
 
-  signal(SIGALRM, timer_event);
   signal(SIGHUP, SIG_IGN); // maybe should re-read config on it
 
   sigact.sa_handler = ap_tcp_check_conns;
@@ -93,39 +121,61 @@ int main(int argc, char **argv)
     exit(1);
   }
 
-  if (debug_level) debuglog("Entering main loop\n");
+  if ( ! ap_evloop_init() )
+    exit(1);
 
-  // setting timer for looking at activity on ports
-  timer_val.it_interval.tv_sec = 0;
-  timer_val.it_interval.tv_usec = 0;
-  timer_val.it_value.tv_sec = 0;
-  timer_val.it_value.tv_usec = poll_freq;
-  setitimer(ITIMER_REAL, &timer_val, NULL);
+  ap_tcp_open_hook = tcp_connection_opened;
+  ap_tcp_close_hook = tcp_connection_closed;
 
-  //-------------------------------------------
-  // tcp listener loop
-  for(;;)
+  if ( ! ap_evloop_add(lsock, EPOLLIN, listener_event, NULL) )
+    exit(1);
+
+  // blocked before workers are started, so they inherit the mask and signal is read in event loop only
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGUSR1);
+  sigaddset(&sigmask, SIGUSR2);
+  sigaddset(&sigmask, SIGTERM);
+  sigaddset(&sigmask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+  if ( -1 == (sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC)) )
   {
-    int tcpci; // conn index
+    dosyslog(LOG_ERR, "signalfd(): %m");
+    exit(1);
+  }
 
-    if ( listen( lsock, ap_tcp_max_connections ) )
-    {
-      dosyslog(LOG_ERR, "listen(): %m");
+  if ( ! ap_evloop_add(sigfd, EPOLLIN, signal_event, NULL) )
+    exit(1);
+
+  // printer IO and event loop only queue the log records from now on
+  if ( ! ap_log_async_start() )
+    dosyslog(LOG_ERR, "logging stays synchronous");
+
+  // workers are started after fork as threads are not surviving it
+  if ( ! devworker_module_init(device_job_done) )
+    exit(1);
+
+  for ( n = 0; n < devices_count; ++n )
+    if ( ! devworker_start(&devices[n]) )
       exit(1);
-    }
 
-    for (tcpci = 0; tcpci < ap_tcp_max_connections; ++tcpci) // finding free slot
-      if (ap_tcp_connections[tcpci].fd == 0)
-        break;
+  // listener is up already, so clients are answered while printers are looked for
+  if (debug_want(1))
+    debuglog("Initializing ports\n");
 
-    if (tcpci == ap_tcp_max_connections)
-      continue; // no free slots - loop to wait
+  open_ports();
 
-    if ( ! ap_tcp_accept_connection(lsock) )
-      continue;
+  if (debug_want(1)) debuglog("Entering main loop\n");
 
-    ap_tcp_connections[tcpci].state = TC_ST_READY;
-  } // for(;;) - listen...
+  ap_log_context(LOGCAT_TCP, 0); // event loop is all about clients from now on
+
+  //-------------------------------------------
+  // event loop. all tcp and device work is done from handlers
+  for(;;)
+  {
+    if ( -1 == ap_evloop_run(-1) )
+      exit(1);
+  }
 
   closelog();
   return 0;
@@ -137,148 +187,259 @@ int main(int argc, char **argv)
  * \param void
  * \return void
  *
- * Calls initialization for all configured devices
+ * Queues initialization of all configured devices to their workers, so the slow speed scans go in parallel
+ * and event loop is running meanwhile. Device commands are answered with "407 device initializing" until it is done.
+ * if there is error init printer then we'll try to reconnect in the background
 */
 void open_ports (void)
 {
-  int i, errcode;
+  int i;
 
   for ( i = 0; i < devices_count; ++i )
   {
-    errcode = devices[i].device_type->func_port_init(devices[i].id);
-    // if there is error init printer then we'll try to reconnect in the background
-
-    if (errcode == 0)
-    {
-      if (debug_level) debuglog("port %s initialized\n", devices[i].tty);
-    }
-    else devices[i].state = STATE_NEEDRECONNECT;
+    ap_evloop_timer_init(&devices[i].timer, device_timer, &devices[i]);
+    devices[i].init_queued = 1;
+    devworker_submit(devjob_new(DEVJOB_INIT, &devices[i]));
   }
 }
 
 //=======================================================================
+/** \brief Event loop handler for the listener socket
+ *
+ * \param fd int - listener socket
+ * \param events uint32_t - EPOLL* mask
+ * \param data void* - unused
+ * \return void
+ *
+ * Accepts all pending connections. If the slots are exhausted then newcomers wait in admission queue
+ * and get the slot as soon as it is freed, see tcp_connection_opened(). Overflow is answered with "409 busy" at once.
+*/
+void listener_event(int fd, uint32_t events, void *data)
+{
+  while ( -1 != ap_tcp_accept_connection(lsock) );
+}
+
 //=======================================================================
+/** \brief ap_tcp_open_hook implementation. Connection got a slot, either at once or from admission queue
+ *
+ * \param conn_idx int - connection index
+ * \return void
+*/
+void tcp_connection_opened(int conn_idx)
+{
+  ap_evloop_add(ap_tcp_connections[conn_idx].fd, EPOLLIN | EPOLLRDHUP, tcp_conn_event, &ap_tcp_connections[conn_idx]);
+}
+
 //=======================================================================
-/** \brief Called periodically to process data on serial ports
+/** \brief Event loop handler for the signals delivered through signalfd
  *
- * \param a int - dummy for sigalarm compatibility
+ * \param fd int - signalfd
+ * \param events uint32_t - EPOLL* mask
+ * \param data void* - unused
  * \return void
  *
- * Queries configured serial ports for new data coming from printers.
- * Resets printer's state in case of comm errors.
- * After checking the printers, looks at opened TCP connections
- * processing expiration and errors.
+ * SIGUSR1 dumps the printer commands latency statistics to syslog
+ * SIGUSR2 dumps flight recorders of all devices to statedir
+ * SIGTERM and SIGINT are graceful shutdown: drivers' state is saved first
 */
-void timer_event(int a)
+void signal_event(int fd, uint32_t events, void *data)
 {
-static int rotator = 0;
-int i, ii, n, errcode;
-fd_set fds;
-struct timeval tv;
-struct itimerval timer_val;
+  struct signalfd_siginfo si;
 
-  // checking devices state
-  for ( i = 0; i < devices_count; ++i )
+  while ( sizeof(si) == read(fd, &si, sizeof(si)) )
   {
-    for (n = 0; n < ap_tcp_max_connections; ++n) // do not try to re-init stale printer if there is connections active
-      if ( ap_tcp_connections[n].fd != 0 )
-        break;
-
-    gettimeofday(&tv, NULL);
+    if ( si.ssi_signo == SIGUSR1 )
+      cmdstats_dump();
+    else if ( si.ssi_signo == SIGUSR2 )
+      flightrec_dump_all();
+    else if ( si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT )
+      shutdown_begin();
+  }
+}
 
-    if (devices[i].state == STATE_NEEDRECONNECT && timercmp(&tv, &devices[i].next_attempt, >= ))
-    {
-      dosyslog(LOG_NOTICE, "fprn timer_event: re-init of dev %d (%s) requested", devices[i].id, devices[i].tty);
+//=======================================================================
+/** \brief Starts graceful shutdown
+ *
+ * \param void
+ * \return void
+ *
+ * Shutdown job is queued behind the jobs that are in device's queue already, so the command in progress is completed.
+ * Program exits when all workers are done with it or SHUTDOWN_TIMEOUT expires. exit() flushes the log queue.
+*/
+static void shutdown_begin(void)
+{
+  int i;
 
-      errcode = devices[i].device_type->func_port_init(devices[i].id);
+  if ( shutdown_pending != -1 ) // repeated signal
+    return;
 
-      if (errcode == 0)
-      {
-        if (debug_level) debuglog("port %s re-initialized\n", devices[i].tty);
-      }
-      else
-      {
-        devices[i].state = STATE_NEEDRECONNECT;
-      }
+  dosyslog(LOG_NOTICE, "shutdown requested");
 
-      gettimeofday(&devices[i].next_attempt, NULL);
+  if ( devices_count == 0 )
+    exit(0);
 
-      devices[i].next_attempt.tv_sec += 9;
-    }
-  } // for ( i = 0; i < devices_count; ++i )
+  shutdown_pending = devices_count;
 
-  /*++++++++++++++++++++++++++++++++++++++++++++++++++
-    checking TCP connections for activity and timeouts
-  */
-  FD_ZERO(&fds);
-  n = 0;
+  for ( i = 0; i < devices_count; ++i )
+    devworker_submit(devjob_new(DEVJOB_SHUTDOWN, &devices[i]));
 
-  for (i = 0; i < ap_tcp_max_connections; ++i)
-  {
-    if ( ap_tcp_connections[i].fd == 0 )
-      continue;
+  ap_evloop_timer_init(&shutdown_deadline, shutdown_timer, NULL);
+  ap_evloop_timer_start(&shutdown_deadline, SHUTDOWN_TIMEOUT);
+}
 
-    gettimeofday(&tv, NULL);
+//=======================================================================
+static void shutdown_timer(ap_evloop_timer_t *timer, void *data)
+{
+  dosyslog(LOG_ERR, "shutdown: %d device(s) did not finish in %d msec. exiting anyway", shutdown_pending, SHUTDOWN_TIMEOUT);
+  exit(0);
+}
 
-    if ( timercmp(&tv, &ap_tcp_connections[i].expire, >=) )//session expired. closing
-    {
-      ap_tcp_close_connection(i, NULL/*"\n401 Session Expired\n"*/);
+//=======================================================================
+/** \brief Event loop handler for the client connections
+ *
+ * \param fd int - connection socket
+ * \param events uint32_t - EPOLL* mask
+ * \param data void* - ptr to ap_tcp_connection_t of this socket
+ * \return void
+*/
+void tcp_conn_event(int fd, uint32_t events, void *data)
+{
+  struct ap_tcp_connection_t *tc;
 
-      for(ii = 0; ii < devices_count; ++ii)
-      {
-        if (devices[ii].tcpconn == &ap_tcp_connections[i] )
-        {
-          devices[ii].tcpconn = NULL;
-          break;
-        }
-      }
+  tc = (struct ap_tcp_connection_t *)data;
 
-      if (debug_level)
-        debuglog("\n%d Session Expired\n", i);
+  if ( events & EPOLLOUT ) // socket has room for the queued rest of answer
+    ap_tcp_conn_flush(tc->idx);
 
-      continue;
-    }
+  if ( tc->fd == fd && (events & EPOLLIN) )
+    tcp_answer(tc->idx);
 
-    FD_SET(ap_tcp_connections[i].fd, &fds);
+  if ( tc->fd != fd || ! (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) )
+    return;
 
-    if ( n < ap_tcp_connections[i].fd ) n = ap_tcp_connections[i].fd + 1;
+  // peer has shut down its sending side only. the answer still can be delivered
+  if ( ! (events & (EPOLLHUP | EPOLLERR)) )
+  {
+    tcp_peer_closed(tc->idx);
+    return;
   }
 
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
+  // peer is gone. the last command is processed already if it was there
+  ap_tcp_close_connection(tc->idx, NULL);
+}
 
-  n = select(n, &fds, NULL, NULL, &tv);
+//=======================================================================
+/** \brief ap_tcp_close_hook implementation. Called right before connection's socket is closed
+ *
+ * \param conn_idx int - connection index
+ * \return void
+*/
+void tcp_connection_closed(int conn_idx)
+{
+  ap_evloop_del(ap_tcp_connections[conn_idx].fd);
+  tcp_session_reset(conn_idx);
+}
 
-  if (n < 0)
-    dosyslog(LOG_ERR, "select(): %m");
+//=======================================================================
+/** \brief Called from event loop for each job finished by device workers
+ *
+ * \param job t_dev_job * - finished job or NULL at the end of batch
+ * \return void
+ *
+ * Also used by workers to report device's state change, such as line hang up
+*/
+void device_job_done(t_dev_job *job)
+{
+  int i;
+  struct t_device *dev;
 
-  if (n <= 0)
-    goto end; // error or no data available yet
+  if ( job == NULL ) // worker could flag the line hang up without a job
+  {
+    for ( i = 0; i < devices_count; ++i )
+      device_plan(&devices[i]);
+
+    return;
+  }
+
+  dev = job->dev;
 
-  // running answering machine
-  for (i = 0; i < ap_tcp_max_connections; ++i)
+  if ( job->type == DEVJOB_INIT || job->type == DEVJOB_GETSTATE ) // status snapshot is refreshed by both
+    dev->status_next_poll = ap_evloop_now() + (uint64_t)status_poll_interval * 1000000;
+
+  if ( job->type == DEVJOB_SHUTDOWN )
   {
-    if ( ap_tcp_connections[i].fd != 0 && FD_ISSET(ap_tcp_connections[i].fd, &fds) )
-      tcp_answer(i);
+    devjob_free(job);
+
+    if ( --shutdown_pending == 0 )
+    {
+      dosyslog(LOG_NOTICE, "shutdown: all devices are done. exiting");
+      exit(0);
+    }
+
+    return;
   }
 
-end:
-  if (debug_to_tty && debug_level)
+  if ( job->type == DEVJOB_INIT )
   {
-    fprintf(stderr,"%c\r", "/-\\|"[rotator]);
-    if (++rotator == 4) rotator = 0;
+    dev->init_queued = 0;
+    devjob_free(job);
+    device_plan(dev);
+    return;
   }
 
-  // ...and in the end... plan next call
-  //signal(SIGALRM, timer_event);
-  timer_val.it_interval.tv_sec = 0;
-  timer_val.it_interval.tv_usec = 0;
-  timer_val.it_value.tv_sec = 0;
-  timer_val.it_value.tv_usec = poll_freq;
+  if ( job->type == DEVJOB_GETSTATE && job->conn_idx == -1 ) // background poll. peers could attach to it
+    dev->status_poll_queued = 0;
+
+  tcp_job_done(job);
+  device_plan(dev);
+}
 
-  if ( -1 == setitimer(ITIMER_REAL, &timer_val, NULL))
+//=======================================================================
+/** \brief Arms device's timer to the next re-init attempt or background status poll
+ *
+ * \param dev struct t_device * - device
+ * \return void
+ *
+ * Timer is disarmed while worker owns the device for re-init or status query is in the queue:
+ * device_job_done() calls us again when it is done. Idle daemon is not woken up at all.
+*/
+void device_plan(struct t_device *dev)
+{
+  if ( dev->init_queued )
+    ap_evloop_timer_stop(&dev->timer);
+  else if ( DEV_STATE(dev) == STATE_NEEDRECONNECT )
+    ap_evloop_timer_at(&dev->timer, dev->next_attempt);
+  else if ( status_poll_interval != 0 && ! dev->status_poll_queued && dev->status_job == NULL )
+    ap_evloop_timer_at(&dev->timer, dev->status_next_poll);
+  else
+    ap_evloop_timer_stop(&dev->timer);
+}
+
+//=======================================================================
+/** \brief Device's timer handler. Queues re-init of printer in case of comm errors, or background status query
+ *
+ * \param timer ap_evloop_timer_t * - device's timer
+ * \param data void* - ptr to t_device
+ * \return void
+*/
+static void device_timer(ap_evloop_timer_t *timer, void *data)
+{
+  struct t_device *dev;
+
+  dev = (struct t_device *)data;
+
+  if ( DEV_STATE(dev) == STATE_NEEDRECONNECT )
   {
-    dosyslog(LOG_ERR, "setitimer(): %m");
-    exit(1);
+    dev->init_queued = 1;
+    devworker_submit(devjob_new(DEVJOB_INIT, dev));
+    return;
+  }
+
+  // peer's query in flight will do otherwise. we are re-planned when it is done
+  if ( status_poll_interval != 0 && ! dev->status_poll_queued && dev->status_job == NULL )
+  {
+    dev->status_poll_queued = 1;
+    dev->status_job = devjob_new(DEVJOB_GETSTATE, dev);
+    devworker_submit(dev->status_job);
   }
 }
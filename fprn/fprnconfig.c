@@ -5,24 +5,35 @@
 ****************************************************/
 #define FPRNCONFIG_C
 #include "fprnconfig.h"
+#include "flightrec.h"
 
 const int DEFAULTADDR = INADDR_LOOPBACK; // TCP listener default addr
 const int DEFAULTPORT = 2011;            // TCP listener default port
 struct sockaddr_in bind_sock;
 int bind_retries, bind_retry_sleep;
+int listen_backlog = 0; // 0 - same as maxtcpsessions
 
 const char *DEFAULTCONFIGFILE = "/etc/fprn/fprn.conf";
 char *CONFIGFILE = NULL;
 const char *default_pid_file = "/var/run/fprn.pid";
 char *pidfile = NULL;
+const char *default_state_dir = "/var/lib/fprn";
+char *state_dir = NULL; // small files with per-device state to survive restarts
 
 int history_lock = 0; // simple varlock
 
+int job_keep_time; // seconds to keep the results of SUBMIT'ted jobs
+int status_poll_interval; // seconds between background status queries of idle device. 0 - off
+int lease_timeout; // seconds of holder's silence after that device's lease is revoked
+
 // devices
 int devices_count; // attached devices count
-struct t_device devices[MAXDEVS];
+struct t_device *devices = NULL; // grows on 'device' config lines only, so the pointers to its items are stable after config is read
+static int devices_alloc = 0; // allocated items in devices[]
 
-int poll_freq = 100000; // sleep time between polls (us)
+// device id lookup. open addressing hash of device index + 1, 0 is empty slot. size is power of 2 and at least twice the devices_count
+static int *dev_id_hash = NULL;
+static unsigned dev_id_hash_mask = 0;
 
 int daemonize = 0;
 
@@ -54,6 +65,8 @@ extern int maria301_parse_options(int device_index, char *opt);
 extern int shtrih_ltfrk_port_init(int devid);
 extern int shtrih_ltfrk_get_state(int devid);
 extern int shtrih_ltfrk_send_command(int devid, char *data, size_t size);
+extern int shtrih_ltfrk_transaction(int devid, struct t_fiscal_doc *doc);
+extern int shtrih_ltfrk_shutdown(int devid);
 extern int shtrih_ltfrk_register_device(int device_index);
 extern int shtrih_ltfrk_parse_options(int device_index, char *opt);
 #endif
@@ -72,64 +85,147 @@ const struct t_device_type device_types[] =
   {
      DEVICE_TYPE_MARIA301, "maria301", "Maria 301MTM (firmware M301T7)",
 #ifdef DRIVER_MARIA301
-     maria301_port_init, maria301_get_state, maria301_send_command
+     maria301_port_init, maria301_get_state, maria301_send_command, NULL, NULL
 #else
-     NULL, NULL, NULL
+     NULL, NULL, NULL, NULL, NULL
 #endif
   },
 
   {
      DEVICE_TYPE_SHTRIH_LTFRK, "shtrih_ltfrk", "Shtrih-Light-FR-K",
 #ifdef DRIVER_SHTRIH_LTFRK
-     shtrih_ltfrk_port_init, shtrih_ltfrk_get_state, shtrih_ltfrk_send_command
+     shtrih_ltfrk_port_init, shtrih_ltfrk_get_state, shtrih_ltfrk_send_command, shtrih_ltfrk_transaction, shtrih_ltfrk_shutdown
 #else
-     NULL, NULL, NULL
+     NULL, NULL, NULL, NULL, NULL
 #endif
   },
 
   {
      DEVICE_TYPE_INNOVA, "innova", "Innova S.A. (PL) DF-1 FV",
 #ifdef DRIVER_INNOVA
-     innova_port_init, innova_get_state, innova_send_command
+     innova_port_init, innova_get_state, innova_send_command, NULL, NULL
 #else
-     NULL, NULL, NULL
+     NULL, NULL, NULL, NULL, NULL
 #endif
   }
 };
 
 //=============================================================================
-/** \brief returns ptr to device data structure associated with given id
+/** \brief Helper for device id lookups - hash slot to start probing from
+ *
+ * \param id int - device id
+ * \return unsigned - index in dev_id_hash[]
+*/
+static unsigned dev_id_slot(int id)
+{
+  return ((unsigned)id * 2654435761u) & dev_id_hash_mask; // Knuth's multiplicative hash
+}
+
+//=============================================================================
+/** \brief returns index of device data structure associated with given id
  *
  * \param id int - device id to find
- * \return struct t_device *
+ * \return int
  *
 */
-struct t_device *get_dev_by_id(int id)
+int dev_idx_by_id(int id)
 {
-int i;
+unsigned i;
+
+  if ( dev_id_hash == NULL )
+    return -1;
 
-  for (i = 0; i < devices_count; ++i)
-    if ( devices[i].id == id )
-      return &devices[i];
+  for ( i = dev_id_slot(id); dev_id_hash[i] != 0; i = (i + 1) & dev_id_hash_mask )
+    if ( devices[dev_id_hash[i] - 1].id == id )
+      return dev_id_hash[i] - 1;
 
-  return NULL;
+  return -1;
 }
 
-/** \brief returns index of device data structure associated with given id
+//=============================================================================
+/** \brief Adds device to the id lookup hash. Rebuilds it with double size if it is half full
+ *
+ * \param idx int - device index in devices[]. its id must be set already. the ones before are in hash already
+ * \return int - boolean. false if the id is used by other device already
+*/
+static int dev_id_hash_add(int idx)
+{
+unsigned i, slot, size;
+
+  if ( -1 != dev_idx_by_id(devices[idx].id) )
+    return 0;
+
+  if ( dev_id_hash == NULL || (unsigned)(idx + 1) * 2 > dev_id_hash_mask + 1 )
+  {
+    size = ( dev_id_hash == NULL ) ? 16 : (dev_id_hash_mask + 1) * 2;
+
+    free(dev_id_hash);
+    dev_id_hash = getmem(size * sizeof(int), "dev_id_hash_add: malloc");
+    memset(dev_id_hash, 0, size * sizeof(int));
+    dev_id_hash_mask = size - 1;
+
+    for ( i = 0; i < (unsigned)idx; ++i ) // re-adding the ones before
+    {
+      for ( slot = dev_id_slot(devices[i].id); dev_id_hash[slot] != 0; slot = (slot + 1) & dev_id_hash_mask );
+
+      dev_id_hash[slot] = i + 1;
+    }
+  }
+
+  for ( slot = dev_id_slot(devices[idx].id); dev_id_hash[slot] != 0; slot = (slot + 1) & dev_id_hash_mask );
+
+  dev_id_hash[slot] = idx + 1;
+
+  return 1;
+}
+
+//=============================================================================
+/** \brief Allocates new item at the end of devices[] and sets its defaults
+ *
+ * \param void
+ * \return struct t_device * - the new device. devices_count is not changed
+ *
+ * Config reader only. table is moved on growth, so no pointers to its items should be kept yet
+*/
+static struct t_device *device_alloc(void)
+{
+struct t_device *dev;
+
+  if ( devices_count == devices_alloc )
+  {
+    devices_alloc = ( devices_alloc == 0 ) ? 4 : devices_alloc * 2;
+
+    if ( NULL == (devices = realloc(devices, devices_alloc * sizeof(struct t_device))) )
+    {
+      dosyslog(LOG_ERR, "device_alloc: realloc on %d devices: %m", devices_alloc);
+      exit(1);
+    }
+  }
+
+  dev = &devices[devices_count];
+  memset(dev, 0, sizeof(struct t_device));
+
+  dev->id = -1;
+  dev->next_attempt = 0; // due at once
+
+  return dev;
+}
+
+//=============================================================================
+/** \brief returns ptr to device data structure associated with given id
  *
  * \param id int - device id to find
- * \return int
+ * \return struct t_device *
  *
 */
-int dev_idx_by_id(int id)
+struct t_device *get_dev_by_id(int id)
 {
 int i;
 
-  for (i = 0; i < devices_count; ++i)
-    if ( devices[i].id == id )
-      return i;
+  if ( -1 == (i = dev_idx_by_id(id)) )
+    return NULL;
 
-  return -1;
+  return &devices[i];
 }
 
 //----------------------------------------------------------------------
@@ -146,6 +242,7 @@ void help(void)
   -d - daemonize\n\
   -f config_file - use this config (default: %s)\n\
   -v - debug mode. no daemonizing, stderr/debug channel(s) logging also\n\
+  -r dump_file - print flight recorder's dump and exit\n\
   \nLasciate ogni speranza voi ch 'entrate\n",
   compiled_time, CONFIGFILE);
 }
@@ -176,7 +273,7 @@ char *config_parse_get_next_token(int optional)
     printf("! ERROR at line %d: missing arg: %s\n", line, cfg_buf);
     ++errors;
   }
-  //if (debug_level) debuglog("Token: '%s'\n", s);
+  //if (debug_want(1)) debuglog("Token: '%s'\n", s);
 
   return s;
 }
@@ -251,7 +348,7 @@ void getconfig( int argc, char **argv )
 {
 int i, c, n; 
 FILE *cfgh; // config file handle
-char *s;
+char *s, *sp;
 extern char *optarg;
 extern int optind, optopt;
 
@@ -265,22 +362,19 @@ extern int optind, optopt;
 
   makestr(&CONFIGFILE, (char*)DEFAULTCONFIGFILE);
   makestr(&pidfile, (char*)default_pid_file);
+  makestr(&state_dir, (char*)default_state_dir);
 
   devices_count = 0;
-  for ( i = 0; i < MAXDEVS; ++i )
-  {
-    devices[i].tty = NULL;
-    devices[i].id = -1;
-    devices[i].state = 0;
-    devices[i].fd = 0;
-    gettimeofday(&devices[i].next_attempt, NULL);
-  }
 
   max_tcp_conn_time.tv_sec = 2;
   max_tcp_conn_time.tv_usec = 0;
 
+  job_keep_time = 300;
+  status_poll_interval = 60;
+  lease_timeout = 30;
+
   // parsing command line args
-  while( (c = getopt(argc, argv, ":dhvf:") ) != -1)
+  while( (c = getopt(argc, argv, ":dhvf:r:") ) != -1)
   {
     switch( c )
     {
@@ -300,7 +394,10 @@ extern int optind, optopt;
         debug_to_tty = 1;
         break;
 
-      case ':': /* -f without operand */
+      case 'r':
+        exit( flightrec_decode(optarg) ? 0 : 1 );
+
+      case ':': /* -f or -r without operand */
         fprintf(stderr, "Option -%c requires an operand\n", optopt);
         exit(1);
 
@@ -329,7 +426,7 @@ extern int optind, optopt;
     cfg_buf_ptr = cfg_buf;
     s = strsep(&cfg_buf_ptr, " \t\r\n");
 
-    if(debug_level > 10)
+    if(debug_want(11))
       debuglog("> line %d parse start: '%s'\n", line, s);
 
     ++line;
@@ -392,7 +489,7 @@ extern int optind, optopt;
       else
         debug_level = atoi(s);
 
-      if (debug_level)
+      if (debug_want(1))
         debuglog("debug level set to %d\n", debug_level);
     }
     //++++++++++++++++++++++++++++++++++++++++++++
@@ -403,6 +500,8 @@ extern int optind, optopt;
     // "device" keyword may be followed by on or more optional "options" keywords with driver specific settings
     else if ( 0 == strcasecmp(s, "device") )
     {
+      device_alloc();
+
       s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED); // id
 
       if ( 0 == ( n = atoi(s) ) )
@@ -430,11 +529,13 @@ extern int optind, optopt;
       makestr(&devices[devices_count].tty, s);
 
       devices[devices_count].id = n;
-      devices[devices_count].fd = 0;
-      devices[devices_count].state = 0;
-      devices[devices_count].tcpconn = NULL;
-      devices[devices_count].buf_ptr = 0;
-      devices[devices_count].buf_size = 0; // must be altered by driver's init func + buf getmem
+      // the rest is zeroed by device_alloc(). buf_size must be altered by driver's init func + buf getmem
+
+      if ( n != 0 && ! dev_id_hash_add(devices_count) )
+      {
+        fprintf(stderr, "! ERROR at line %d: duplicate ID value: %d\n", line, n);
+        ++errors;
+      }
 
       switch( devices[devices_count].device_type->type )
       {
@@ -457,7 +558,7 @@ extern int optind, optopt;
 #endif
       }
 
-      if (debug_level > 2)
+      if (debug_want(3))
         debuglog("Added device id: %d (%s)\n", devices[devices_count].id, devices[devices_count].tty);
 
       ++devices_count;
@@ -480,7 +581,8 @@ extern int optind, optopt;
     //++++++++++++++++++++++++++++++++++++++++++++
     // options <driver-specific data>
     // can appear next line after 'device' keyword to provide additional options specific to this printer model or instance
-    // parsed within driver
+    // parsed within driver, except the serial port ones that are common for all:
+    //   options lowlatency <bool> - kernel passes received bytes right away. default is off
     else if ( 0 == strcasecmp(s, "options") )
     {
       s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
@@ -490,6 +592,16 @@ extern int optind, optopt;
         fprintf(stderr, "! ERROR at line %d: no devices defined before 'options'\n", line);
         ++errors;
       }
+      else if ( 0 == strcasecmp(s, "lowlatency") )
+      {
+        if ( -1 == (n = config_parse_get_bool()) )
+        {
+          fprintf(stderr, "! ERROR at line %d: bad boolean: %s\n", line, cfg_buf);
+          ++errors;
+        }
+        else
+          devices[devices_count - 1].low_latency = n;
+      }
       else
       {
         switch( devices[devices_count - 1].device_type->type )
@@ -516,7 +628,8 @@ extern int optind, optopt;
     }
     //++++++++++++++++++++++++++++++++++++++++++++
     // polltime <ms>
-    // pause between device and tcp connections polls. Set in milliseconds
+    // obsolete: pause between device and tcp connections polls.
+    // the daemon is event driven now, so value is checked, but not used
     else if ( 0 == strcasecmp(s, "polltime") )
     {
       s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
@@ -560,6 +673,139 @@ extern int optind, optopt;
       max_tcp_conn_time.tv_usec = 0;
     }
     //++++++++++++++++++++++++++++++++++++++++++++
+    // jobkeeptime <seconds>
+    // how long the result of SUBMIT'ted job is available for RESULT command
+    else if ( 0 == strcasecmp(s, "jobkeeptime") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+
+      if ( 0 == ( n = atoi(s) ) || n < 1 || n > 86400)
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, cfg_buf);
+        ++errors;
+      }
+      else
+        job_keep_time = n;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // leasetimeout <seconds>
+    // device's lease is revoked if holder sends no commands for that long
+    else if ( 0 == strcasecmp(s, "leasetimeout") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+
+      if ( 0 == ( n = atoi(s) ) || n < 1 || n > 3600)
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, cfg_buf);
+        ++errors;
+      }
+      else
+        lease_timeout = n;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // statuspoll <seconds>
+    // how often devices are queried for status in background. DEVSTATE with max age is answered from it. 0 - off
+    else if ( 0 == strcasecmp(s, "statuspoll") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+      n = strtol(s, &sp, 10);
+
+      if ( *sp != '\0' || n < 0 || n > 86400 )
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, s);
+        ++errors;
+      }
+      else
+        status_poll_interval = n;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // flightrec <kbytes>
+    // size of each device's flight recorder ring. 0 - off
+    else if ( 0 == strcasecmp(s, "flightrec") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+      n = strtol(s, &sp, 10);
+
+      if ( *sp != '\0' || n < 0 || (n > 0 && n < 4) || n > 65536 )
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, s);
+        ++errors;
+      }
+      else
+        flightrec_size = n * 1024;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // tcpnodelay <bool>
+    // disables Nagle's algorithm on client connections. default is on as each answer is sent with single call
+    else if ( 0 == strcasecmp(s, "tcpnodelay") )
+    {
+      if ( -1 == (n = config_parse_get_bool()) )
+      {
+        fprintf(stderr, "! ERROR at line %d: bad boolean: %s\n", line, cfg_buf);
+        ++errors;
+      }
+      else
+        ap_tcp_nodelay = n;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // listenbacklog <number>
+    // kernel's queue of connections not accepted yet. default is maxtcpsessions
+    else if ( 0 == strcasecmp(s, "listenbacklog") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+
+      if ( 0 == ( n = atoi(s) ) || n < 1 || n > 65535 )
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, cfg_buf);
+        ++errors;
+      }
+      else
+        listen_backlog = n;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // tcpqueue <number> [retry_after_ms]
+    // accepted connections that wait for a free session slot up to tcptimeout.
+    // the rest get "409 busy, retry after N ms" answer. 0 - answer so at once
+    else if ( 0 == strcasecmp(s, "tcpqueue") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+      n = atoi(s);
+
+      if ( n < 0 || n > 65535 || ( n == 0 && *s != '0' ) )
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, cfg_buf);
+        ++errors;
+      }
+      else
+        ap_tcp_queue_size = n;
+
+      if( NULL != (s = config_parse_get_next_token(NEXT_TOKEN_OPTIONAL)) )
+      {
+        if ( 0 >= ( n = atoi(s) ) || n > 3600000 )
+        {
+          fprintf(stderr, "! ERROR at line %d: bad retry time: %s\n", line, cfg_buf);
+          ++errors;
+        }
+        else
+          ap_tcp_retry_after = n;
+      }
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // tcpmaxbuffer <bytes>
+    // connection's input buffer growth limit. it is the max length of command or data line too
+    else if ( 0 == strcasecmp(s, "tcpmaxbuffer") )
+    {
+      s = config_parse_get_next_token(NEXT_TOKEN_REQUIRED);
+
+      if ( 0 == ( n = atoi(s) ) || n < 1024 || n > 67108864)
+      {
+        fprintf(stderr, "! ERROR at line %d: bad number: %s\n", line, cfg_buf);
+        ++errors;
+      }
+      else
+        ap_tcp_max_bufsize = n;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
     // pidfile <path>
     // path to file with PID. default is /var/run/fprn.pid
     else if ( 0 == strcasecmp(s, "pidfile") )
@@ -567,6 +813,13 @@ extern int optind, optopt;
       makestr(&pidfile, (const char*)config_parse_get_next_token(NEXT_TOKEN_REQUIRED));
     }
     //++++++++++++++++++++++++++++++++++++++++++++
+    // statedir <path>
+    // directory for device state files like last connected speed. default is /var/lib/fprn
+    else if ( 0 == strcasecmp(s, "statedir") )
+    {
+      makestr(&state_dir, (const char*)config_parse_get_next_token(NEXT_TOKEN_REQUIRED));
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
     else {
       fprintf(stderr, "Unknown option: %s\n", cfg_buf);
       ++errors;
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -17,6 +18,7 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include "../libs/ap_evloop.h"
 #include "../libs/ap_log.h"
 #include "../libs/ap_str.h"
 #include "../libs/ap_tcp.h"
@@ -33,9 +35,6 @@
 #define STATE_NEEDRECONNECT 5 // connection error happened. driver should attempt to reconnect
 #define STATE_ERROR    6 // serious I/O error happened
 
-// truly generous amount
-#define MAXDEVS 2
-
 // tcp conn statuses (mostly internal for TCPAnswer() func)
 #define TC_ST_READY  0
 #define TC_ST_BUSY   1
@@ -48,6 +47,8 @@
 #define DEVICE_TYPE_SHTRIH_LTFRK  2
 #define DEVICE_TYPE_INNOVA        3
 
+struct t_fiscal_doc; // see fiscaldoc.h
+
 typedef struct t_device_type
 {
   int type; // internal type-id. see above
@@ -56,30 +57,69 @@ typedef struct t_device_type
   int (*func_port_init)(int devid); // ptr to device initializatin function
   int (*func_get_state)(int devid); // ptr to device state query function
   int (*func_send_command)(int devid, char *data, size_t size); // ptr to function that send enquiries to device
+  int (*func_transaction)(int devid, struct t_fiscal_doc *doc); // ptr to function that prints whole fiscal document. NULL if not supported
+  int (*func_shutdown)(int devid); // ptr to function that saves driver's state before exit. NULL if there is nothing to save
 } t_device_type;
 
+#define DEV_STATUS_MAX 1000 // status text size limit. DEVSTATE answer is 1024 at most
+
 typedef struct t_device
 {
-  char *tty;
-  int fd; // opened tty file descriptor or 0
+  // hot: touched on each command. kept together at the start
   int id; // human-configured, numeric ID != 0
+  int fd; // opened tty file descriptor or 0
+  unsigned state; //current state. connected, fault etc. see STATE_*. written by worker, read by event loop: use DEV_STATE()/DEV_SET_STATE()
+  int init_queued; // (re-)init job is queued or running. event loop's thread only. device commands get "407 device initializing" meanwhile
   struct t_device_type const *device_type;
-  unsigned state; //current state. connected, fault etc. see STATE_*
-  struct timeval next_attempt; // universal due time for the next attempt of anything ;). used mainly to prevent every other second re-init attemts in cases of errors
   /* IO buffer (actually this is _only_ for combed printer's output.
      The commands and other data being sent _to_ printer
      must be stored in driver's data block as it is internal matters only.
   */
   unsigned char *buf; // IO buffer. should be only used for output data from printer
   int buf_size, buf_ptr; // buf size/current index
-
   void *driver_data; // driver's data block. depends on printer model. set on port init procedure call
-  struct ap_tcp_connection_t *tcpconn; // ptr to the tcp connection associated with this dev. NULL if none. used to extend timeouts on long jobs, etc
 
+  // worker thread that owns the tty and runs driver methods. see devworker.c
+  pthread_t worker;
+  pthread_mutex_t queue_lock;
+  struct t_dev_job *queue_head, *queue_tail; // jobs waiting for the worker
+  int wake_fd; // eventfd to wake the worker up on new job
+
+  // cold: config and rarely used data
+  char *tty;
+  int low_latency; // ask serial driver for ASYNC_LOW_LATENCY. "options lowlatency"
+  uint64_t next_attempt; // ap_evloop_now() based due time for the next attempt of anything ;). used mainly to prevent every other second re-init attemts in cases of errors
+  ap_evloop_timer_t timer; // event loop's thread only. next re-init attempt or background status poll. see device_plan()
   unsigned char *psbuf; // saved PHP class data if not NULL
   int psbuf_size, psbuf_ptr; // PHP save
+
+  // status snapshot for DEVSTATE with max age. written by driver in worker, read by event loop. see dev_status_*() in printers_common.c
+  pthread_mutex_t status_lock;
+  char *status_text; // driver's state text as of status_time. DEV_STATUS_MAX bytes, allocated by devworker_start() to keep t_device small
+  int status_len; // 0 if there was no successful state query yet
+  uint64_t status_time; // ap_evloop_now() of last refresh, either full query or from regular command's answer
+  uint64_t status_next_poll; // event loop's thread only. --"-- background GETSTATE is queued after that
+  int status_poll_queued; // --"--. background GETSTATE is in the queue
+  struct t_dev_job *status_job; // --"--. GETSTATE in flight, either poller's or peer's one. DEVSTATE requests are attached to it
+
+  // competing clients scheduling. event loop's thread only. see devsched.c
+  int lease_conn; // connection holding device's lease or -1
+  int lease_busy; // holder's commands in work. lease does not expire meanwhile
+  ap_evloop_timer_t lease_timer; // revokes the lease of silent holder
+  ap_evloop_timer_t sched_timer; // dispatches the waiting requests after lease is dropped
+  struct t_sched_wait *sched_head; // lease requests and commands waiting for the holder, by priority
+
+  // per-command latency statistics. written by driver in worker, read by STATS and SIGUSR1 dump. see cmdstats.c
+  pthread_mutex_t stats_lock;
+  struct t_cmd_stats **cmd_stats; // 256 ptrs indexed by command code, allocated by devworker_start(). NULL until the code is used
+
+  struct t_flightrec *flightrec; // ring of the serial IO and protocol events. NULL if off. see flightrec.c
 } t_device;
 
+// device's state is shared by its worker and event loop threads
+#define DEV_STATE(dev) __atomic_load_n(&(dev)->state, __ATOMIC_ACQUIRE)
+#define DEV_SET_STATE(dev, s) __atomic_store_n(&(dev)->state, (s), __ATOMIC_RELEASE)
+
 #define INITPORT_GENERALERROR -1;
 
 #define max_io_speeds_index 21
@@ -103,16 +143,20 @@ extern int dev_idx_by_id(int id);
 
 extern struct sockaddr_in bind_sock;
 extern int bind_retries, bind_retry_sleep;
+extern int listen_backlog; // listen() backlog. 0 - ap_tcp_max_connections
 
 extern int devices_count;
-extern struct t_device devices[MAXDEVS];
-extern int poll_freq;
+extern struct t_device *devices;
 
 extern const int device_types_count;
 extern struct t_device_type *device_types;
 extern int daemonize;
 
 extern char *pidfile;
+extern char *state_dir;
+extern int status_poll_interval;
+extern int job_keep_time;
+extern int lease_timeout;
 
 extern const int io_speeds[max_io_speeds_index + 1];
 extern const int io_speeds_printable[max_io_speeds_index + 1];
@@ -7,6 +7,7 @@
 #define MARIA301_C
 #include <fcntl.h>
 #include "maria301.h"
+#include "../cmdstats.h"
 
 const char *default_speeds_list = "115200,57600,38400,19200,9600,4800,2400";
 
@@ -140,7 +141,7 @@ static int read_block(struct t_device *dev, int timeout)
 {
   int n, i, got_bytes;
   struct t_driver_data *dd;
-  struct timeval tv, time_end;
+  uint64_t time_end;
 
 
   dd = (struct t_driver_data *)(dev->driver_data);
@@ -148,10 +149,7 @@ static int read_block(struct t_device *dev, int timeout)
   dev->buf_ptr = 0;
   memset(dev->buf, 255, dev->buf_size);
 
-  if ( dev->tcpconn != NULL )
-    ap_utils_timeval_set(dev->tcpconn->expire, AP_UTILS_TIMEVAL_ADD, timeout);
-
-  ap_utils_timeval_set(&time_end, AP_UTILS_TIMEVAL_SET, timeout);
+  time_end = ap_evloop_now() + (uint64_t)timeout * 1000;
 
   timeout /= 10; // adjusting for average answer length in bytes
 
@@ -159,10 +157,9 @@ static int read_block(struct t_device *dev, int timeout)
   // we'll do simple scan for begin/end here. no mind blowing tricks. there is just short data packets
   do
   {
-    gettimeofday(&tv, NULL);
-    if ( timercmp(&tv, &time_end, >=) )
+    if ( ap_evloop_now() >= time_end )
     {
-      if ( debug_level )
+      if ( debug_want(1) )
         debuglog("? warning: maria301: read_block() dev %d/%s: timeout after %d bytes\n", dev->id, dev->tty, dev->buf_ptr);
 
       return 0;
@@ -171,9 +168,9 @@ static int read_block(struct t_device *dev, int timeout)
     if ( dev->buf_ptr == dev->buf_size )
     {
       dev->buf_ptr = 0;
-      dev->state = NEED_RECONNECT;
+      DEV_SET_STATE(dev, NEED_RECONNECT);
 
-      if ( debug_level )
+      if ( debug_want(1) )
         debuglog("? warning: maria301: read_block() dev %d/%s: buffer full of garbage\n", dev->id, dev->tty);
 
       return -1;
@@ -183,10 +180,10 @@ static int read_block(struct t_device *dev, int timeout)
 
     if ( n < 0 ) // error - we can do nothing here
     {
-      if ( debug_level )
+      if ( debug_want(1) )
         debuglog("!ERROR: maria301: read_block() dev %d/%s: byte read return %d/%m\n", dev->id, dev->tty, n);
 
-      dev->state = NEED_RECONNECT;
+      DEV_SET_STATE(dev, NEED_RECONNECT);
 
       return n;
     }
@@ -202,7 +199,7 @@ static int read_block(struct t_device *dev, int timeout)
     {
       dev->buf_ptr = 0;
 
-      if ( debug_level > 9 )
+      if ( debug_want(10) )
         debuglog("!ERROR: maria301: read_block() dev %d/%s: no CMD_BEGIN from start. read %d bytes\n", dev->id, dev->tty, got_bytes);
 
       continue;
@@ -212,14 +209,14 @@ static int read_block(struct t_device *dev, int timeout)
       dev->buf[0] = CMD_BEGIN;
       dev->buf_ptr = 1;
 
-      if ( debug_level > 4 )
+      if ( debug_want(5) )
         debuglog("!ERROR: maria301: read_block() dev %d/%s: another CMD_BEGIN after %d bytes\n", dev->id, dev->tty, dev->buf_ptr - 1);
 
       continue;
     }
   } while ( dev->buf[dev->buf_ptr - 1] != CMD_END );
 
-  if ( debug_level > 9 )
+  if ( debug_want(10) )
   {
     debuglog("*debug: maria301: read_block() dev %d/%s:\n", dev->id, dev->tty);
     memdump(dev->buf, dev->buf_ptr);
@@ -228,7 +225,7 @@ static int read_block(struct t_device *dev, int timeout)
   // OK, got the sequence. now checking is data length correct?
   if ( dev->buf[dev->buf_ptr - 2] != dev->buf_ptr - 3 )
   {
-    if ( debug_level )
+    if ( debug_want(1) )
       debuglog("!ERROR: maria301: read_block() dev %d/%s: seq length error: got %d bytes but should be %d\n", dev->id, dev->tty, dev->buf_ptr - 1, dev->buf[dev->buf_ptr - 2]);
 
     return -1;
@@ -241,7 +238,7 @@ static int read_block(struct t_device *dev, int timeout)
     if ( n != 2 )
     {
       /* to hell with it now
-      dev->state = NEED_RECONNECT;
+      DEV_SET_STATE(dev, NEED_RECONNECT);
       */
 
       return dev->buf_ptr;
@@ -249,7 +246,7 @@ static int read_block(struct t_device *dev, int timeout)
 
     if ( *((uint16_t *)(dd->buf + dev->buf_ptr - 2)) != count_crc16(dd->buf, dev->buf_ptr - 2) )
     {
-      if ( debug_level )
+      if ( debug_want(1) )
         debuglog("!ERROR: maria301: read_block() dev %d/%s: seq CRC error\n", dev->id, dev->tty);
 
       return -1;
@@ -303,7 +300,7 @@ static int read_answer(struct t_device *dev, int timeout)
 
     if ( 0 == memcmp(dev->buf + 1, "WAIT", 4) || 0 == memcmp(dev->buf + 1, "WRK", 3) || 0 == memcmp(dev->buf + 1, "PRN", 3) )
     {
-      if ( debug_level > 3 )
+      if ( debug_want(4) )
         dosyslog(LOG_ERR, "*debug: maria301(%d:%s): printer tells it's busy. we wait.\n", dev->id, dev->tty);
 
       usleep(1000000);
@@ -312,14 +309,14 @@ static int read_answer(struct t_device *dev, int timeout)
     }
     else if ( 0 == memcmp(dev->buf + 1, "DONE", 4) )
     {
-      if ( debug_level > 3 )
+      if ( debug_want(4) )
         dosyslog(LOG_ERR, "*debug: maria301(%d:%s): printer tells us 'DONE'.\n", dev->id, dev->tty);
 
       continue;
     }
     else if ( 0 == memcmp(dev->buf + 1, "READY", 5) )
     {
-      if ( debug_level > 3 )
+      if ( debug_want(4) )
         dosyslog(LOG_ERR, "*debug: maria301(%d:%s): printer tells us 'READY'.\n", dev->id, dev->tty);
 
       if ( tmpdatalen > 0 ) // we've got some data previously
@@ -340,7 +337,7 @@ static int read_answer(struct t_device *dev, int timeout)
 
         dd->prnerrindex = i;
 
-        if ( debug_level )
+        if ( debug_want(1) )
           dosyslog(LOG_ERR, "*debug: maria301(%d:%s): printer error: %s (%s).\n", dev->id, dev->tty,
                    maria301_error_messages[i][0], maria301_error_messages[i][1]);
 
@@ -369,12 +366,13 @@ static int read_answer(struct t_device *dev, int timeout)
 static int send_command(struct t_device *dev, char *buf, size_t data_size)
 {
   struct t_driver_data *dd;
-  struct timeval tv;
   size_t cmd_size;
+  uint64_t start;
 
   dd = dev->driver_data;
+  start = ap_evloop_now();
 
-  dev->state = STATE_BUSY;
+  DEV_SET_STATE(dev, STATE_BUSY);
 
   memcpy(dev->buf + 1, dd->buf, data_size);
   dd->buf[0] = CMD_BEGIN;
@@ -390,24 +388,23 @@ static int send_command(struct t_device *dev, char *buf, size_t data_size)
     cmd_size += 2;
   }
 
-  if (debug_level)
+  if (debug_want(1))
     debuglog("* debug: maria301: send_command() dev %d: %d bytes, '%4s'\n", dev->id, cmd_size, dev->buf + 1);
 
-  if (debug_level > 9)
+  if (debug_want(10))
     memdump(dd->buf, cmd_size);
 
   if ( cmd_size != write_bytes(dev, dd->buf, cmd_size, "maria301: send_command() dev %d: write %d bytes: %m", dev->id, cmd_size) )
     return 1;
 
-  tv.tv_sec = answer_timeouts[command_code] / 1000; // msec->sec
-  tv.tv_usec = 999999; // +1 sec bonus
-
-  if ( dev->tcpconn != NULL )
-    timeradd(&(dev->tcpconn->expire), &tv, &(dev->tcpconn->expire)); // extending the timeout in tcp watcher
-
   n = read_bytes(dev, 1, answer_timeouts[command_code]);
 
-  dev->state = STATE_CMDSENT;
+  if ( n == 1 )
+    cmdstats_record(dev, command_code, ap_evloop_now() - start, -1); // answer is read by the caller
+  else
+    cmdstats_count(dev, command_code, CMDSTATS_TIMEOUT);
+
+  DEV_SET_STATE(dev, STATE_CMDSENT);
 
   return cmd_size;
 }
@@ -47,6 +47,8 @@ int maria301_port_init(int devid);
     return(INITPORT_GENERALERROR);
   }
 
+  set_low_latency(dev);
+
   //------------------------------------------
   dd->state = STATE_SPEED_SET;
 
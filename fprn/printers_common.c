@@ -6,79 +6,157 @@
 
 #define PRINTERS_COMMON_C
 #include "fprnconfig.h"
+#include "flightrec.h"
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 //===========================================================================
 /** \brief Reads data from printer until done or error
  *
  * \param dev struct t_device * - ptr to printer device data structure
  * \param need_bytes int - how many byte we need to receive
- * \param timeout int - total timeout for the whole transaction in milliseconds (at least 50 there will be)
+ * \param timeout int - total timeout for the whole transaction in milliseconds. 0 means just take what is there already
  * \return int - actual read count or -1 in case of error
  *
- * cyclically queries the printer for the data available and reads it into dev->buf
+ * waits for the data with poll() until the absolute deadline, so the bytes are taken as soon as tty has them
  * adds data into dev->buf, past dev->bufptr
 */
 int read_bytes(struct t_device *dev, int need_bytes, int timeout)
 {
-struct timeval tvstart, tvnow, tvdiff;
-int n, received_count;
+uint64_t deadline, now;
+struct pollfd pfd;
+int n, received_count, wait_ms;
+int32_t tmo[3]; // flight recorder's timeout record
+
+  // monotonic, as date change command of fiscal printer shifts the wall clock
+  now = ap_evloop_now();
+  deadline = now + (uint64_t)timeout * 1000;
 
-  timeout *= 1000; // to microseconds
-  gettimeofday(&tvstart, NULL);
   received_count = 0;
 
+  pfd.fd = dev->fd;
+  pfd.events = POLLIN;
+
   for(;;)
   {
-    // it's better to sleep immediately as this func anyway called right after write() w/o delays
-    usleep(10000);
+    // time left, rounded up so we do not wake up a bit early and spin
+    if ( now < deadline )
+      wait_ms = (deadline - now + 999) / 1000;
+    else
+      wait_ms = 0;
+
+    pfd.revents = 0;
+
+    if ( -1 == poll(&pfd, 1, wait_ms) && errno != EINTR )
+    {
+      dosyslog(LOG_ERR, "* read_bytes(): poll() on printer id: %d: %m", dev->id);
+      flightrec_event(dev, FR_ERROR, "read: poll(): %s", strerror(errno));
+      return -1;
+    }
 
     n = dev->buf_size - dev->buf_ptr;
 
-    if (n > need_bytes)
-       n = need_bytes;
+    if (n > need_bytes - received_count)
+       n = need_bytes - received_count;
+
+    if ( n == 0 ) // no room in buffer
+      return received_count;
 
     n = read(dev->fd, dev->buf + dev->buf_ptr, n);
 
     if (n > 0)
     {
       received_count += n;
+      flightrec_add(dev, FR_RX, dev->buf + dev->buf_ptr, n);
 
-      if (debug_level > 9 )
+      if (debug_want_cat(LOGCAT_SERIAL, 10) )
       {
         debuglog("read_bytes(): got %d (%d of %d) bytes:%c", n, received_count, need_bytes, (received_count > 9? '\n' : ' ') );
         memdump(dev->buf + dev->buf_ptr, n);
       }
 
       dev->buf_ptr += n;
+
+      if (received_count == need_bytes)
+        return need_bytes;
     }
-    else // n <= 0
+    else if ( (n < 0 && errno != EAGAIN && errno != EINTR) || (n == 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) )
     {
-      if (n < 0 && errno != EAGAIN && debug_level > 5)
+      if (debug_want(6))
         dosyslog(LOG_ERR, "* debug: read_bytes(): got %d code reding from printer id: %d (err: %m)\n", n, dev->id);
-    }
 
-    if (received_count == need_bytes)
-      return need_bytes;
+      flightrec_event(dev, FR_ERROR, "read: %d: %s", n, ( n < 0 ? strerror(errno) : "hang up" ));
+      return -1;
+    }
 
-    gettimeofday(&tvnow, NULL);
-    timersub(&tvnow, &tvstart, &tvdiff);
+    now = ap_evloop_now();
 
-    if (tvdiff.tv_sec * 1000000 + tvdiff.tv_usec >= timeout)
+    if ( now >= deadline )
     {
-      if (debug_level > 10)
-        debuglog("* debug: read_bytes(): timeout (%ldms of %dms) from printer id: %d (%d bytes read so far)\n", (tvdiff.tv_sec * 1000000 + tvdiff.tv_usec)/1000, timeout/1000, dev->id, received_count);
+      if (debug_want_cat(LOGCAT_SERIAL, 11))
+        debuglog("* debug: read_bytes(): timeout (%dms) from printer id: %d (%d bytes read so far)\n", timeout, dev->id, received_count);
 
-      if (n < 0 && errno != EAGAIN)
-        return n;
+      if ( timeout > 0 ) // 0 is just a peek
+      {
+        tmo[0] = need_bytes;
+        tmo[1] = received_count;
+        tmo[2] = timeout;
+        flightrec_add(dev, FR_TIMEOUT, tmo, sizeof(tmo));
+      }
 
       return 0;
     }
   }//for(;;)
 }
 
+//===========================================================================
+/** \brief Switches the low latency mode of serial port driver if device is configured so
+ *
+ * \param dev struct t_device * - ptr to printer device data structure with port opened
+ * \return int - boolean success. true if option is off
+ *
+ * Kernel passes the received bytes to reader right away instead of batching them up on timer tick.
+ * Not all serial drivers support it, so failure is only logged.
+*/
+int set_low_latency(struct t_device *dev)
+{
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+struct serial_struct ss;
+
+  if ( ! dev->low_latency )
+    return 1;
+
+  if ( -1 == ioctl(dev->fd, TIOCGSERIAL, &ss) )
+  {
+    dosyslog(LOG_NOTICE, "dev %d (%s): low latency: TIOCGSERIAL: %m", dev->id, dev->tty);
+    return 0;
+  }
+
+  ss.flags |= ASYNC_LOW_LATENCY;
+
+  if ( -1 == ioctl(dev->fd, TIOCSSERIAL, &ss) )
+  {
+    dosyslog(LOG_NOTICE, "dev %d (%s): low latency: TIOCSSERIAL: %m", dev->id, dev->tty);
+    return 0;
+  }
+
+  if (debug_want(3))
+    debuglog("* dev %d (%s): low latency mode is on\n", dev->id, dev->tty);
+
+  return 1;
+#else
+  if ( dev->low_latency )
+    dosyslog(LOG_NOTICE, "dev %d (%s): low latency mode is not supported on this system", dev->id, dev->tty);
+
+  return ! dev->low_latency;
+#endif
+}
+
 //===========================================================================
 /** \brief Sends some prepared data to printer.
  *
@@ -102,7 +180,9 @@ int n;
 
   if ( count == n )
   {
-    if (debug_level > 10 )
+    flightrec_add(dev, FR_TX, buf, count);
+
+    if (debug_want_cat(LOGCAT_SERIAL, 11) )
     {
       debuglog("* debug: successfully wrote dev %d, %d byte(s):%c", dev->id, count, (count > 10?'\n':' '));
       memdump(buf, count);
@@ -111,6 +191,8 @@ int n;
     return count;
   }
 
+  flightrec_event(dev, FR_ERROR, "write: %d of %d bytes: %s", n, count, ( n < 0 ? strerror(errno) : "short write" ));
+
   if ( error_msg_fmt != NULL )
   {
     va_start(va, error_msg_fmt);
@@ -126,6 +208,242 @@ int n;
   return n;
 }
 
+//===========================================================================
+/** \brief Stores the new status snapshot of device. Called by driver after state query or any answer that changes it
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \param text const char * - driver's state text, as for DEVSTATE
+ * \param len int - its length. cut to DEV_STATUS_MAX - 1
+ * \return void
+*/
+void dev_status_publish(struct t_device *dev, const char *text, int len)
+{
+  if ( len >= DEV_STATUS_MAX )
+    len = DEV_STATUS_MAX - 1;
+
+  pthread_mutex_lock(&dev->status_lock);
+
+  memcpy(dev->status_text, text, len);
+  dev->status_text[len] = '\0';
+  dev->status_len = len;
+  dev->status_time = ap_evloop_now();
+
+  pthread_mutex_unlock(&dev->status_lock);
+}
+
+//===========================================================================
+/** \brief Copies device's status snapshot if it is fresh enough
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \param max_age int - seconds
+ * \param out char * - output buffer. at least DEV_STATUS_MAX bytes. text is zero-terminated
+ * \return int - text length or -1 if there is no snapshot or it is older than max_age
+*/
+int dev_status_get(struct t_device *dev, int max_age, char *out)
+{
+uint64_t now;
+int len;
+
+  now = ap_evloop_now();
+
+  pthread_mutex_lock(&dev->status_lock);
+
+  if ( dev->status_len > 0 && dev->status_time + (uint64_t)max_age * 1000000 >= now )
+  {
+    len = dev->status_len;
+    memcpy(out, dev->status_text, len + 1);
+  }
+  else
+    len = -1;
+
+  pthread_mutex_unlock(&dev->status_lock);
+
+  return len;
+}
+
+//===========================================================================
+/** \brief Makes the name of device's file in state_dir
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \param kind const char * - file name prefix: "speed", "timeouts", flight recorder dump
+ * \param path char * - output buffer
+ * \param path_size size_t - its size
+ * \return int - boolean success
+ *
+ * file is named after tty, not device id, so the printer is found at the same port even if config is renumbered
+*/
+int dev_state_path(struct t_device *dev, const char *kind, char *path, size_t path_size)
+{
+char *tty_name;
+
+  if ( state_dir == NULL || *state_dir == '\0' || dev->tty == NULL )
+    return 0;
+
+  tty_name = strrchr(dev->tty, '/');
+  tty_name = ( tty_name == NULL ) ? dev->tty : tty_name + 1;
+
+  return snprintf(path, path_size, "%s/%s.%s", state_dir, kind, tty_name) < (int)path_size;
+}
+
+//===========================================================================
+/** \brief Reads the last good serial speed of device from the state file
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \return int - index in io_speeds[] or -1 if there is no file or it is unusable
+ *
+ * file contains the plain speed value like 19200
+*/
+int load_device_speed(struct t_device *dev)
+{
+char path[1024];
+FILE *f;
+int speed, i;
+
+  if ( ! dev_state_path(dev, "speed", path, sizeof(path)) )
+    return -1;
+
+  if ( NULL == (f = fopen(path, "r")) )
+    return -1;
+
+  i = fscanf(f, "%d", &speed);
+  fclose(f);
+
+  if ( i != 1 )
+    return -1;
+
+  for ( i = 0; i <= max_io_speeds_index; ++i )
+    if ( speed == io_speeds_printable[i] )
+      return i;
+
+  dosyslog(LOG_NOTICE, "dev %d (%s): ignoring bad speed %d in %s", dev->id, dev->tty, speed, path);
+
+  return -1;
+}
+
+//===========================================================================
+/** \brief Saves the serial speed of device to the state file
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \param speed_idx int - index in io_speeds[]
+ * \return int - boolean success
+ *
+ * written to temporary file and renamed, so the reader never gets a half-written one.
+ * the failure is only logged: the port is scanned as usual then
+*/
+int save_device_speed(struct t_device *dev, int speed_idx)
+{
+char path[1024], tmp_path[1040];
+FILE *f;
+
+  if ( speed_idx < 0 || speed_idx > max_io_speeds_index || ! dev_state_path(dev, "speed", path, sizeof(path)) )
+    return 0;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  if ( NULL == (f = fopen(tmp_path, "w")) )
+  {
+    dosyslog(LOG_NOTICE, "dev %d (%s): can't save speed: fopen(%s): %m", dev->id, dev->tty, tmp_path);
+    return 0;
+  }
+
+  fprintf(f, "%d\n", io_speeds_printable[speed_idx]);
+
+  if ( 0 != fclose(f) || -1 == rename(tmp_path, path) )
+  {
+    dosyslog(LOG_NOTICE, "dev %d (%s): can't save speed to %s: %m", dev->id, dev->tty, path);
+    unlink(tmp_path);
+    return 0;
+  }
+
+  if (debug_want(3))
+    debuglog("* dev %d (%s): speed %d saved to %s\n", dev->id, dev->tty, io_speeds_printable[speed_idx], path);
+
+  return 1;
+}
+
+//===========================================================================
+/** \brief Reads the learned command timeouts of device from the state file
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \param timeouts int * - table of 256 msec values, indexed by command code. only the codes found in file are set
+ * \return int - count of values loaded
+ *
+ * file has "code msec" line per learned command, code is hex like 0x10
+*/
+int load_device_timeouts(struct t_device *dev, int *timeouts)
+{
+char path[1024];
+FILE *f;
+int code, msec, count;
+
+  if ( ! dev_state_path(dev, "timeouts", path, sizeof(path)) )
+    return 0;
+
+  if ( NULL == (f = fopen(path, "r")) )
+    return 0;
+
+  count = 0;
+
+  while ( 2 == fscanf(f, "%i %d", &code, &msec) )
+  {
+    if ( code < 0 || code > 255 || msec <= 0 )
+    {
+      dosyslog(LOG_NOTICE, "dev %d (%s): ignoring bad timeout %#x %d in %s", dev->id, dev->tty, code, msec, path);
+      continue;
+    }
+
+    timeouts[code] = msec;
+    ++count;
+  }
+
+  fclose(f);
+
+  return count;
+}
+
+//===========================================================================
+/** \brief Saves the learned command timeouts of device to the state file
+ *
+ * \param dev struct t_device * - ptr to printer device data structure
+ * \param timeouts const int * - table of 256 msec values, indexed by command code. 0 - not learned, not saved
+ * \return int - boolean success
+ *
+ * see save_device_speed() for the way it is written
+*/
+int save_device_timeouts(struct t_device *dev, const int *timeouts)
+{
+char path[1024], tmp_path[1040];
+FILE *f;
+int code;
+
+  if ( ! dev_state_path(dev, "timeouts", path, sizeof(path)) )
+    return 0;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  if ( NULL == (f = fopen(tmp_path, "w")) )
+  {
+    dosyslog(LOG_NOTICE, "dev %d (%s): can't save timeouts: fopen(%s): %m", dev->id, dev->tty, tmp_path);
+    return 0;
+  }
+
+  for ( code = 0; code < 256; ++code )
+    if ( timeouts[code] > 0 )
+      fprintf(f, "%#04x %d\n", code, timeouts[code]);
+
+  if ( 0 != fclose(f) || -1 == rename(tmp_path, path) )
+  {
+    dosyslog(LOG_NOTICE, "dev %d (%s): can't save timeouts to %s: %m", dev->id, dev->tty, path);
+    unlink(tmp_path);
+    return 0;
+  }
+
+  if (debug_want(3))
+    debuglog("* dev %d (%s): timeouts saved to %s\n", dev->id, dev->tty, path);
+
+  return 1;
+}
+
 //===========================================================================
 /** \brief Helper for process_config_options_speed() - decodes serial speed value and finds it index
  *
@@ -246,7 +564,7 @@ int i, speed, range_end;
     exit(1);
   }
 
-  if ( debug_level > 4 )
+  if ( debug_want(5) )
     dosyslog(LOG_NOTICE, "process_options_speed(): no speeds set. using default scan range: %s.", in_default_speeds_list);
 
   process_config_options_speed((char*)in_default_speeds_list, out_speeds_array, NULL);
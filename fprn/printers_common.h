@@ -2,8 +2,8 @@
 #define PRINTERS_COMMON_H
 
 /*
-   read printer bytes with timeouts
-   timeout in millisec (at least 50 there will be)
+   read printer bytes with timeouts. waits with poll(), so the data is taken as soon as it arrives
+   timeout in millisec. 0 - take only what is there already
    adds data past dev->bufptr
    return bytes read if any
     0 if timeout
@@ -11,6 +11,33 @@
 */
 extern int read_bytes(struct t_device *dev, int need_bytes, int timeout);
 
+// sets ASYNC_LOW_LATENCY on port if dev->low_latency is set. returns false if it is not possible
+extern int set_low_latency(struct t_device *dev);
+
+/*
+   device's status snapshot. publish is for drivers, get is for answering DEVSTATE with max age
+   get returns text length or -1 if there is none or it is older than max_age seconds. out is DEV_STATUS_MAX at least
+*/
+extern void dev_status_publish(struct t_device *dev, const char *text, int len);
+extern int dev_status_get(struct t_device *dev, int max_age, char *out);
+
+// name of device's file in state_dir: <state_dir>/<kind>.<tty name>. returns boolean success
+extern int dev_state_path(struct t_device *dev, const char *kind, char *path, size_t path_size);
+
+/*
+   last good serial speed of device, kept in state_dir/speed.<tty name> between restarts
+   speeds are indexes in io_speeds[]. load returns -1 if nothing is saved
+*/
+extern int load_device_speed(struct t_device *dev);
+extern int save_device_speed(struct t_device *dev, int speed_idx);
+
+/*
+   learned answer timeouts of device by command code, kept in state_dir/timeouts.<tty name>
+   tables are 256 msec values. 0 - not learned. load returns count of values set
+*/
+extern int load_device_timeouts(struct t_device *dev, int *timeouts);
+extern int save_device_timeouts(struct t_device *dev, const int *timeouts);
+
 // return count of bytes written
 extern int write_bytes(struct t_device *dev, void *buf, int count, char *error_msg_fmt, ...);
 
@@ -9,11 +9,15 @@
 #include "shtrih_ltfrk.h"
 #include "shtrih_answer_timeouts.h"
 #include "shtrih_flags.h"
+#include "../cmdstats.h"
+#include "../flightrec.h"
+#include "../fiscaldoc.h"
 
 // factory-def speed is 4800, but windows software prefer it to 19200, so these comes first.
 const char *default_speeds_list = "19200,4800,9600,38400,57600,115200,2400";
 const int each_speed_tries = 2;
 const int standard_answer_timeout = 10000; //msec. win driver table std = 10000. the fucking printer is too slow even on 115000
+const int default_probe_timeout = 500; //msec. ENQ is answered at once by the manual, so speed scan need not wait the standard time
 
 #include "shtrih_ltfrk_get_state.c"
 //===========================================================================
@@ -31,9 +35,37 @@ int shtrih_ltfrk_send_command(int devid, char *data, size_t size)
   int errcode;
   dev = get_dev_by_id(devid);
   errcode = send_command(dev, data, size);
+
+  if ( errcode == 0 )
+    note_answer_state(dev);
+
   return errcode;
 }
 
+//===========================================================================
+/** \brief Shtrih-FR-K driver. Method called before program exits
+ *
+ * \param devid int - device id
+ * \return int - 0 - OK, errcode if not
+ *
+ * Saves learned timeouts changed since the last periodic save
+*/
+int shtrih_ltfrk_shutdown(int devid)
+{
+  struct t_device *dev;
+  struct t_driver_data *dd;
+
+  dev = get_dev_by_id(devid);
+  dd = dev->driver_data;
+
+  if ( ! dd->learned_dirty )
+    return 0;
+
+  dd->learned_dirty = ! save_device_timeouts(dev, dd->learned_timeout);
+
+  return dd->learned_dirty ? -1 : 0;
+}
+
 //===========================================================================
 /** \brief Shtrih-FR-K driver internal. counting CRC according to the Manual
  *
@@ -84,9 +116,23 @@ int shtrih_ltfrk_register_device(int device_index)
   dd->buf = getmem(dd->buf_size, "shtrih_ltfrk_register_device: driver_data buf malloc");
   dd->buf_ptr = 0;
 
+  dd->config_try_speeds = NULL;
   process_config_options_speed((char*)default_speeds_list, &dd->config_try_speeds, NULL);
 
   dd->connected_speed = 0;
+  dd->saved_speed = SPEED_NOT_LOADED; // statedir may be set later in config
+  dd->reported_speed = -1;
+  dd->probe_timeout = default_probe_timeout;
+  dd->long_state_valid = 0;
+  dd->state_speed = dd->state_timeout = 0;
+  dd->dtr_reset = DTR_RESET_ONERROR;
+  dd->dtr_reset_pending = 1;
+  dd->link_idle = 0;
+  dd->adaptive_timeouts = 0;
+  memset(dd->timeout_override, 0, sizeof(dd->timeout_override));
+  memset(dd->learned_timeout, 0, sizeof(dd->learned_timeout));
+  dd->learned_loaded = dd->learned_dirty = 0;
+  dd->learned_saved = 0;
 
   return 1;
 }
@@ -126,6 +172,49 @@ int shtrih_ltfrk_parse_options(int device_index, char *opt)
     // should die on errors
     process_config_options_speed(config_parse_remaining_arg(), &dd->config_try_speeds, default_speeds_list);
   }
+  else if (0 == strcasecmp(opt, "probetimeout")) // msec to wait for ENQ answer while looking for speed and for frame's ACK on fast path
+  {
+    s = config_parse_get_next_token(1);
+    n = strtol(s, &sp, 10);
+
+    if (n < 10 || n > standard_answer_timeout || *sp != '\0')
+      return 0;
+
+    dd->probe_timeout = n;
+  }
+  else if (0 == strcasecmp(opt, "dtrreset")) // when to pulse DTR before command: always, onerror or never
+  {
+    s = config_parse_get_next_token(1);
+
+    if (0 == strcasecmp(s, "always"))
+      dd->dtr_reset = DTR_RESET_ALWAYS;
+    else if (0 == strcasecmp(s, "onerror"))
+      dd->dtr_reset = DTR_RESET_ONERROR;
+    else if (0 == strcasecmp(s, "never"))
+      dd->dtr_reset = DTR_RESET_NEVER;
+    else
+      return 0;
+  }
+  else if (0 == strcasecmp(opt, "adaptivetimeouts")) // learn answer timeouts from the observed latency
+  {
+    if ( -1 == (dd->adaptive_timeouts = config_parse_get_bool()) )
+      return 0;
+  }
+  else if (0 == strcasecmp(opt, "timeout")) // fixed answer timeout for the command code: timeout <code> <msec>
+  {
+    if ( NULL == (s = config_parse_get_next_token(1)) )
+      return 0;
+
+    n = strtol(s, &sp, 0);
+
+    if (n < 0 || n > 255 || *sp != '\0' || NULL == (s = config_parse_get_next_token(1)))
+      return 0;
+
+    dd->timeout_override[n] = strtol(s, &sp, 10);
+
+    if (dd->timeout_override[n] < 10 || *sp != '\0')
+      return 0;
+  }
   else
     return 0; //unrecognized
 
@@ -147,40 +236,43 @@ int shtrih_ltfrk_parse_options(int device_index, char *opt)
  *  02: data...*/
 int read_answer3(struct t_device *dev, int timeout, char confirm_char)
 {
-  struct timeval tvstart, tvnow, tvdiff;
+  uint64_t start, elapsed;
   struct t_driver_data *dd;
-  int n, data_len;
+  int n, data_len, left;
   unsigned char crc;
 
   dd = dev->driver_data;
   timeout *= 1000; // to microseconds
-  gettimeofday(&tvstart, NULL);
+  start = ap_evloop_now();
 
   for(;;)
   {
-    gettimeofday(&tvnow, NULL);
-    timersub(&tvnow, &tvstart, &tvdiff);
+    elapsed = ap_evloop_now() - start;
 
-    if (tvdiff.tv_sec * 1000000 + tvdiff.tv_usec >= timeout)
+    if (elapsed >= timeout)
     {
-      if (debug_level > 10)
+      if (debug_want(11))
         debuglog("* debug: read_answer(): timeout from printer id: %d (%d bytes read so far)\n", dev->id, dev->buf_ptr);
+      flightrec_event(dev, FR_EVENT, "answer timeout %d msec", timeout / 1000);
       return 0;
     }
 
+    left = (timeout - elapsed + 999) / 1000; // msec. the frame start is waited for the rest of timeout only
+
     dev->buf_ptr = 0;
     memset(dev->buf, 0, dev->buf_size);
 
-    dev->state = STATE_BUSY;
+    DEV_SET_STATE(dev, STATE_BUSY);
 
-    n = read_bytes(dev, 1, standard_answer_timeout); // should get STX + answer length
+    n = read_bytes(dev, 1, left); // should get STX + answer length
 
     if (n == 0)
       continue;  // timeout. looping
 
     if (n != 1 || dev->buf[0] != CODE_STX)
     {
-      if(debug_level > 3) dosyslog(LOG_ERR, "!ERROR: read_answer: answer begins with %#x on dev %d", dev->buf[0], dev->id);
+      if(debug_want(4)) dosyslog(LOG_ERR, "!ERROR: read_answer: answer begins with %#x on dev %d", dev->buf[0], dev->id);
+      flightrec_event(dev, FR_EVENT, "answer begins with %#x", dev->buf[0]);
       continue; // garbage data or not the first byte of previous answer. re-trying whole process till timeout
     }
 
@@ -192,12 +284,13 @@ int read_answer3(struct t_device *dev, int timeout, char confirm_char)
     data_len = dev->buf[1];
     n = read_bytes(dev, data_len + 1, standard_answer_timeout); // data + CRC byte. at least 8-10 msec on 2400 per byte, but you know...
 
-    dev->state = STATE_READY;
+    DEV_SET_STATE(dev, STATE_READY);
     if (n < 0)
     {
       dd->buf[0] = CODE_NAK;
       write_bytes(dev, dd->buf, 1, NULL);
       dosyslog(LOG_ERR, "shtrih_ltfrk: read_answer: answer read error on dev %d", dev->id);
+      flightrec_event(dev, FR_EVENT, "answer read error");
       return 0; // fatality
     }
     if (n != data_len + 1)
@@ -205,6 +298,7 @@ int read_answer3(struct t_device *dev, int timeout, char confirm_char)
       dd->buf[0] = CODE_NAK;
       write_bytes(dev, dd->buf, 1, NULL);
       dosyslog(LOG_ERR, "shtrih_ltfrk: read_answer: FR different length answer (timeout?) %d of %d bytes on dev %d", n, data_len + 1, dev->id);
+      flightrec_event(dev, FR_EVENT, "answer length %d of %d", n, data_len + 1);
       return 0; // brutality
     }
 
@@ -215,8 +309,9 @@ int read_answer3(struct t_device *dev, int timeout, char confirm_char)
       dd->buf[0] = CODE_NAK;
       write_bytes(dev, dd->buf, 1, NULL);
       dosyslog(LOG_ERR, "shtrih_ltfrk: read_answer: FR answer CRC error on dev %d: should be %#x, count: %#x", dev->id, (int)(dev->buf[data_len + 2]), crc);
+      flightrec_event(dev, FR_EVENT, "answer CRC %#x, counted %#x", (int)(dev->buf[data_len + 2]), crc);
 
-      if (debug_level > 9 )
+      if (debug_want(10) )
       {
         debuglog("read_answer: dev->buf_ptr=%d:%c", dev->buf_ptr, (dev->buf_ptr>10?'\n':' '));
         memdump(dev->buf, dev->buf_ptr);
@@ -231,7 +326,7 @@ int read_answer3(struct t_device *dev, int timeout, char confirm_char)
        return 0; // fucality
 
     //tcflush(dev->fd, TCIFLUSH); // flushing input. just in case
-    if (debug_level > 9) debuglog("read_answer: data packet received OK\n");
+    if (debug_want(10)) debuglog("read_answer: data packet received OK\n");
 
     break; // OK
   } //for(;;)
@@ -252,14 +347,50 @@ int read_answer(struct t_device *dev, int timeout)
 }
 
 //===========================================================================
-/** \brief Shtrih-FR-K driver internal. sends command to printer
+/** \brief Shtrih-FR-K driver internal. Resets the link by dropping RTS/DTR for a second
  *
  * \param dev struct t_device * - ptr to device data struct
- * \param data char* - data to send
- * \param data_size size_t - data size
- * \return int - 0 = no error, 1 - error, -1 = garbled communication
+ * \return void
  *
- * format:
+ * Done before command only if driver's dtr_reset mode asks for it.
+ * Old versions did it before every command, so throughput was about a command per second.
+*/
+static void dtr_pulse(struct t_device *dev)
+{
+  int n;
+
+  if (debug_want(6)) debuglog("* debug: dev %d: DTR pulse\n", dev->id);
+
+  ioctl(dev->fd, TIOCMGET, &n);
+  n &= ~(TIOCM_RTS| TIOCM_DTR);
+  ioctl(dev->fd, TIOCMSET, &n);
+  sleep(1);
+  n |= TIOCM_DTR;
+  ioctl(dev->fd, TIOCMSET, &n);
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Timeout to wait for ENQ answer
+ *
+ * \param dd struct t_driver_data * - driver data of device
+ * \return int - msec
+ *
+ * ENQ is answered at once by the manual. with adaptive timeouts the dead printer is found after probe_timeout then
+*/
+static int enq_timeout(struct t_driver_data *dd)
+{
+  return dd->adaptive_timeouts ? dd->probe_timeout : standard_answer_timeout;
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Negotiates the link with ENQ until printer is ready to get the command
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \return int - 0 = printer is ready, 1 - error, -1 = read error
+ *
+ * Printer answers ENQ with NAK if it waits for command, or with ACK if it has unconfirmed answer to send.
+ *
+ * command format:
  * byte 0: STX(0x02) - begin of msg
  * byte 1: msg length (N). Length excluding bytes 0, LRC(CRC) and this
  * byte 2: command/answer code
@@ -272,11 +403,10 @@ int read_answer(struct t_device *dev, int timeout)
  * ACK  6 = acknowledge
  * NAK 15 = denial
 */
-int send_command(struct t_device *dev, char *data, size_t data_size)
+static int link_negotiate(struct t_device *dev)
 {
   struct t_driver_data *dd;
-  struct timeval tv;
-  int n, command_code, answer_try;
+  int n, answer_try, silent_tries;
 
   dd = dev->driver_data;
   //if ( dd->state != STATE_READY ) return 1;
@@ -285,18 +415,16 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
   dev->buf_ptr = 0;
   read_bytes(dev, dev->buf_size, 0); // skip garbage
 
-  // don't remember why to trigger DTR, honestly...
-  ioctl(dev->fd, TIOCMGET, &n);
-  n &= ~(TIOCM_RTS| TIOCM_DTR);
-  ioctl(dev->fd, TIOCMSET, &n);
-  sleep(1);
-  n |= TIOCM_DTR;
-  ioctl(dev->fd, TIOCMSET, &n);
+  // line is kept up between commands. it is reset only after re-init or error, unless configured otherwise
+  if ( dd->dtr_reset == DTR_RESET_ALWAYS || (dd->dtr_reset == DTR_RESET_ONERROR && dd->dtr_reset_pending) )
+    dtr_pulse(dev);
+
+  dd->dtr_reset_pending = 0;
 
   // ENQ ------------------------------------------
-  for (answer_try = 0; ; ++answer_try)
+  for (answer_try = silent_tries = 0; ; ++answer_try)
   {
-    if (answer_try == 10)
+    if (answer_try == 10 || (dd->adaptive_timeouts && silent_tries == ADAPT_ENQ_TRIES))
     {
       dosyslog(LOG_ERR, "shtrih_ltfrk send_command: try #%d timeout on ENQ - aborting", answer_try);
       dd->state = STATE_NEEDRECONNECT;
@@ -311,9 +439,9 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
     }
 
     dev->buf_ptr = 0;
-    n = read_bytes(dev, 1, standard_answer_timeout);
+    n = read_bytes(dev, 1, enq_timeout(dd));
 
-    //if (debug_level > 9 && n > 0) debuglog("send_command: ENQ answer: %#x\n", *(dev->buf));
+    //if (debug_want(10) && n > 0) debuglog("send_command: ENQ answer: %#x\n", *(dev->buf));
 
     if (n < 0)
     {
@@ -322,7 +450,10 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
     }
 
     if (n == 0)
+    {
+      ++silent_tries;
       continue; // timeout - silent next try
+    }
 
     if( *(dev->buf) == CODE_NAK ) // now we can send command
     {
@@ -331,7 +462,7 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
     }
     else if ( *(dev->buf) == CODE_ACK )
     {
-      if (debug_level > 5) debuglog("send_command: ENQ answer is ACK. devouring the previous command output first\n");
+      if (debug_want(6)) debuglog("send_command: ENQ answer is ACK. devouring the previous command output first\n");
 
       read_answer(dev, standard_answer_timeout);
 
@@ -344,38 +475,201 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
     }
   }
 
-  dev->state = STATE_BUSY;
-  dd->buf[0] = CODE_STX;
-  dd->buf[1] = data_size;
-  memcpy(dd->buf + 2, data, data_size);
-  dd->buf[data_size + 2] = count_crc(dd->buf + 1, data_size + 1); // crc for len + data bytes  n = data_size + 3;
-  command_code = dd->buf[2];
+  return 0;
+}
 
-  if (debug_level) debuglog("* debug: send_command dev %d: code %#x, %d bytes:%c", dev->id, command_code, n, (dev->buf_ptr>10?'\n':' ') );
-  if (debug_level > 9) memdump(dd->buf, n);
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Timeout to wait for printer's answer to the command
+ *
+ * \param dd struct t_driver_data * - driver data of device
+ * \param code int - command code
+ * \param fixed int - msec. timeout to use if there is no configured or learned one
+ * \return int - msec
+*/
+static int command_timeout(struct t_driver_data *dd, int code, int fixed)
+{
+  if ( dd->timeout_override[code] )
+    return dd->timeout_override[code];
 
-  if ( n != write_bytes(dev, dd->buf, n, "shtrih_ltfrk: send_command dev %d: write %d bytes: %m", dev->id, n) )
-    return 1;
+  if ( dd->adaptive_timeouts && dd->learned_timeout[code] )
+    return dd->learned_timeout[code];
 
-  dev->state = STATE_CMDSENT;
+  return fixed;
+}
 
-  //--------------------------------------
-  dev->buf_ptr = 0;
-  tv.tv_sec = answer_timeouts[command_code] / 1000; // msec->sec
-  tv.tv_usec = 999999; // +1 sec bonus
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Sets learned timeout and saves the table if it is time
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \param code int - command code
+ * \param msec int - new timeout
+ * \return void
+*/
+static void set_learned_timeout(struct t_device *dev, int code, int msec)
+{
+  struct t_driver_data *dd;
+  uint64_t now;
+  int cap;
 
-  if ( dev->tcpconn != NULL )
-    timeradd(&(dev->tcpconn->expire), &tv, &(dev->tcpconn->expire)); // extending the timeout in tcp watcher
+  dd = dev->driver_data;
+
+  cap = ( answer_timeouts[code] > standard_answer_timeout ) ? answer_timeouts[code] : standard_answer_timeout;
+
+  if ( msec > cap )
+    msec = cap;
+
+  if ( msec < ADAPT_FLOOR )
+    msec = ADAPT_FLOOR;
 
-  n = read_bytes(dev, 1, answer_timeouts[command_code]); //read ACK/NAK
+  if ( msec != dd->learned_timeout[code] )
+  {
+    if (debug_want(3)) debuglog("* debug: dev %d: code %#x: timeout %d -> %d msec\n", dev->id, code, dd->learned_timeout[code], msec);
+
+    dd->learned_timeout[code] = msec;
+    dd->learned_dirty = 1;
+  }
 
-  dev->state = STATE_BUSY;
+  now = ap_evloop_now(); // monotonic, so the clock set on printer's host does not stop the saves
 
-  //if (debug_level > 9) debuglog("send_command: command acknowledge answer: %#x\n", *(dev-buf));
+  if ( dd->learned_dirty && now - dd->learned_saved >= ADAPT_SAVE_INTERVAL * 1000000ULL )
+  {
+    dd->learned_saved = now; // not retried too often on failure either
+    dd->learned_dirty = ! save_device_timeouts(dev, dd->learned_timeout);
+  }
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Updates learned timeout of command after the exchange
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \param code int - command code
+ * \param timed_out int - boolean. exchange is failed on timeout
+ * \return void
+ *
+ * Timeout is the ADAPT_PERCENTILE of answer times * ADAPT_FACTOR + ADAPT_MARGIN.
+ * Answers that are late are not seen in statistics, so the timeout is doubled on expiry.
+ * It is learned back from the statistics on the next good answer.
+*/
+static void learn_timeout(struct t_device *dev, int code, int timed_out)
+{
+  struct t_driver_data *dd;
+  int64_t usec;
+
+  dd = dev->driver_data;
+
+  if ( ! dd->adaptive_timeouts || dd->timeout_override[code] )
+    return;
+
+  if ( timed_out )
+  {
+    if ( dd->learned_timeout[code] )
+      set_learned_timeout(dev, code, dd->learned_timeout[code] * 2);
+
+    return;
+  }
+
+  if ( -1 != (usec = cmdstats_answer_percentile(dev, code, ADAPT_PERCENTILE, ADAPT_MIN_SAMPLES)) )
+    set_learned_timeout(dev, code, usec / 1000 * ADAPT_FACTOR + ADAPT_MARGIN);
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. sends command to printer
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \param data char* - data to send
+ * \param data_size size_t - data size
+ * \return int - 0 = no error, 1 - error, -1 = garbled communication
+ *
+ * If the previous exchange was clean and not long ago, the printer is known to wait for a command,
+ * so the frame is sent right away without ENQ round trip.
+ * Fast path waits for frame's ACK for probetimeout only and falls back to link_negotiate() on NAK. On timeout ENQ is sent first:
+ * if printer answers ACK then it got the command and its answer is ready, so the command is not repeated.
+ * see link_negotiate() for the protocol basics
+ * Timings and troubles are recorded in device's command statistics, see cmdstats.c
+ * Answer is waited for command_timeout(). With adaptive timeouts it is learned from these statistics, see learn_timeout()
+*/
+static int send_command_exchange(struct t_device *dev, char *data, size_t data_size)
+{
+  struct t_driver_data *dd;
+  int n, command_code, fast, timeout;
+  uint64_t start;
+  int64_t ack_usec;
+
+  dd = dev->driver_data;
+  start = ap_evloop_now();
+  command_code = (unsigned char)data[0];
+  timeout = command_timeout(dd, command_code, answer_timeouts[command_code]);
+
+  fast = ( dd->link_idle && dd->dtr_reset != DTR_RESET_ALWAYS && ap_evloop_now() - dd->link_idle_since < LINK_IDLE_MAX * 1000000ULL );
+  dd->link_idle = 0; // until this exchange is done
+
+  for (;;)
+  {
+    if ( ! fast && 0 != (n = link_negotiate(dev)) )
+      return n;
+
+    DEV_SET_STATE(dev, STATE_BUSY);
+    dd->buf[0] = CODE_STX;
+    dd->buf[1] = data_size;
+    memcpy(dd->buf + 2, data, data_size);
+    dd->buf[data_size + 2] = count_crc(dd->buf + 1, data_size + 1); // crc for len + data bytes
+    n = data_size + 3;
+
+    if (debug_want(1)) debuglog("* debug: send_command dev %d: code %#x, %d bytes:%c", dev->id, command_code, n, (n>10?'\n':' ') );
+    if (debug_want(10)) memdump(dd->buf, n);
+
+    if ( n != write_bytes(dev, dd->buf, n, "shtrih_ltfrk: send_command dev %d: write %d bytes: %m", dev->id, n) )
+      return 1;
+
+    DEV_SET_STATE(dev, STATE_CMDSENT);
+
+    //--------------------------------------
+    dev->buf_ptr = 0;
+    n = read_bytes(dev, 1, (fast ? dd->probe_timeout : timeout)); //read ACK/NAK. waiting printer ACKs the frame at once, so the lost one is found out soon
+
+    DEV_SET_STATE(dev, STATE_BUSY);
+
+    if ( ! fast || (n == 1 && *(dev->buf) != CODE_NAK) )
+      break;
+
+    fast = 0; // fast path failed. going the long way
+
+    if ( n == 1 ) // frame is rejected. re-sending after link negotiation
+    {
+      if (debug_want(6)) debuglog("send_command: fast path: NAK. negotiating link\n");
+      cmdstats_count(dev, command_code, CMDSTATS_NAK);
+      cmdstats_count(dev, command_code, CMDSTATS_RETRY);
+      continue;
+    }
+
+    if (debug_want(6)) debuglog("send_command: fast path: no ACK. asking printer with ENQ\n");
+    cmdstats_count(dev, command_code, CMDSTATS_TIMEOUT); // the short ACK wait says nothing about the answer timeout, so it is not learned
+
+    dd->buf[0] = CODE_ENQ;
+    if (1 != write_bytes(dev, dd->buf, 1, "shtrih_ltfrk send_command: write(ENQ) to %s: %m", dev->tty))
+      return 1;
+
+    dev->buf_ptr = 0;
+
+    if ( 1 != (n = read_bytes(dev, 1, enq_timeout(dd))) )
+    {
+      dosyslog(LOG_ERR, "shtrih_ltfrk: send_command: no answer on ENQ from dev %d", dev->id);
+      return 1; // printer is silent. no sense to negotiate
+    }
+
+    if ( *(dev->buf) == CODE_ACK )
+      break; // printer has got the command. its answer follows
+
+    cmdstats_count(dev, command_code, CMDSTATS_RETRY);
+  } // for(;;)
+
+  //if (debug_want(10)) debuglog("send_command: command acknowledge answer: %#x\n", *(dev-buf));
 
   if (n != 1)
   {
     dosyslog(LOG_ERR, "shtrih_ltfrk: send_command: ACK/NAK timeout on dev %d", dev->id);
+    cmdstats_count(dev, command_code, CMDSTATS_TIMEOUT);
+    learn_timeout(dev, command_code, 1);
     return 1;
   }
 
@@ -385,14 +679,17 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
       break;
 
     case CODE_NAK: // some job still in progress
+      cmdstats_count(dev, command_code, CMDSTATS_NAK);
       return 1;
 
     default:      dosyslog(LOG_ERR, "shtrih_ltfrk: send_command: dev: %d answer is not an ACK/NAK: %#x", dev->id, *(dev->buf));
       return -1;
   } //switch dev->buf
 
+  ack_usec = ap_evloop_now() - start;
+
   // read data --------------------------------------
-  n = read_answer(dev, standard_answer_timeout);
+  n = read_answer(dev, command_timeout(dd, command_code, standard_answer_timeout));
 
   if (n <= 0)
   {
@@ -400,16 +697,50 @@ int send_command(struct t_device *dev, char *data, size_t data_size)
     dd->buf[0] = CODE_NAK;
     write_bytes(dev, dd->buf, 1, NULL);
 
+    cmdstats_record(dev, command_code, ack_usec, -1);
+    cmdstats_count(dev, command_code, CMDSTATS_TIMEOUT);
+    learn_timeout(dev, command_code, 1);
+
     return 1;
   }
 
+  cmdstats_record(dev, command_code, ack_usec, ap_evloop_now() - start);
+  learn_timeout(dev, command_code, 0);
+
   tcflush(dev->fd, TCIFLUSH); // flushing input. just in case
 
-  dev->state = STATE_READY;
+  DEV_SET_STATE(dev, STATE_READY);
+
+  // answer is ACK'ed, so printer waits for the next command now
+  dd->link_idle = 1;
+  dd->link_idle_since = ap_evloop_now();
 
   return 0; // no error
 }
 
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. sends command to printer
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \param data char* - data to send
+ * \param data_size size_t - data size
+ * \return int - 0 = no error, 1 - error, -1 = garbled communication
+ *
+ * see send_command_exchange(). Failed exchange makes the next command to reset the link first
+*/
+int send_command(struct t_device *dev, char *data, size_t data_size)
+{
+  struct t_driver_data *dd;
+  int n;
+
+  dd = dev->driver_data;
+
+  if ( 0 != (n = send_command_exchange(dev, data, data_size)) )
+    dd->dtr_reset_pending = 1;
+
+  return n;
+}
+
 //===========================================================================
 /** \brief Shtrih-FR-K driver internal. sends command to printer. just like send_command(), but with mighty printf abilities
  *
@@ -461,4 +792,6 @@ int send_command_fmt(struct t_device *dev, char *fmt, ...)
   dd = dev->driver_data;
 */
   return 1;
-}
\ No newline at end of file
+}
+
+#include "shtrih_ltfrk_transaction.c"
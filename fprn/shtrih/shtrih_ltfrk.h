@@ -28,10 +28,46 @@ typedef struct t_driver_data
   unsigned char admin_password[4]; //printer admin password
   int *config_try_speeds; // array of config option <speed>. see printers_common.c/process_options_speed()
   int connected_speed; // currently connected speed
+  int saved_speed; // speed in state file, tried first on init. -1 if none, SPEED_NOT_LOADED before the first init
+  int reported_speed; // speed printer reports with 0x15 command. -1 if unknown
+  int probe_timeout; // msec to wait for ENQ answer on speed detection. "options probetimeout"
+  unsigned char long_state[64]; // the last 0x11 answer from dev->buf[0]. status text is made from it
+  int long_state_valid; // there was successful 0x11 already
+  int state_speed, state_timeout; // exchange params from 0x15 answer
+  int dtr_reset; // when to pulse DTR before command. DTR_RESET_*. "options dtrreset"
+  int dtr_reset_pending; // port was re-initialized or the last command failed
+  int link_idle; // the last exchange was clean, so printer waits for command. ENQ is skipped then
+  uint64_t link_idle_since; // ap_evloop_now() when the last exchange was done
+  int adaptive_timeouts; // learn answer timeouts from the observed latency. "options adaptivetimeouts"
+  int timeout_override[256]; // msec by command code. 0 - none. "options timeout <code> <msec>". not learned then
+  int learned_timeout[256]; // msec by command code. 0 - not learned yet
+  int learned_loaded; // learned_timeout[] was read from state file already
+  int learned_dirty; // learned_timeout[] differs from the saved one
+  uint64_t learned_saved; // ap_evloop_now() of last save of learned_timeout[]
 } t_driver_data;
 
+#define SPEED_NOT_LOADED -2
+
+#define LINK_IDLE_MAX 5 // sec. after longer pause the link is negotiated with ENQ again
+
+// adaptive timeouts: percentile of answer time * factor + margin, but not less than floor and not more than the static table value
+#define ADAPT_MIN_SAMPLES 20 // answers of the code before its timeout is learned
+#define ADAPT_PERCENTILE 99
+#define ADAPT_FACTOR 2
+#define ADAPT_MARGIN 200 // msec
+#define ADAPT_FLOOR 300 // msec
+#define ADAPT_SAVE_INTERVAL 60 // sec. learned table is saved not more often
+#define ADAPT_ENQ_TRIES 2 // link negotiation tries without any answer. ENQ is waited for probe_timeout only, so the silence is not worth 10 tries
+
+// DTR pulse (drop RTS/DTR for a second) before command modes
+#define DTR_RESET_NEVER   0
+#define DTR_RESET_ONERROR 1 // only after port init and after failed command. default
+#define DTR_RESET_ALWAYS  2 // before each command as old versions did. costs a second per command
+
 // returns 0 if no error
 extern int send_command(struct t_device *dev, char *data, size_t size);extern int send_command_fmt(struct t_device *dev, char *fmt, ...);
 extern int shtrih_ltfrk_port_init(int devid);
 extern int shtrih_ltfrk_get_state(int devid);
+extern int shtrih_ltfrk_transaction(int devid, struct t_fiscal_doc *doc);
+extern int shtrih_ltfrk_shutdown(int devid);
 #endif
\ No newline at end of file
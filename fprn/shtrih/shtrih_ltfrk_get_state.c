@@ -13,6 +13,84 @@
 #include "shtrih_answer_timeouts.h"
 #include "shtrih_flags.h"
 */
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Makes the status text for DEVSTATE from the last known printer's state
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \param out char * - output buffer of DEV_STATUS_MAX bytes
+ * \return int - text length
+ *
+ * the most is taken from the saved 0x11 answer. error code, mode and flags are the latest ones
+*/
+static int format_state(struct t_device *dev, char *out)
+{
+  struct t_driver_data *dd;
+  unsigned char *ls;
+  int n;
+
+  dd = dev->driver_data;
+  ls = dd->long_state;
+
+  n = snprintf(out, DEV_STATUS_MAX, "errcode %d\nspeed %d\ntimeout %d\nmode %u %u\nfr_flags %u\nfp_flags %u\n"
+           "operator %d\nfw_ver %d.%d\nfw_build %d\nfw_date %02d-%02d-%04d\n"
+           "depts_num %d\ndoc_no %d\nport %d\n"
+           "eklz_ver %d.%d\neklz_build %d\neklz_date %02d-%02d-%04d\n"
+           "date %02d-%02d-%04d\ntime %02d:%02d:%02d\n"
+           "id %u\nlast_closed_shift_id %d\n"
+           "eklz_free %d\nregs_count %d\nregs_left %d\nINN %llu\n"
+           "end\n",
+           dd->prnerrcode, dd->state_speed, dd->state_timeout, dd->mode, dd->submode, dd->fr_flags, dd->fp_flags,
+           ls[4], ls[5], ls[6], *((uint16_t*)(ls+7)), ls[9], ls[10], 2000 + ls[11],
+           ls[12], *((uint16_t*)(ls+13)), ls[19],
+           ls[20], ls[21], *((uint16_t*)(ls+22)), ls[24], ls[25], 2000 + ls[26],
+           ls[27], ls[28], 2000 + ls[29], ls[30], ls[31], ls[32],
+           *((uint32_t*)(ls+34)), *((uint16_t*)(ls+38)),
+           *((uint16_t*)(ls+40)), ls[42], ls[43],
+           *((uint64_t*)(ls+44)) & 0x0000ffffffffffffl
+  );
+
+  return ( n >= DEV_STATUS_MAX ) ? DEV_STATUS_MAX - 1 : n;
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Takes error code and mode from the answer of regular command into status snapshot
+ *
+ * \param dev struct t_device * - ptr to device data struct with the answer in buf
+ * \return void
+ *
+ * 0x10 (short state) and 0x11 (long state) answers carry mode and flags. the rest only the error code
+*/
+static void note_answer_state(struct t_device *dev)
+{
+  struct t_driver_data *dd;
+  char text[DEV_STATUS_MAX];
+
+  dd = dev->driver_data;
+
+  if ( dev->buf_ptr < 4 )
+    return;
+
+  dd->prnerrcode = dev->buf[3];
+
+  if ( dev->buf[3] == 0 && dev->buf[2] == 0x10 && dev->buf_ptr >= 9 )
+  {
+    dd->fr_flags = *((uint16_t*)(dev->buf + 5));
+    dd->mode = dev->buf[7];
+    dd->submode = dev->buf[8];
+  }
+  else if ( dev->buf[3] == 0 && dev->buf[2] == 0x11 && dev->buf_ptr >= 34 )
+  {
+    memcpy(dd->long_state, dev->buf, sizeof(dd->long_state));
+    dd->fr_flags = *((uint16_t*)(dev->buf + 15));
+    dd->fp_flags = dev->buf[33];
+    dd->mode = dev->buf[17];
+    dd->submode = dev->buf[18];
+  }
+
+  if ( dd->long_state_valid ) // there was full query already
+    dev_status_publish(dev, text, format_state(dev, text));
+}
+
 //===========================================================================
 /** \brief Shtrih-FR-K driver. Method that queries and returns detailed status of printer hardware
  *
@@ -25,20 +103,12 @@ int shtrih_ltfrk_get_state(int devid)
 {
   struct t_device *dev;
   struct t_driver_data *dd;
-  int errcode;
-  int state_speed, state_timeout;
-  struct timeval tv; // for timeout fixing
-  char *tmpbuf;
+  int errcode, n;
+  char text[DEV_STATUS_MAX];
 
   dev = get_dev_by_id(devid);
   dd = dev->driver_data;
 
-  tv.tv_sec = 10; // 10 sec is good enough for slow connection
-  tv.tv_usec = 0;
-
-  if ( dev->tcpconn != NULL )
-    timeradd(&(dev->tcpconn->expire), &tv, &(dev->tcpconn->expire)); // extending the timeout in tcp watcher
-
   /* get dev type */
   errcode = send_command(dev, "\xfc", 1);
   dd->prnerrcode = dev->buf[3];
@@ -78,15 +148,26 @@ int shtrih_ltfrk_get_state(int devid)
   else
   {
     if ( dev->buf[5] <= 150 )
-      state_timeout = dev->buf[5];
+      dd->state_timeout = dev->buf[5];
     else if ( dev->buf[5] <= 249 )
-      state_timeout = dev->buf[5] * 150;
+      dd->state_timeout = dev->buf[5] * 150;
     else
-      state_timeout = dev->buf[5] * 15000;
+      dd->state_timeout = dev->buf[5] * 15000;
 
-    state_speed = io_speeds_printable[2 + dev->buf[4]]; // io_speeds[2] == 2400
+    if ( 2 + dev->buf[4] <= max_io_speeds_index )
+    {
+      dd->reported_speed = 2 + dev->buf[4]; // io_speeds[2] == 2400
+      dd->state_speed = io_speeds_printable[dd->reported_speed];
+    }
+    else
+      dd->state_speed = 0;
+
+    if ( debug_want(3) )
+      dosyslog(LOG_NOTICE, "shtrih_ltfrk_get_state(#%d): comm params: speed: %d, timeout: %d ms \n", dev->id, dd->state_speed, dd->state_timeout);
 
-    dosyslog(LOG_NOTICE, "shtrih_ltfrk_get_state(#%d): comm params: speed: %d, timeout: %d ms \n", dev->id, state_speed, state_timeout);
+    // printer will use this one after restart, so it goes first in the next scan
+    if ( dd->reported_speed >= 0 && dd->reported_speed != dd->saved_speed && save_device_speed(dev, dd->reported_speed) )
+      dd->saved_speed = dd->reported_speed;
   }
 
   /* get long status */
@@ -95,12 +176,14 @@ int shtrih_ltfrk_get_state(int devid)
 
   if ( errcode == 0 )
   {
+    memcpy(dd->long_state, dev->buf, sizeof(dd->long_state));
+    dd->long_state_valid = 1;
     dd->fr_flags = *((uint16_t*)(dev->buf + 15));
     dd->fp_flags = dev->buf[33];
     dd->mode = dev->buf[17];
     dd->submode = dev->buf[18];
 
-    if (debug_level > 0)
+    if (debug_want(1))
     {
       debuglog("* debug: got: err code: %#x\n\tFR V%u.%u, Build %u, date: %02u-%02u-%04u\n",
                dev->buf[3], dev->buf[5], dev->buf[6], *((uint16_t*)(dev->buf+7)),
@@ -174,35 +257,14 @@ int shtrih_ltfrk_get_state(int devid)
 
       debuglog("\tdate: %02u-%02u-%04u\n", dev->buf[24], dev->buf[25], 2000 + dev->buf[26]);
     }
-  } // if (debug_level > 0)
+  } // if (debug_want(1))
   else
     return errcode;
 
-  // return something for php
-  dev->buf[0] = '\0';
-  if ( NULL == ( tmpbuf = malloc(dev->buf_size)) )
-    return 0;
-
-  snprintf(tmpbuf, dev->buf_size - 1, "errcode %d\nspeed %d\ntimeout %d\nmode %u %u\nfr_flags %u\nfp_flags %u\n"
-           "operator %d\nfw_ver %d.%d\nfw_build %d\nfw_date %02d-%02d-%04d\n"
-           "depts_num %d\ndoc_no %d\nport %d\n"
-           "eklz_ver %d.%d\neklz_build %d\neklz_date %02d-%02d-%04d\n"
-           "date %02d-%02d-%04d\ntime %02d:%02d:%02d\n"
-           "id %u\nlast_closed_shift_id %d\n"
-           "eklz_free %d\nregs_count %d\nregs_left %d\nINN %llu\n"
-           "end\n",
-           dd->prnerrcode, state_speed, state_timeout, dd->mode, dd->submode, dd->fr_flags, dd->fp_flags,
-           dev->buf[4], dev->buf[5], dev->buf[6], *((uint16_t*)(dev->buf+7)), dev->buf[9], dev->buf[10], 2000 + dev->buf[11],
-           dev->buf[12], *((uint16_t*)(dev->buf+13)), dev->buf[19],
-           dev->buf[20], dev->buf[21], *((uint16_t*)(dev->buf+22)), dev->buf[24], dev->buf[25], 2000 + dev->buf[26],
-           dev->buf[27], dev->buf[28], 2000 + dev->buf[29], dev->buf[30], dev->buf[31], dev->buf[32],
-           *((uint32_t*)(dev->buf+34)), *((uint16_t*)(dev->buf+38)),
-           *((uint16_t*)(dev->buf+40)), dev->buf[42], dev->buf[43],
-           *((uint64_t*)(dev->buf+44)) & 0x0000ffffffffffffl
-  );
-
-  strcpy((char *)(dev->buf), tmpbuf);
-  free(tmpbuf);
+  // return something for php. it is the status snapshot as well
+  n = format_state(dev, text);
+  memcpy(dev->buf, text, n + 1);
+  dev_status_publish(dev, text, n);
 
   return errcode;
 }
@@ -23,7 +23,8 @@
  * but(!), at last RMK sets speed to 19200, so we assume that a preference #1
  *
  * So, we start at 19200 then 4800 and then 2400 up to 115200 sending ENQ
- * each_speed_trys tries at each speed with timeouts of try_timeout sec
+ * each_speed_trys tries at each speed with timeouts of probe_timeout msec
+ * The last good speed from the state file goes before the list. It is the one printer reported with 0x15 if known.
  *
  * on power on device awaits for ENQ code (0x05) and answers with:
  * ACK(0x06) if busy with other command processing
@@ -41,24 +42,50 @@ int shtrih_ltfrk_port_init(int devid)
   dev = get_dev_by_id(devid);
   dd = dev->driver_data;
   dd->state = STATE_INIT;
+  dd->dtr_reset_pending = 1; // the first command after init resets the link
+  dd->link_idle = 0;
+  dd->reported_speed = -1;
+
+  if ( dd->saved_speed == SPEED_NOT_LOADED )
+    dd->saved_speed = load_device_speed(dev);
+
+  if ( dd->adaptive_timeouts && ! dd->learned_loaded )
+  {
+    dd->learned_loaded = 1;
+    n = load_device_timeouts(dev, dd->learned_timeout);
+
+    if (debug_want(3)) debuglog("* debug: dev %d: %d learned timeouts loaded\n", dev->id, n);
+  }
 
   //------------------------------------------
-  for (splist_idx = 0; ; ++splist_idx)
+  for (splist_idx = -1; ; ++splist_idx) // -1 is for saved speed
   {
-    if ( 0 == dd->config_try_speeds[splist_idx] ) // end of list?
+    if ( splist_idx == -1 )
+    {
+      if ( dd->saved_speed < 0 )
+        continue;
+
+      io_speed = dd->saved_speed;
+    }
+    else if ( 0 == dd->config_try_speeds[splist_idx] ) // end of list?
     {
       dosyslog(LOG_ERR, "!ERROR shtrih_ltfrk_port_init: out of tries (speed setting/ready check) printer id: %d, tty: %s", dev->id, dev->tty);
 
       process_config_options_speed((char*)default_speeds_list, &dd->config_try_speeds, NULL);  // re-setting to default speeds list
 
-      dev->state = STATE_NEEDRECONNECT;
+      DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
 
       return INITPORT_GENERALERROR;
     }
+    else
+    {
+      io_speed = dd->config_try_speeds[splist_idx];
 
-    io_speed = dd->config_try_speeds[splist_idx];
+      if ( io_speed == dd->saved_speed ) // tried already
+        continue;
+    }
 
-    if (debug_level) debuglog("\n\n########################################################\n* debug: init speed %d for printer id: %d, tty: %s\n", io_speeds_printable[io_speed], dev->id, dev->tty);
+    if (debug_want(1)) debuglog("\n\n########################################################\n* debug: init speed %d for printer id: %d, tty: %s\n", io_speeds_printable[io_speed], dev->id, dev->tty);
 
     if ( 0 != dev->fd )
       close(dev->fd);
@@ -67,7 +94,7 @@ int shtrih_ltfrk_port_init(int devid)
     {
       dosyslog(LOG_ERR, "shtrih_ltfrk_port_init: open(%s): %m", dev->tty);
 
-      dev->state = STATE_NEEDRECONNECT;
+      DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
 
       return INITPORT_GENERALERROR;
     }
@@ -80,7 +107,7 @@ int shtrih_ltfrk_port_init(int devid)
     if ( -1 == tcgetattr(dev->fd, &tiop) )
     {
       dosyslog(LOG_ERR, "shtrih_ltfrk_port_init: tcgetattr %s: %m", dev->tty);
-      dev->state = STATE_NEEDRECONNECT;
+      DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
       return INITPORT_GENERALERROR;
     }
 
@@ -119,7 +146,7 @@ int shtrih_ltfrk_port_init(int devid)
     {
       dosyslog(LOG_ERR, "shtrih_ltfrk_port_init: tcsetattr %s: %m", dev->tty);
 
-      dev->state = STATE_NEEDRECONNECT;
+      DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
 
       return INITPORT_GENERALERROR;
 
@@ -129,7 +156,7 @@ int shtrih_ltfrk_port_init(int devid)
     {
       dosyslog(LOG_ERR, "shtrih_ltfrk_port_init: tcgetattr %s: %m", dev->tty);
 
-      dev->state = STATE_NEEDRECONNECT;
+      DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
 
       return INITPORT_GENERALERROR;
     }
@@ -139,18 +166,20 @@ int shtrih_ltfrk_port_init(int devid)
     {
       dosyslog(LOG_ERR, "shtrih_ltfrk_port_init: c_Xflag(s) set wrong for %s", dev->tty);
 
-      dev->state = STATE_NEEDRECONNECT;
+      DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
 
       return INITPORT_GENERALERROR;
     }
 
+    set_low_latency(dev); // printer still works if serial driver can't do it
+
     //------------------------------------------
     dd->state = STATE_SPEEDSET;
     ack_count = 0;
 
     for (speed_try = 0; speed_try < each_speed_tries; ++speed_try)
     {
-      if (debug_level > 5) debuglog("\n\n-------------------------------------------------\n* debug: speed try %d\n", speed_try + 1);
+      if (debug_want(6)) debuglog("\n\n-------------------------------------------------\n* debug: speed try %d\n", speed_try + 1);
 
       tcflush(dev->fd, TCIFLUSH);
 
@@ -160,13 +189,13 @@ int shtrih_ltfrk_port_init(int devid)
       if (1 != write_bytes(dev, dd->buf, 1, "shtrih_ltfrk %s: try %d at %d - write ENQ: %m", dev->tty, speed_try, io_speeds_printable[io_speed]))
         break;
 
-      if (debug_level > 5) debuglog("* debug: wait for ACK/NAK\n");
+      if (debug_want(6)) debuglog("* debug: wait for ACK/NAK\n");
 
       //------------------------------------------
       for (answer_try = 0; answer_try < 5; ++answer_try)
       {
         dev->buf_ptr = 0;
-        n = read_bytes(dev, 1, standard_answer_timeout);
+        n = read_bytes(dev, 1, dd->probe_timeout);
 
         if (n < 0)
         {
@@ -207,7 +236,7 @@ int shtrih_ltfrk_port_init(int devid)
             write_bytes(dev, dd->buf, 1, NULL);
           }// if (ack_count)
 
-          if (debug_level > 5) debuglog("\n!-!-!-!-!-!-!-!-! loop !-!-!-!-!-!-!-!-!-!-!\n");
+          if (debug_want(6)) debuglog("\n!-!-!-!-!-!-!-!-! loop !-!-!-!-!-!-!-!-!-!-!\n");
 
           continue;
         }
@@ -222,13 +251,16 @@ int shtrih_ltfrk_port_init(int devid)
           continue; // next try
         }
 
-        if (debug_level > 9) memdump(dev->buf, n);
-        if (debug_level > 5) debuglog("* debug: port init done, getting printer status\n");
+        if (debug_want(10)) memdump(dev->buf, n);
+        if (debug_want(6)) debuglog("* debug: port init done, getting printer status\n");
 
-        dev->state = STATE_READY;
+        DEV_SET_STATE(dev, STATE_READY);
         dd->connected_speed = io_speed;
 
-        errcode = shtrih_ltfrk_get_state(dev->id);
+        errcode = shtrih_ltfrk_get_state(dev->id); // saves the speed printer reports
+
+        if ( ! errcode && dd->reported_speed < 0 && io_speed != dd->saved_speed && save_device_speed(dev, io_speed) )
+          dd->saved_speed = io_speed;
 
         if ( ! errcode )
           send_command_fmt(dev, "\x13%c%c%c%c", dd->admin_password[0], dd->admin_password[1],dd->admin_password[2], dd->admin_password[3]); // beep!!!
@@ -240,7 +272,7 @@ int shtrih_ltfrk_port_init(int devid)
     } // for(speed_try)
   } //for(splist_idx)
 
-  dev->state = STATE_NEEDRECONNECT;
+  DEV_SET_STATE(dev, STATE_NEEDRECONNECT);
 
   return INITPORT_GENERALERROR; // really we shouldn't be here ever
 }
@@ -0,0 +1,196 @@
+/** \file shtrih_ltfrk_transaction.c
+* \brief Fiscal printers daemon's driver for Shtrih-FR-K printer - printing of whole fiscal document
+*
+* V1.200. Written by Andrej Pakhutin
+*
+* !!! This file is being #include-d into shtrih_ltfrk.c just to avoid Makefile hell
+****************************************************/
+#define SHTRIH_LTFRK_TRANSACTION_C
+/*
+#include "shtrih_ltfrk.h"
+#include "../fiscaldoc.h"
+*/
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Puts little-endian number of n bytes as printer's commands have them
+ *
+ * \param p unsigned char* - destination
+ * \param v uint64_t - value
+ * \param n int - bytes
+ * \return unsigned char* - ptr after the field
+*/
+static unsigned char *put_le(unsigned char *p, uint64_t v, int n)
+{
+  while ( n-- > 0 )
+  {
+    *p++ = v & 0xff;
+    v >>= 8;
+  }
+
+  return p;
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Puts printer's line text padded with spaces
+ *
+ * \param p unsigned char* - destination
+ * \param text char* - text, FDOC_TEXT_MAX at most
+ * \return unsigned char* - ptr after the field
+*/
+static unsigned char *put_text(unsigned char *p, char *text)
+{
+  int n;
+
+  n = strlen(text);
+  memcpy(p, text, n);
+  memset(p + n, ' ', FDOC_TEXT_MAX - n);
+
+  return p + FDOC_TEXT_MAX;
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver internal. Sends one command of the document
+ *
+ * \param dev struct t_device * - ptr to device data struct
+ * \param cmd unsigned char* - command
+ * \param end unsigned char* - ptr after the command's last byte
+ * \return int - printer's error code from the answer, -1 on communication error
+*/
+static int transaction_step(struct t_device *dev, unsigned char *cmd, unsigned char *end)
+{
+  if ( 0 != send_command(dev, (char*)cmd, end - cmd) || dev->buf_ptr < 4 )
+    return -1;
+
+  note_answer_state(dev);
+
+  return dev->buf[3];
+}
+
+//===========================================================================
+/** \brief Shtrih-FR-K driver. Method that prints whole fiscal document: header lines, open, positions, footer lines, close
+ *
+ * \param devid int - device id
+ * \param doc struct t_fiscal_doc * - validated document. see fiscaldoc.c
+ * \return int - 0 - OK, 1 if document failed
+ *
+ * Result text is left in devices[devid]->buf:
+ * "total <kopecks>\nchange <kopecks>\n" if printed, or
+ * "step <n>\ncommand <code>\nerrcode <printer's error code, -1 on communication error>\ncancel <0 - not needed, 1 - done, -1 - failed>\n"
+ * Once the document is opened, it is cancelled on any failure, so printer is not left with the half of cheque.
+*/
+int shtrih_ltfrk_transaction(int devid, struct t_fiscal_doc *doc)
+{
+  struct t_driver_data *dd;
+  struct t_device *dev;
+  unsigned char cmd[80], pass[4], *p;
+  int i, step, err, opened, cancel;
+  uint64_t change;
+
+  dev = get_dev_by_id(devid);
+  dd = dev->driver_data;
+
+  if ( doc->password == -1 )
+    memcpy(pass, dd->admin_password, 4);
+  else
+    put_le(pass, doc->password, 4);
+
+  step = 0;
+  opened = 0;
+  err = 0;
+
+  // lines before document are printed on the cheque tape as is
+  for ( i = 0; i < doc->header_count && err == 0; ++i )
+  {
+    ++step;
+    p = cmd;
+    *p++ = 0x17;
+    memcpy(p, pass, 4); p += 4;
+    *p++ = 1; // cheque tape
+    p = put_text(p, doc->header[i]);
+    err = transaction_step(dev, cmd, p);
+  }
+
+  if ( err == 0 )
+  {
+    ++step;
+    p = cmd;
+    *p++ = 0x8D;
+    memcpy(p, pass, 4); p += 4;
+    *p++ = doc->type;
+    err = transaction_step(dev, cmd, p);
+    opened = ( err <= 0 ); // refused by printer - not opened. lost answer - may be
+  }
+
+  for ( i = 0; i < doc->pos_count && err == 0; ++i )
+  {
+    ++step;
+    p = cmd;
+    *p++ = 0x80 + doc->type; // sale, buy, return of sale, return of buy
+    memcpy(p, pass, 4); p += 4;
+    p = put_le(p, doc->pos[i].qty, 5);
+    p = put_le(p, doc->pos[i].price, 5);
+    *p++ = doc->pos[i].division;
+    *p++ = doc->pos[i].tax[0];
+    *p++ = doc->pos[i].tax[1];
+    *p++ = doc->pos[i].tax[2];
+    *p++ = doc->pos[i].tax[3];
+    p = put_text(p, doc->pos[i].text);
+    err = transaction_step(dev, cmd, p);
+  }
+
+  for ( i = 0; i < doc->footer_count && err == 0; ++i )
+  {
+    ++step;
+    p = cmd;
+    *p++ = 0x17;
+    memcpy(p, pass, 4); p += 4;
+    *p++ = 1;
+    p = put_text(p, doc->footer[i]);
+    err = transaction_step(dev, cmd, p);
+  }
+
+  if ( err == 0 )
+  {
+    ++step;
+    p = cmd;
+    *p++ = 0x85;
+    memcpy(p, pass, 4); p += 4;
+
+    for ( i = 0; i < FDOC_PAY_KINDS; ++i )
+      p = put_le(p, doc->payment[i], 5);
+
+    p = put_le(p, 0, 2); // discount
+    p = put_le(p, 0, 4); // taxes
+    p = put_text(p, "");
+    err = transaction_step(dev, cmd, p);
+  }
+
+  if ( err == 0 )
+  {
+    change = 0;
+
+    if ( dev->buf_ptr >= 10 )
+      for ( i = 9; i >= 5; --i )
+        change = (change << 8) | dev->buf[i];
+
+    snprintf((char*)(dev->buf), dev->buf_size, "total %llu\nchange %llu\n", (unsigned long long)doc->total, (unsigned long long)change);
+
+    return 0;
+  }
+
+  i = cmd[0]; // failed command's code. cmd[] is reused by cancel
+  cancel = 0;
+
+  if ( opened )
+  {
+    p = cmd;
+    *p++ = 0x88;
+    memcpy(p, pass, 4); p += 4;
+    cancel = ( 0 == transaction_step(dev, cmd, p) ? 1 : -1 );
+  }
+
+  dosyslog(LOG_ERR, "shtrih_ltfrk: dev %d: transaction failed at step %d, command %#x, errcode %d, cancel %d", dev->id, step, i, err, cancel);
+
+  snprintf((char*)(dev->buf), dev->buf_size, "step %d\ncommand %d\nerrcode %d\ncancel %d\n", step, i, err, cancel);
+
+  return 1;
+}
@@ -3,7 +3,15 @@
 *
 * V1.200. Initial code by Andrej Pakhutin
 ****************************************************/
+#include <ctype.h>
+
 #include "fprnconfig.h"
+#include "devworker.h"
+#include "devsched.h"
+#include "fiscaldoc.h"
+#include "cmdstats.h"
+#include "flightrec.h"
+#include "printers_common.h"
 #include "../libs/b64.h"
 
 char *std_answers[] =
@@ -20,148 +28,985 @@ char *std_answers[] =
   "404 command parameter error\r\n",
 #define SA_DEVINUSE 5
   "405 device already in use\r\n",
+#define SA_JOBPENDING 6
+  "202 job in progress\r\n",
+#define SA_NOJOB 7
+  "406 no such job\r\n",
+#define SA_DEVINIT 8
+  "407 device initializing\r\n",
+#define SA_NOTAVAIL 9
+  "408 not available\r\n",
+#define SA_TRANSFAIL 10
+  "410 transaction failed\r\n",
   NULL
 };
 
+/* binary mode frame header. switched on by HELLO BINARY. all numbers are in network byte order
+   0: uint32 payload length
+   4: uint32 device id
+   8: uint8  operation, BIN_OP_*. answer has the same op as request
+   9: uint8  reserved, 0
+  10: uint16 answer's status code as in std_answers, like 200 or 403. 0 in request
+*/
+#define BIN_HDR_SIZE 12
+#define BIN_MAX_PAYLOAD 65536
+
+#define BIN_OP_SEND     1 // payload is raw command for printer. answer's payload is raw printer's answer
+#define BIN_OP_DEVSTATE 2 // answer's payload is the same as with text DEVSTATE
+#define BIN_OP_DEVTYPE  3 // --"-- DEVTYPE
+
+// per-connection data of the answering side. indexed the same way as ap_tcp_connections[]
+typedef struct t_tcp_session
+{
+  int dev_index; // index in devices[] of the current command's target
+  t_dev_job *job; // job queued to device's worker and not answered yet or NULL
+  t_dev_job *wait_job; // async job that RESULT command waits for or NULL
+  ap_evloop_timer_t wait_timer; // stops waiting for wait_job
+  int keepalive; // do not close connection after answer. set by KEEPALIVE command
+  char *outbuf; // long answers are prepared here, so input buffer with pipelined commands stays intact
+  int outbuf_size;
+  int binary; // connection uses binary frames instead of text lines. set by HELLO BINARY
+  int peer_closed; // peer has shut down its sending side. pending answers are still delivered
+  int lease_wait; // LEASE request waits in device's queue. see devsched.c
+  t_fiscal_doc *doc; // TRANSACTION's document while its lines arrive or NULL
+  int doc_bad; // --"--. there was malformed line. the rest is read anyway to keep the stream in sync
+} t_tcp_session;
+
+static t_tcp_session *sessions = NULL;
+
+static t_dev_job *async_jobs = NULL; // SUBMIT'ted jobs, both pending and finished
+static unsigned next_job_id;
+
+static void tcp_send_answer(int tcp_conn_idx, int exec_status, char *answer_ptr, int answer_len);
+static void job_answer_frame(int tcp_conn_idx, t_dev_job *job);
+void tcp_answer(int tcp_conn_idx);
+static void tcp_update_events(int tcp_conn_idx);
+void tcp_output_pending(int tcp_conn_idx, int pending);
+static void answer_waiter(int tcp_conn_idx, t_dev_job *job);
+static void tcp_lease_granted(int tcp_conn_idx, struct t_device *dev);
+
 //=============================================================================
-/** \brief checking if data available for reading from file descriptor
+/** \brief Makes room for the new input in connection's buffer
  *
- * \param fd int - file descriptor
- * \return int - num of fds ready (see select())
+ * \param tc struct ap_tcp_connection_t * - connection
+ * \param need int - free bytes needed after the data end
+ * \param cap int - max buffer size, 0 if unlimited
+ * \return int - boolean. false if it would exceed the cap
+ *
+ * Processed data at the buffer's head is dropped only if it is not less than the data to move
+ * or the cap is reached, otherwise buffer is doubled. Both keep the cost of input linear.
+*/
+static int tcp_buf_room(struct ap_tcp_connection_t *tc, int need, int cap)
+{
+  int n;
+
+  if ( tc->bufsize - tc->bufptr >= need )
+    return 1;
+
+  n = tc->bufptr - tc->bufstart; // unprocessed data
+
+  if ( tc->bufstart > 0 && (tc->bufstart >= n || (cap > 0 && tc->bufptr + need > cap)) )
+  {
+    memmove(tc->buf, tc->buf + tc->bufstart, n);
+    tc->scanpos -= tc->bufstart;
+    tc->bufptr = n;
+    tc->bufstart = 0;
+
+    if ( debug_want(10) )
+      debuglog("*debug: buffer compacted to %d bytes\n", n);
+
+    if ( tc->bufsize - tc->bufptr >= need )
+      return 1;
+  }
+
+  n = tc->bufsize * 2;
+
+  if ( n < tc->bufptr + need )
+    n = tc->bufptr + need;
+
+  if ( cap > 0 && n > cap )
+    n = cap;
+
+  if ( n - tc->bufptr < need )
+    return 0;
+
+  if ( NULL == (tc->buf = realloc(tc->buf, n)) )
+  {
+    dosyslog(LOG_ERR, "realloc error from %d to %d bytes", tc->bufsize, n);
+    exit(1);
+  }
+
+  tc->bufsize = n;
+
+  return 1;
+}
+
+//=============================================================================
+/** \brief Reads what is available from connection into its buffer
  *
- * copying from aptcp.c:
- * according to the mans what's down below is total bullshit.
- * you always have to monitor for EPIPE and EAGAIN errors and, possibly for 0 bytes read return as eof() indication specifically.
- * The read and write states on non-blocked socket are always ON.
+ * \param tc struct ap_tcp_connection_t * - connection
+ * \return int - bytes read. 0 if there is nothing now or on error
 */
-int check_for_data(int fd)
+static int tcp_read_input(struct ap_tcp_connection_t *tc)
 {
-  struct timeval tv;
   int n;
-  fd_set fds;
 
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
+  // socket is non-blocking, so EAGAIN just means that event loop woke us for the data we have read already
+  n = read(tc->fd, tc->buf + tc->bufptr, tc->bufsize - tc->bufptr);
+
+  if (n < 0)
+  {
+    if (errno != EAGAIN)
+      dosyslog(LOG_ERR, "tcp_answer: read: %s\n", strerror(errno));
+
+    return 0;
+  }
+
+  tc->bufptr += n;
+
+  if (debug_want(1))
+    debuglog("tcp conn fd: %d read: %d bytes, start: %d, end: %d, size: %d\n", tc->fd, n, tc->bufstart, tc->bufptr, tc->bufsize);
+
+  return n;
+}
+
+//=============================================================================
+/** \brief Get next line of data from TCP connection
+ *
+ * \param tc struct ap_tcp_connection_t * - connection data structure to use
+ * \param line_len int* - set to the line length
+ * \return char* - ptr to the line or NULL if there is no complete line yet
+ *
+ * Line is zero-terminated in place and stays valid until the next call. Empty lines are skipped.
+ * Socket is read only when buffer has no complete line, and the EOL search continues where the previous one stopped.
+ * Connection is closed if the line does not fit into ap_tcp_max_bufsize.
+ * Used to accumulate input from TCP peer in waiting for another command.
+*/
+char *tcp_get_line(struct ap_tcp_connection_t *tc, int *line_len)
+{
+  char *s, *eol, *cr;
+  int n;
+
+  *line_len = 0;
+
+  for(;;)
+  {
+    // skipping empty lines and LF of CR LF pair that came after the previous line
+    while ( tc->bufstart < tc->bufptr && (tc->buf[tc->bufstart] == '\r' || tc->buf[tc->bufstart] == '\n') )
+      ++tc->bufstart;
+
+    if ( tc->bufstart == tc->bufptr ) // all is processed. reusing buffer from the beginning
+      tc->bufstart = tc->bufptr = tc->scanpos = 0;
+    else if ( tc->scanpos < tc->bufstart )
+      tc->scanpos = tc->bufstart;
+
+    s = tc->buf + tc->scanpos;
+    n = tc->bufptr - tc->scanpos;
+
+    if ( NULL == (eol = memchr(s, '\n', n)) )
+      cr = memchr(s, '\r', n);
+    else
+      cr = memchr(s, '\r', eol - s);
+
+    if ( cr != NULL )
+      eol = cr;
+
+    if ( eol != NULL )
+    {
+      *eol = '\0';
+      s = tc->buf + tc->bufstart;
+      *line_len = eol - s;
+      tc->bufstart = tc->scanpos = eol - tc->buf + 1;
+
+      return s;
+    }
+
+    tc->scanpos = tc->bufptr; // no EOL in there
+
+    n = ap_tcp_max_bufsize - (tc->bufptr - tc->bufstart); // what is left for this line
+
+    if ( n <= 0 || ! tcp_buf_room(tc, (n < 1024 ? n : 1024), ap_tcp_max_bufsize) )
+    {
+      dosyslog(LOG_ERR, "TCP Conn %d: line is longer than %d bytes. closing", tc->idx, ap_tcp_max_bufsize);
+      ap_tcp_close_connection(tc->idx, NULL);
+      return NULL;
+    }
+
+    if ( 0 == tcp_read_input(tc) )
+      return NULL;
+  }
+}
+
+//=============================================================================
+/** \brief Get next complete binary frame from TCP connection
+ *
+ * \param tc struct ap_tcp_connection_t * - connection data structure to use
+ * \param payload_len int* - set to the payload length. -1 if frame header is bad
+ * \return unsigned char* - ptr to the frame (header + payload) or NULL if it is incomplete yet
+ *
+ * Binary mode counterpart of tcp_get_line(). Uses the same buffer. Frame stays valid until the next call.
+*/
+static unsigned char *tcp_get_frame(struct ap_tcp_connection_t *tc, int *payload_len)
+{
+  unsigned char *frame;
+  int avail, need;
+  uint32_t len;
+
+  *payload_len = 0;
+
+  if ( tc->bufstart == tc->bufptr ) // all is processed. reusing buffer from the beginning
+    tc->bufstart = tc->bufptr = tc->scanpos = 0;
+
+  for(;;)
+  {
+    avail = tc->bufptr - tc->bufstart;
+    need = BIN_HDR_SIZE;
+
+    if ( avail >= BIN_HDR_SIZE )
+    {
+      memcpy(&len, tc->buf + tc->bufstart, 4);
+      len = ntohl(len);
+
+      if ( len > BIN_MAX_PAYLOAD )
+      {
+        *payload_len = -1;
+        return NULL;
+      }
+
+      need += len;
+
+      if ( avail >= need )
+      {
+        frame = (unsigned char*)(tc->buf + tc->bufstart);
+        tc->bufstart += need;
+        *payload_len = len;
+
+        return frame;
+      }
+    }
+
+    tcp_buf_room(tc, need - avail, 0); // payload size is checked already
+
+    if ( 0 == tcp_read_input(tc) )
+      return NULL;
+  }
+}
+
+//=============================================================================
+#define CMDCODE_SEND     1
+#define CMDCODE_DEVSTATE 2
+#define CMDCODE_DEVTYPE  3
+#define CMDCODE_LDPSTATE 4
+#define CMDCODE_SVPSTATE 5
+#define CMDCODE_MONITOR  6
+#define CMDCODE_SUBMIT   7
+#define CMDCODE_RESULT   8
+#define CMDCODE_KEEPALIVE 9
+#define CMDCODE_HELLO    10
+#define CMDCODE_STATS    11
+#define CMDCODE_FLIGHTREC 12
+#define CMDCODE_LEASE    13
+#define CMDCODE_RELEASE  14
+#define CMDCODE_TRANSACTION 15
+
+//=============================================================================
+/** \brief RESULT's wait timer handler. Answers the waiter that the job is still pending
+ *
+ * \param timer ap_evloop_timer_t * - session's wait timer
+ * \param data void* - ptr to session
+ * \return void
+*/
+static void wait_timer_expired(ap_evloop_timer_t *timer, void *data)
+{
+  answer_waiter((t_tcp_session *)data - sessions, NULL);
+}
+
+//=============================================================================
+/** \brief Async job's keep timer handler. Drops the result that was not fetched by RESULT command
+ *
+ * \param timer ap_evloop_timer_t * - job's keep timer
+ * \param data void* - ptr to job
+ * \return void
+*/
+static void job_keep_expired(ap_evloop_timer_t *timer, void *data)
+{
+  t_dev_job *job, **pjob;
+
+  job = (t_dev_job *)data;
+
+  for ( pjob = &async_jobs; *pjob != job; pjob = &(*pjob)->async_next );
+
+  *pjob = job->async_next;
+
+  if (debug_want(1))
+    debuglog("* debug: job %u result expired\n", job->id);
+
+  devjob_free(job);
+}
+
+//=============================================================================
+/** \brief Allocates per-connection data. Should be called after config is read
+ *
+ * \param void
+ * \return void
+*/
+void tcp_answer_init(void)
+{
+  int i;
+
+  sessions = getmem(ap_tcp_max_connections * sizeof(t_tcp_session), "tcp_answer_init: malloc");
+  memset(sessions, 0, ap_tcp_max_connections * sizeof(t_tcp_session));
+
+  for ( i = 0; i < ap_tcp_max_connections; ++i )
+    ap_evloop_timer_init(&sessions[i].wait_timer, wait_timer_expired, &sessions[i]);
+
+  next_job_id = (unsigned)time(NULL); // lowers the chance that peer gets other's result after daemon restart
+
+  ap_tcp_output_hook = tcp_output_pending;
+
+  devsched_module_init(tcp_lease_granted);
+}
+
+//=============================================================================
+/** \brief Forgets the connection's state. Called when connection is closed
+ *
+ * \param tcp_conn_idx int - connection index
+ * \return void
+ *
+ * The job that is still in device's queue is not cancelled, its result will be just dropped on completion
+*/
+void tcp_session_reset(int tcp_conn_idx)
+{
+  t_dev_job *job;
+
+  for ( job = async_jobs; job != NULL; job = job->async_next ) // connection's lease is gone. index could be reused
+    if ( job->sched_conn == tcp_conn_idx )
+      job->sched_conn = -1;
+
+  sessions[tcp_conn_idx].job = NULL;
+  sessions[tcp_conn_idx].wait_job = NULL;
+  ap_evloop_timer_stop(&sessions[tcp_conn_idx].wait_timer);
+  sessions[tcp_conn_idx].keepalive = 0;
+  sessions[tcp_conn_idx].binary = 0;
+  sessions[tcp_conn_idx].peer_closed = 0;
+  sessions[tcp_conn_idx].lease_wait = 0;
+
+  if ( sessions[tcp_conn_idx].doc != NULL )
+  {
+    free(sessions[tcp_conn_idx].doc);
+    sessions[tcp_conn_idx].doc = NULL;
+  }
+
+  devsched_conn_gone(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief Checks if connection waits for the device to answer
+ *
+ * \param tcp_conn_idx int - connection index
+ * \return int - boolean
+*/
+int tcp_answer_pending(int tcp_conn_idx)
+{
+  return sessions[tcp_conn_idx].job != NULL || sessions[tcp_conn_idx].wait_job != NULL || sessions[tcp_conn_idx].lease_wait;
+}
+
+//=============================================================================
+/** \brief Sets the event loop's mask for connection according to its session state
+ *
+ * \param tcp_conn_idx int - connection index
+ * \return void
+ *
+ * Input is paused while the answer is pending or connection is to be closed.
+ * Writability is watched only while there is queued output.
+*/
+static void tcp_update_events(int tcp_conn_idx)
+{
+  struct ap_tcp_connection_t *tc;
+  uint32_t events;
+
+  tc = &ap_tcp_connections[tcp_conn_idx];
+
+  if ( tc->fd == 0 )
+    return;
+
+  events = 0;
+
+  if ( ! sessions[tcp_conn_idx].peer_closed )
+  {
+    events = EPOLLRDHUP;
+
+    if ( ! tcp_answer_pending(tcp_conn_idx) && ! tc->close_pending )
+      events |= EPOLLIN;
+  }
+
+  if ( tc->obufptr > tc->obufsent )
+    events |= EPOLLOUT;
+
+  ap_evloop_mod(tc->fd, events);
+}
+
+//=============================================================================
+/** \brief ap_tcp_output_hook implementation. Connection got some output queued or its queue is empty now
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param pending int - boolean. there is queued output
+ * \return void
+*/
+void tcp_output_pending(int tcp_conn_idx, int pending)
+{
+  tcp_update_events(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief Peer has shut down its sending side. Connection is closed as soon as the pending answers are delivered
+ *
+ * \param tcp_conn_idx int - connection index
+ * \return void
+*/
+void tcp_peer_closed(int tcp_conn_idx)
+{
+  sessions[tcp_conn_idx].peer_closed = 1;
+
+  if ( ! tcp_answer_pending(tcp_conn_idx) )
+    ap_tcp_close_when_sent(tcp_conn_idx);
+
+  tcp_update_events(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief Passes the job to device's worker. The answer will be sent from tcp_job_done()
+ *
+ * \param tcp_conn_idx int - requesting connection
+ * \param job t_dev_job * - job
+ * \return void
+ *
+ * Printer's command waits for the other client's lease to be dropped, see devsched.c
+ * Whole fiscal documents go before the other waiting commands
+*/
+static void submit_job(int tcp_conn_idx, t_dev_job *job)
+{
+  job->conn_idx = tcp_conn_idx;
+  job->sched_conn = tcp_conn_idx;
+  sessions[tcp_conn_idx].job = job;
+
+  tcp_update_events(tcp_conn_idx); // no more input until answered
+  ap_tcp_conn_idle_stop(tcp_conn_idx); // device's wait is bound by driver's timeouts, not ours
+
+  if ( job->type == DEVJOB_GETSTATE )
+  {
+    devworker_submit(job);
+    return;
+  }
+
+  devsched_activity(job->dev, tcp_conn_idx, 1);
+  devsched_submit(job, (job->type == DEVJOB_TRANSACTION ? SCHED_PRIO_FISCAL : SCHED_PRIO_NORMAL));
+}
+
+//=============================================================================
+/** \brief Queues device's status query for the connection or attaches it to the one in flight already
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param dev_index int - device index
+ * \return void
+ *
+ * Status queries of the same device are collapsed, so N pollers cost one printer's query.
+ * All connections attached get the same answer from tcp_job_done()
+*/
+static void submit_status_job(int tcp_conn_idx, int dev_index)
+{
+  struct t_device *dev;
+
+  dev = &devices[dev_index];
+
+  if ( dev->status_job == NULL )
+  {
+    dev->status_job = devjob_new(DEVJOB_GETSTATE, dev);
+    submit_job(tcp_conn_idx, dev->status_job);
+    return;
+  }
+
+  if (debug_want(3))
+    debuglog("tcp conn %d: attached to status query of dev %d in flight\n", tcp_conn_idx, dev->id);
+
+  sessions[tcp_conn_idx].job = dev->status_job;
+  tcp_update_events(tcp_conn_idx); // no more input until answered
+  ap_tcp_conn_idle_stop(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief Makes DEVSTATE answer from device's status snapshot if it is fresh enough
+ *
+ * \param dev_index int - device index
+ * \param max_age int - seconds
+ * \param answer char* - output buffer. at least 1024 bytes
+ * \return int - answer length or -1 if snapshot is missing or too old
+ *
+ * driver's state is the current one, the text is the snapshot's
+*/
+static int cached_status_answer(int dev_index, int max_age, char *answer)
+{
+  int n;
+
+  n = sprintf(answer, "%d\n", DEV_STATE(&devices[dev_index]));
+
+  if ( -1 == dev_status_get(&devices[dev_index], max_age, answer + n) )
+    return -1;
+
+  n += strlen(answer + n);
+  answer[n++] = '\n';
+
+  return n;
+}
+
+//=============================================================================
+/** \brief Makes the answer to peer from the results of job done by device's worker
+ *
+ * \param ts t_tcp_session * - session to answer to. its output buffer is used for long answers
+ * \param job t_dev_job * - finished job
+ * \param answer char* - buffer for the short answers. at least 1024 bytes
+ * \param answer_ptr char** - set to the answer data
+ * \param answer_len int* - set to the answer data length
+ * \return int - SA_* status
+*/
+static int job_answer(t_tcp_session *ts, t_dev_job *job, char *answer, char **answer_ptr, int *answer_len)
+{
+  int n;
+
+  *answer_ptr = answer;
+  *answer_len = 0;
+
+  if ( job->type == DEVJOB_SEND )
+  {
+    if ( job->errcode != 0 )
+    {
+      *answer_len = sprintf(answer, "%d\n", job->dev_state);
+      return SA_PRINTERERROR;
+    }
+
+    // sent OK. we answer with %06d length, encoded data, LF
+    *answer_len = BASE64_ENCODED_LEN(job->answer_len);
+    n = 0;
+
+    if ( ! check_buf_size(&ts->outbuf, &ts->outbuf_size, &n, *answer_len + 8) )
+    {
+      dosyslog(LOG_ERR, "realloc for +%d: %m", *answer_len + 8);
+      exit(1);
+    }
+
+    sprintf(ts->outbuf, "%06d", *answer_len + 1);
+    base64_encode_buf(job->answer, job->answer_len, ts->outbuf + 6);
+    ts->outbuf[*answer_len + 6] = '\n';
+    *answer_len += 7;
+    *answer_ptr = ts->outbuf;
+  }
+  else if ( job->type == DEVJOB_GETSTATE )
+  {
+    if ( job->errcode != 0 )
+    {
+      *answer_len = sprintf(answer, "device state: %d\n", job->dev_state);
+      return SA_PRINTERERROR;
+    }
+
+    *answer_len = snprintf(answer, 1024, "%d\n%s\n", job->dev_state, job->answer);
+
+    if ( *answer_len >= 1024 )
+      *answer_len = 1023;
+  }
+  else if ( job->type == DEVJOB_TRANSACTION ) // driver's result text either way
+  {
+    *answer_len = snprintf(answer, 1024, "%s", job->answer);
+
+    if ( *answer_len >= 1024 )
+      *answer_len = 1023;
+
+    if ( job->errcode != 0 )
+      return SA_TRANSFAIL;
+  }
+
+  return SA_OK;
+}
+
+//=============================================================================
+/** \brief Sends the result of async job to the connection that waits for it with RESULT command
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param job t_dev_job * - job. NULL if waiting timed out
+ * \return void
+*/
+static void answer_waiter(int tcp_conn_idx, t_dev_job *job)
+{
+  int exec_status, answer_len;
+  char answer[1024], *answer_ptr;
+  struct ap_tcp_connection_t *tc;
+
+  tc = &ap_tcp_connections[tcp_conn_idx];
+  sessions[tcp_conn_idx].wait_job = NULL;
+  ap_evloop_timer_stop(&sessions[tcp_conn_idx].wait_timer);
+
+  tcp_update_events(tcp_conn_idx);
+
+  if ( job == NULL )
+  {
+    exec_status = SA_JOBPENDING;
+    answer_ptr = answer;
+    answer_len = 0;
+  }
+  else
+    exec_status = job_answer(&sessions[tcp_conn_idx], job, answer, &answer_ptr, &answer_len);
+
+  tcp_send_answer(tcp_conn_idx, exec_status, answer_ptr, answer_len);
+
+  if ( tc->fd != 0 ) // keep-alive peer could send more commands already
+    tcp_answer(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief devsched's on_lease handler. Answers LEASE request that waited for the other client
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param dev struct t_device * - leased device
+ * \return void
+*/
+static void tcp_lease_granted(int tcp_conn_idx, struct t_device *dev)
+{
+  struct ap_tcp_connection_t *tc;
+
+  tc = &ap_tcp_connections[tcp_conn_idx];
+  sessions[tcp_conn_idx].lease_wait = 0;
+
+  tcp_update_events(tcp_conn_idx);
+  tcp_send_answer(tcp_conn_idx, SA_OK, NULL, 0);
+
+  if ( tc->fd != 0 ) // peer could send transaction's commands already
+    tcp_answer(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief Sends the result of job to connection that waits for it
+ *
+ * \param idx int - connection index
+ * \param job t_dev_job * - finished job. not freed here
+ * \return void
+*/
+static void answer_session(int idx, t_dev_job *job)
+{
+  int exec_status, answer_len;
+  char answer[1024], *answer_ptr;
+  struct ap_tcp_connection_t *tc;
+
+  tc = &ap_tcp_connections[idx];
+  sessions[idx].job = NULL;
+
+  if ( job->type != DEVJOB_GETSTATE )
+    devsched_activity(job->dev, idx, 0);
+
+  tcp_update_events(idx);
+
+  if ( sessions[idx].binary )
+    job_answer_frame(idx, job);
+  else
+  {
+    exec_status = job_answer(&sessions[idx], job, answer, &answer_ptr, &answer_len);
+    tcp_send_answer(idx, exec_status, answer_ptr, answer_len);
+  }
+
+  if ( tc->fd != 0 ) // keep-alive peer could send more commands already
+    tcp_answer(idx);
+}
+
+//=============================================================================
+/** \brief Answers the peer with results of the job done by device's worker
+ *
+ * \param job t_dev_job * - finished job. freed here unless it is async one
+ * \return void
+ *
+ * Called from event loop. If requesting connection is gone already, then result is dropped.
+ * Async job's result is stored until RESULT command fetches it or job_keep_time passes.
+ * Status query is answered to all connections attached to it, including the background poller's one.
+*/
+void tcp_job_done(t_dev_job *job)
+{
+  int idx;
+
+  if ( job->id != 0 ) // async
+  {
+    job->done = 1;
+
+    if ( job->sched_conn != -1 ) // requester's lease timeout goes on
+      devsched_activity(job->dev, job->sched_conn, 0);
+
+    ap_evloop_timer_init(&job->keep_timer, job_keep_expired, job);
+    ap_evloop_timer_start(&job->keep_timer, job_keep_time * 1000);
+
+    for ( idx = 0; idx < ap_tcp_max_connections; ++idx )
+      if ( sessions[idx].wait_job == job )
+        answer_waiter(idx, job);
+
+    return;
+  }
+
+  if ( job->type == DEVJOB_GETSTATE ) // see submit_status_job()
+  {
+    if ( job->dev->status_job == job )
+      job->dev->status_job = NULL; // the next query is a new one
+
+    for ( idx = 0; idx < ap_tcp_max_connections; ++idx )
+      if ( sessions[idx].job == job )
+        answer_session(idx, job);
+
+    devjob_free(job);
+    return;
+  }
+
+  idx = job->conn_idx;
+
+  if ( idx == -1 || sessions[idx].job != job ) // closed or expired while waiting
+  {
+    if (debug_want(1) && idx != -1)
+      debuglog("tcp conn %d: is gone. dropping the answer of dev %d\n", idx, job->dev->id);
+
+    devjob_free(job);
+    return;
+  }
+
+  answer_session(idx, job);
+  devjob_free(job);
+}
+
+//=============================================================================
+/** \brief Sends binary mode answer frame
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param op int - BIN_OP_* of request
+ * \param devid int - device id of request
+ * \param exec_status int - SA_*
+ * \param data const void* - payload
+ * \param len int - payload length
+ * \return void
+ *
+ * Binary connection is never closed by us, so the idle timeout is restarted here
+*/
+static void tcp_send_frame(int tcp_conn_idx, int op, int devid, int exec_status, const void *data, int len)
+{
+  struct ap_tcp_connection_t *tc;
+  unsigned char hdr[BIN_HDR_SIZE];
+  struct iovec iov[2];
+  uint32_t u32;
+  uint16_t u16;
+
+  tc = &ap_tcp_connections[tcp_conn_idx];
+
+  u32 = htonl(len);
+  memcpy(hdr, &u32, 4);
+  u32 = htonl(devid);
+  memcpy(hdr + 4, &u32, 4);
+  hdr[8] = op;
+  hdr[9] = 0;
+  u16 = htons(atoi(std_answers[exec_status]));
+  memcpy(hdr + 10, &u16, 2);
+
+  // header and payload go out with single call, payload is not copied
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = BIN_HDR_SIZE;
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = len;
+
+  if ( -1 == ap_tcp_conn_sendv(tcp_conn_idx, iov, (len > 0 ? 2 : 1)) )
+    return; // connection is closed already
+
+  if (debug_want(1))
+    debuglog("* debug: binary answer: op %d, dev %d, %d bytes, %s", op, devid, len, std_answers[exec_status]);
+
+  tc->state = TC_ST_READY;
+  ap_tcp_conn_idle_restart(tcp_conn_idx);
+}
+
+//=============================================================================
+/** \brief Binary mode counterpart of job_answer(). Sends the results of the job done by device's worker
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param job t_dev_job * - finished job
+ * \return void
+*/
+static void job_answer_frame(int tcp_conn_idx, t_dev_job *job)
+{
+  char answer[64], *s;
+  int n;
+
+  if ( job->errcode != 0 )
+  {
+    n = sprintf(answer, "%d\n", job->dev_state);
+    tcp_send_frame(tcp_conn_idx, (job->type == DEVJOB_SEND ? BIN_OP_SEND : BIN_OP_DEVSTATE), job->dev->id, SA_PRINTERERROR, answer, n);
+  }
+  else if ( job->type == DEVJOB_SEND )
+    tcp_send_frame(tcp_conn_idx, BIN_OP_SEND, job->dev->id, SA_OK, job->answer, job->answer_len);
+  else // status text follows the state as in text mode
+  {
+    s = getmem(job->answer_len + 16, "job_answer_frame: malloc");
+    n = sprintf(s, "%d\n%s\n", job->dev_state, job->answer);
+    tcp_send_frame(tcp_conn_idx, BIN_OP_DEVSTATE, job->dev->id, SA_OK, s, n);
+    free(s);
+  }
+}
+
+//=============================================================================
+/** \brief Sends standard answer and optional data, then closes connection if it is not a monitoring or keep-alive one
+ *
+ * \param tcp_conn_idx int - connection index
+ * \param exec_status int - SA_*
+ * \param answer_ptr char* - additional data. sent only if exec_status is SA_OK or SA_TRANSFAIL
+ * \param answer_len int - its length
+ * \return void
+*/
+static void tcp_send_answer(int tcp_conn_idx, int exec_status, char *answer_ptr, int answer_len)
+{
+  struct ap_tcp_connection_t *tc;
+  struct iovec iov[2];
+  int iovcnt;
+
+  tc = &ap_tcp_connections[tcp_conn_idx];
+
+  tc->state = TC_ST_OUTPUT;
+
+  // status line and data are gathered into single send, so the peer gets them in one segment
+  iov[0].iov_base = std_answers[exec_status];
+  iov[0].iov_len = strlen(std_answers[exec_status]);
+  iovcnt = 1;
+
+  if (debug_want(1))
+    debuglog("* debug: standard answer: %s\n", std_answers[exec_status]);
+
+  if ( (exec_status == SA_OK || exec_status == SA_TRANSFAIL) && answer_len > 0 )
+  {
+    iov[1].iov_base = answer_ptr;
+    iov[1].iov_len = answer_len;
+    iovcnt = 2;
+
+    if(debug_want(10))
+    {
+      debuglog("* debug: answer2:");
+      memdump(answer_ptr, answer_len); debuglog("\n");
+    }
+  }
 
-  n = select(fd + 1, &fds, NULL, NULL, &tv);
+  if ( -1 == ap_tcp_conn_sendv(tcp_conn_idx, iov, iovcnt) )
+    return; // connection is closed already
 
-  if (n < 0)
-    dosyslog(LOG_ERR, "select(): %m");
+  tc->state = TC_ST_READY;
 
-  return n;
+  if ( is_debug_handle(tc->fd) ) // MON subscribers persist until disconnect. stalled ones are dropped by logger
+    ap_tcp_conn_idle_stop(tcp_conn_idx);
+  else if ( sessions[tcp_conn_idx].keepalive ) // idle timeout restarts with each answer
+    ap_tcp_conn_idle_restart(tcp_conn_idx);
+  else
+  {
+    ap_tcp_conn_idle_restart(tcp_conn_idx); // bounds the delivery of the queued rest
+    ap_tcp_close_when_sent(tcp_conn_idx); // the rest of answer could still be queued
+    tcp_update_events(tcp_conn_idx);
+  }
 }
 
 //=============================================================================
-/** \brief Get next line of data from TCP connection
+/** \brief Binary mode counterpart of tcp_answer_command(). Executes the next complete frame
  *
- * \param tc struct ap_tcp_connection_t * - connection data structure to use
- * \return char* - ptr to read data
+ * \param tcp_conn_idx int - index of connection to check
+ * \return int - 1 if frame was answered, 0 if there is no complete frame yet or it waits for device
  *
- * returns ptr to the _next_complete_ line in buffer or NULL if none
- * Can enlarge buffer if needed.
- * Used to accumulate input from TCP peer in waiting for another command.
+ * Connection is closed on malformed frame as there is no way to re-sync the stream
 */
-char *tcp_get_line(struct ap_tcp_connection_t *tc)
+static int tcp_answer_frame(int tcp_conn_idx)
 {
-  char *s;
-  int i, n;
-  const int upsize = 1024; //how much to add to buf in case of overflow?
-
-  // nextline: init state = -1
-  if ( tc->nextline != -1 ) // moving to beginning of the buffer
-  {
-    if ( tc->nextline != 0 ) // tc->nextline == 0 is a special case-something was read, but not the full line.
-    {
-      n = tc->bufptr - tc->nextline;
-      memcpy(tc->buf, tc->buf + tc->nextline, n);
-      tc->bufptr = n;
+  struct ap_tcp_connection_t *tc;
+  unsigned char *frame;
+  char answer[1024];
+  int len, op, devid, dev_index, n;
+  uint32_t u32;
+  t_dev_job *job;
 
-      if ( debug_level > 9 )
-        debuglog("*debug: nextline-shifted %d bytes\n", n);
-
-      tc->nextline = 0;
-    }
-  }
-  else // no next line in buffer. resetting
-  {
-    tc->bufptr = 0;
-  }
+  tc = &ap_tcp_connections[tcp_conn_idx];
 
-  if ( tc->bufptr / (tc->bufsize / 100) > 90 ) // 90% of buffer filled. resizing
+  if ( NULL == (frame = tcp_get_frame(tc, &len)) )
   {
-    if ( tc->buf == ( s = realloc(tc->buf, tc->bufsize + upsize) ) )
+    if ( len == -1 )
     {
-      dosyslog(LOG_ERR, "realloc error from %d to %d bytes", tc->bufsize, tc->bufsize + upsize);
-      exit(1);
+      dosyslog(LOG_ERR, "TCP Conn %d: binary frame is too long. closing", tcp_conn_idx);
+      ap_tcp_close_connection(tcp_conn_idx, NULL);
     }
 
-    tc->bufsize += upsize;
-    tc->buf = s;
+    return 0;
   }
 
-  //if ( debug_level > 9 ) debuglog("before read: ptr: %d, nextl: %d, size: %d\n", tc->bufptr, tc->nextline, tc->bufsize);
-  // reading all what we can. even if we read 0 bytes, there is possibility that buffer already contains full string(s)
-  if ( check_for_data(tc->fd) > 0 )
-    n = read(tc->fd, tc->buf + tc->bufptr, tc->bufsize - tc->bufptr);
-  else
-    n = 0;
-  //if (debug_level) debuglog("read: %d\n", n);
+  memcpy(&u32, frame + 4, 4);
+  devid = ntohl(u32);
+  op = frame[8];
+
+  if (debug_want(1))
+    debuglog("tcp conn %d binary frame: op %d, dev %d, %d bytes\n", tcp_conn_idx, op, devid, len);
 
-  if (n < 0 && errno != EAGAIN)
+  if ( devid == 0 || -1 == (dev_index = dev_idx_by_id(devid)) )
   {
-    dosyslog(LOG_ERR, "tcp_answer: read: %s\n", strerror(errno));
-    return NULL;
+    tcp_send_frame(tcp_conn_idx, op, devid, SA_BADIDX, NULL, 0);
+    return 1;
   }
 
-  if (debug_level)
-    debuglog("tcp conn fd: %d read: %d bytes, ptr: %d, nextl: %d, size: %d\n", tc->fd, n, tc->bufptr, tc->nextline, tc->bufsize);
-
-  s = tc->buf; // always scan from the begin in case prev read() already got the full line
-  tc->bufptr += n;
+  // DEVSTATE's optional payload is uint32 max age of status snapshot in seconds
+  if ( op == BIN_OP_DEVSTATE && len >= 4 )
+  {
+    memcpy(&u32, frame + BIN_HDR_SIZE, 4);
 
-  for (i = 0; i < tc->bufptr; ++i, ++s)
-    if (*s == '\r' || *s == '\n' )
-      break;
+    if ( ntohl(u32) > 0 && -1 != (n = cached_status_answer(dev_index, ntohl(u32), answer)) )
+    {
+      tcp_send_frame(tcp_conn_idx, op, devid, SA_OK, answer, n);
+      return 1;
+    }
+  }
 
-  if ( i == tc->bufptr ) // no eol - waiting for more characters
+  if ( devices[dev_index].init_queued && (op == BIN_OP_SEND || op == BIN_OP_DEVSTATE) )
   {
-    tc->nextline = 0;
-    return NULL;
+    tcp_send_frame(tcp_conn_idx, op, devid, SA_DEVINIT, NULL, 0);
+    return 1;
   }
 
-  // marking end and skipping to the next line begin
-  *(s++) = '\0';
+  switch ( op )
+  {
+    case BIN_OP_SEND:
+      job = devjob_new(DEVJOB_SEND, &devices[dev_index]);
+      job->data = getmem(len + 1, "tcp_answer_frame: malloc");
+      memcpy(job->data, frame + BIN_HDR_SIZE, len);
+      job->data_size = len;
+      submit_job(tcp_conn_idx, job);
+      return 0;
 
-  while ( ++i < tc->bufptr && (*s == '\r' || *s == '\n' ) )
-    ++s;
+    case BIN_OP_DEVSTATE:
+      submit_status_job(tcp_conn_idx, dev_index);
+      return 0;
 
-  tc->nextline = (i == tc->bufptr ? -1 : i); // if there is no next line, then next call will just reset ptr
+    case BIN_OP_DEVTYPE:
+      len = sprintf(answer, "%d\n", devices[dev_index].device_type->type);
+      tcp_send_frame(tcp_conn_idx, op, devid, SA_OK, answer, len);
+      return 1;
+  }
 
-  return tc->buf;
+  tcp_send_frame(tcp_conn_idx, op, devid, SA_UNKCMD, NULL, 0);
+  return 1;
 }
 
 //=============================================================================
-#define CMDCODE_SEND     1
-#define CMDCODE_DEVSTATE 2
-#define CMDCODE_DEVTYPE  3
-#define CMDCODE_LDPSTATE 4
-#define CMDCODE_SVPSTATE 5
-#define CMDCODE_MONITOR  6
-
 /** \brief Checks if command is ready in the incoming buffer of selected TCP connection and executes it
  *
  * \param tcp_conn_idx int - index of connection to check
- * \return void
+ * \return int - 1 if command was answered, 0 if there is no complete command yet or it waits for device
  *
  * Used to process commands sent from web ui or any other external counterpart that issues and/or controls printing jobs.
  * currently processed comands are:
  * SEND <dev_id> <b64string>
  *      send fully prepared command to the device specified. the most commands is usually comdes in binary form, so it should be base64 encoded.
  *      printer's answer if any is sent back also b64 encoded
- * DEVSTATE <dev_id>
+ * DEVSTATE <dev_id>[ max_age]
  *          Queries the state of printer's driver. Returned is integer contining bitmask of internal driver's flags. See STATE_* in fprnconfig.h
+ *          With max_age in seconds the device's status snapshot is returned at once if it is not older than that.
+ *          Snapshot is refreshed by background poller (see statuspoll config keyword) and by the answers of SEND'ed commands.
  * DEVTYPE <dev_id>
  *         Returns type of device assigned to given id. Used to control correctness of inter-config data mostly.
  * SAVEPHPSTATE <lines_count>
@@ -169,26 +1014,89 @@ char *tcp_get_line(struct ap_tcp_connection_t *tc)
  *              As it is derived from the names of commands these were used to save and extract arbitrary data
  *              that can be used as a kind of web cookie in cases where there no external database is available to store such data
  *              <lines_count> is a number of lines of arbitrary data that follows SAVEPHPSTATE command
- * MON[ITOR][ new_debug_level]
- *    Marks this connection as another channel for debug info output, whilst optionally setting the new debug level or verbosity.
+ *              Each SAVEPHPSTATE replaces the data saved before. Empty lines are skipped.
+ * MON[ITOR][ debug_level[ filter]]
+ *    Marks this connection as another channel for debug info output with its own verbosity (daemon's debug level by default).
+ *    filter is comma separated list of message categories: tcp, serial, driver, all, and/or device id to see only its messages.
+ *    Repeating MON changes the settings. The output is buffered and never waited for: messages are skipped when client is slow
+ *    and connection is closed if it does not take anything for 30 seconds.
  *    This connection cannot be force-closed on standard timeout and will persists until client disconnect.
+ * SUBMIT <dev_id> <b64string>
+ *        the same as SEND, but returns the job id right away. peer is free to disconnect then.
+ * RESULT <job_id>[ wait_seconds]
+ *        returns the SUBMIT'ted job's answer in SEND format if it is done or "202 job in progress" if not.
+ *        with wait_seconds it waits for the job up to this time. results are kept for job_keep_time after the job is done.
+ * KEEPALIVE[ on|off]
+ *           Connection is not closed after each answer, so several commands can be sent through it, even at once.
+ *           They are executed one by one and answered in the same order. Connection is closed after TCPtimeOut of idling.
+ *           KEEPALIVE off returns to the default mode, so connection is closed right after its answer.
+ *           It is closed after the answer also if command failed before its data lines were read, e.g. on bad dev id.
+ * HELLO[ BINARY]
+ *       Without args returns the list of protocol extensions supported.
+ *       HELLO BINARY switches connection to binary frames mode for the rest of its life. See BIN_* for the frame format.
+ *       Raw printer's commands and answers are passed then without base64 encoding. Connection is kept alive as with KEEPALIVE.
+ *       Peer should wait for the answer to HELLO before sending the frames.
+ * STATS[ dev_id]
+ *       Returns printer commands latency statistics of the device or all devices. One line per command code used, see cmdstats_format()
+ * FLIGHTREC <dev_id>
+ *       Dumps device's flight recorder to file in statedir and returns the file name. "fprn -r file" decodes it
+ * LEASE <dev_id>[ fiscal|normal|report]
+ *       Takes device for multi-command transaction, like cheque from open to close, and switches KEEPALIVE on.
+ *       SEND and SUBMIT of the other clients wait until the lease is dropped instead of interleaving with holder's ones.
+ *       If device is leased already then the answer is delayed until it is our turn. Waiting requests go by priority
+ *       (normal by default, the other clients' commands are normal too), FIFO within the same one.
+ *       Lease is dropped by RELEASE, on disconnect, or after leasetimeout of holder's silence.
+ * RELEASE <dev_id>
+ *       Drops device's lease. "408 not available" if connection does not hold it (e.g. it has expired)
+ * TRANSACTION <dev_id> <lines_count>
+ *       Prints whole fiscal document described by <lines_count> lines that follow, see fiscaldoc.c for the format.
+ *       Empty lines are skipped. Blank ones are counted in <lines_count> and ignored.
+ *       Bad <dev_id> or <lines_count> leaves the document's lines unread, so KEEPALIVE connection is closed after the answer.
+ *       Totals are checked first, "404 command parameter error" if they do not match. Then the document is done
+ *       on printer as single job, without the other clients' commands in between, and ahead of their waiting ones.
+ *       If any printer's command fails, the opened document is cancelled and "410 transaction failed" is returned
+ *       with the failed step, command, printer's error code and cancel result. "200 OK" returns total and change.
+ *       "408 not available" if device's driver can't do it.
+ *
+ * SEND, DEVSTATE, TRANSACTION are queued to device's worker thread and answered later from tcp_job_done(),
+ * so the slow printer does not hold the other connections.
+ * While device's port is (re-)initialized they are answered with "407 device initializing" at once.
+ * SUBMIT'ted jobs are queued anyway and done after the init.
 */
-void tcp_answer(int tcp_conn_idx) // answering web side inquiries
+static int tcp_answer_command(int tcp_conn_idx)
 {
 int dev_index, n, exec_status, answer_len;
 char *token, *s, answer[1024], *answer_ptr;
-char *nexttokenptr;
+char *nexttokenptr, *line;
+int line_len;
 struct ap_tcp_connection_t *tc;
+t_tcp_session *ts;
+t_dev_job *job;
+unsigned job_id;
 
   tc = &ap_tcp_connections[tcp_conn_idx];
+  ts = &sessions[tcp_conn_idx];
+
+  if ( tcp_answer_pending(tcp_conn_idx) )
+    return 0; // still waiting for the device
 
-  if ( NULL == tcp_get_line(tc) )
-    return; // no data/incomplete line
+  if ( ts->binary )
+    return tcp_answer_frame(tcp_conn_idx);
+
+  // the commands with additional lines are reading them by themselves
+  if ( tc->state == TC_ST_READY )
+  {
+    if ( NULL == (line = tcp_get_line(tc, &line_len)) )
+      return 0; // no data/incomplete line
 
-  if (debug_level)
-    debuglog("tcp conn %d data: %s\n", tcp_conn_idx, tc->buf);
+    if (debug_want(1))
+      debuglog("tcp conn %d data: %s\n", tcp_conn_idx, line);
+  }
 
   answer_ptr = answer;
+  exec_status = SA_OK;
+  answer_len = 0;
+  nexttokenptr = NULL;
 
   for (;;)
   {
@@ -197,11 +1105,9 @@ struct ap_tcp_connection_t *tc;
       tc->cmdcode = 0;
       tc->state = TC_ST_BUSY;
       tc->needlines = 0;
-      exec_status = SA_OK;
       answer[0] = '\0';
-      answer_len = 0;
 
-      nexttokenptr = tc->buf;
+      nexttokenptr = line;
       token = strsep(&nexttokenptr, " \t"); // get command name
 
       //------------------------------------------------------
@@ -225,18 +1131,17 @@ struct ap_tcp_connection_t *tc;
       // param is the count of lines of data to follow
       else if ( 0 == strcasecmp(token, "SAVEPHPSTATE"))
       {
+        tc->cmdcode = CMDCODE_SVPSTATE;
         s = strsep(&nexttokenptr, " \t");
         if ( s == NULL || 0 >= (n = atoi(s)) )
         {
+          tc->needlines = -1; // unknown count of data lines
           exec_status = SA_BADPARAM;
           answer_len = 0;
           break;
         }
         else
-        {
           tc->needlines = n;
-          tc->cmdcode = CMDCODE_SVPSTATE;
-        }
       }
       // sends peer saved data back to it
       else if ( 0 == strcasecmp(token, "LOADPHPSTATE"))
@@ -248,89 +1153,206 @@ struct ap_tcp_connection_t *tc;
       {
         tc->cmdcode = CMDCODE_MONITOR;
       }
+      // async SEND
+      else if ( 0 == strcasecmp(token, "SUBMIT") )
+      {
+        tc->needlines = 1;
+        tc->cmdcode = CMDCODE_SUBMIT;
+      }
+      // fetch the async job's result
+      else if ( 0 == strcasecmp(token, "RESULT") )
+      {
+        tc->cmdcode = CMDCODE_RESULT;
+      }
+      // do not close connection after answer. optional arg is on/off
+      else if ( 0 == strcasecmp(token, "KEEPALIVE") )
+      {
+        tc->cmdcode = CMDCODE_KEEPALIVE;
+      }
+      // capabilities and protocol mode switch
+      else if ( 0 == strcasecmp(token, "HELLO") )
+      {
+        tc->cmdcode = CMDCODE_HELLO;
+      }
+      // per-command latency statistics. optional arg is device id
+      else if ( 0 == strcasecmp(token, "STATS") )
+      {
+        tc->cmdcode = CMDCODE_STATS;
+      }
+      // serial IO trace dump
+      else if ( 0 == strcasecmp(token, "FLIGHTREC") )
+      {
+        tc->cmdcode = CMDCODE_FLIGHTREC;
+      }
+      // device's lease for multi-command transaction. optional arg is priority
+      else if ( 0 == strcasecmp(token, "LEASE") )
+      {
+        tc->cmdcode = CMDCODE_LEASE;
+      }
+      else if ( 0 == strcasecmp(token, "RELEASE") )
+      {
+        tc->cmdcode = CMDCODE_RELEASE;
+      }
+      // whole fiscal document. lines count follows device id
+      else if ( 0 == strcasecmp(token, "TRANSACTION") )
+      {
+        tc->cmdcode = CMDCODE_TRANSACTION;
+        tc->needlines = -1; // unknown until the count is parsed
+      }
       else
       {
-        s = "help: SEND/DEVSTATE/DEVTYPE/SAVEPHPSTATE/LOADPHPSTATE devid\nMON[ITOR][ new_debug_level]\n";
+        s = "help: SEND/SUBMIT/DEVSTATE/DEVTYPE/SAVEPHPSTATE/LOADPHPSTATE devid\nRESULT jobid[ wait_seconds]\nKEEPALIVE[ on|off]\nHELLO[ BINARY]\nSTATS[ devid]\nFLIGHTREC devid\nLEASE devid[ fiscal|normal|report]\nRELEASE devid\nTRANSACTION devid lines_count\nMON[ITOR][ debug_level[ tcp,serial,driver,devid]]\n";
         ap_tcp_conn_send(tcp_conn_idx, s, strlen(s));
         exec_status = SA_UNKCMD;
       }
+
+      // check for valid device.
+      if ( tc->cmdcode != CMDCODE_MONITOR && tc->cmdcode != CMDCODE_RESULT && tc->cmdcode != CMDCODE_KEEPALIVE
+           && tc->cmdcode != CMDCODE_HELLO && tc->cmdcode != CMDCODE_STATS )
+      {
+        s = strsep(&nexttokenptr, " \t");
+        if ( s == NULL || 0 == (dev_index = atoi(s)) || -1 == (dev_index = dev_idx_by_id(dev_index)) )
+        {
+          dosyslog(LOG_ERR, "TCP Conn %d: bad dev id: %s", tcp_conn_idx, s);
+          exec_status = SA_BADIDX;
+          break;
+        }
+
+        ts->dev_index = dev_index;
+      }
     } // new command pre-init
 
 
     /************************************
      command execution division
      ************************************/
-    // check for valid device.
-    if ( tc->cmdcode != CMDCODE_MONITOR )
+    dev_index = ts->dev_index;
+
+    if ( tc->cmdcode == CMDCODE_SEND )
     {
-      s = strsep(&nexttokenptr, " \t");
-      if ( s == NULL || 0 == (dev_index = atoi(s)) || -1 == (dev_index = dev_idx_by_id(dev_index)) )
+      if ( NULL == (line = tcp_get_line(tc, &line_len)) )
+        return 0; // no data/incomplete line
+
+      tc->needlines = 0;
+
+      s = getmem(BASE64_DECODED_MAXLEN(line_len) + 1, "tcp_answer: malloc");
+
+      if ( -1 == (n = base64_decode_buf(line, line_len, s, BASE64_STRICT)) )
       {
-        dosyslog(LOG_ERR, "TCP Conn %d: bad dev id: %s", tcp_conn_idx, s);
-        exec_status = SA_BADIDX;
+        free(s);
+        exec_status = SA_BADPARAM;
         break;
       }
 
-/* this check is makes sense for multithread mode.
-      if ( devices[dev_index].tcpconn != NULL ) // check if busy in another conn.
+      if ( devices[dev_index].init_queued )
       {
-        if ( 0 < ap_tcp_connection_is_alive(devices[dev_index].tcpconn->idx) )
-        { // busy
-          dosyslog(LOG_ERR, "TCP Conn %d: dev id %s is in use by other connection", tcp_conn_idx, s);
-          exec_status = SA_DEVINUSE;
-          break;
-        }
+        free(s);
+        exec_status = SA_DEVINIT;
+        break;
       }
-*/
 
-      devices[dev_index].tcpconn = tc;
+      job = devjob_new(DEVJOB_SEND, &devices[dev_index]);
+      job->data = s;
+      job->data_size = n;
+      submit_job(tcp_conn_idx, job);
+      return 0;
     }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // queue command and answer with job id
+    else if ( tc->cmdcode == CMDCODE_SUBMIT )
+    {
+      if ( NULL == (line = tcp_get_line(tc, &line_len)) )
+        return 0; // no data/incomplete line
 
-    if ( tc->cmdcode == CMDCODE_SEND )
+      tc->needlines = 0;
+
+      s = getmem(BASE64_DECODED_MAXLEN(line_len) + 1, "tcp_answer: malloc");
+
+      if ( -1 == (n = base64_decode_buf(line, line_len, s, BASE64_STRICT)) )
+      {
+        free(s);
+        exec_status = SA_BADPARAM;
+        break;
+      }
+
+      job = devjob_new(DEVJOB_SEND, &devices[dev_index]);
+      job->data = s;
+      job->data_size = n;
+
+      if ( ++next_job_id == 0 )
+        ++next_job_id;
+
+      job->id = next_job_id;
+      job->async_next = async_jobs;
+      async_jobs = job;
+
+      job->sched_conn = tcp_conn_idx; // lease holder's SUBMIT goes to worker at once
+      devsched_activity(job->dev, tcp_conn_idx, 1);
+      devsched_submit(job, SCHED_PRIO_NORMAL);
+
+      answer_len = sprintf(answer, "%u\n", job->id);
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_RESULT )
     {
-      if ( NULL == tcp_get_line(tc) )
-        return; // no data/incomplete line
+      s = strsep(&nexttokenptr, " \t");
+
+      if ( s == NULL || 0 == (job_id = strtoul(s, NULL, 10)) )
+      {
+        exec_status = SA_BADPARAM;
+        break;
+      }
 
-      s = base64_decode(tc->buf, strlen(tc->buf), (size_t*)&n);
+      for ( job = async_jobs; job != NULL && job->id != job_id; job = job->async_next );
 
-      // sending to printer
-      if (0 != devices[dev_index].device_type->func_send_command(devices[dev_index].id, s, n)) // error?
+      if ( job == NULL )
       {
-        exec_status = SA_PRINTERERROR;
-        answer_len = sprintf(answer, "%d\n", devices[dev_index].state);
+        exec_status = SA_NOJOB;
+        break;
       }
-      else
+
+      if ( job->done )
       {
-        // sent OK. we answer with %06d length, encoded data, LF
-        s = base64_encode((char*)(devices[dev_index].buf), devices[dev_index].buf_ptr, (size_t*)&answer_len);
-        sprintf(tc->buf, "%06d", answer_len + 1);
-        tc->bufptr = 6;
+        exec_status = job_answer(ts, job, answer, &answer_ptr, &answer_len);
+        break;
+      }
 
-        if ( ! check_buf_size(&tc->buf, &tc->bufsize, &tc->bufptr, answer_len + 1) )
-        {
-          dosyslog(LOG_ERR, "realloc for +%d: %m", answer_len + 1);
-          exit(1);
-        }
+      s = strsep(&nexttokenptr, " \t"); // optional wait time
 
-        memcpy(tc->buf + 6, s, answer_len);
-        tc->buf[answer_len + 6] = '\n';
-        answer_len += 7;
-        answer_ptr = tc->buf;
-        free(s);
+      if ( s == NULL || 0 >= (n = atoi(s)) )
+      {
+        exec_status = SA_JOBPENDING;
+        break;
       }
+
+      if ( n > 60 )
+        n = 60;
+
+      ts->wait_job = job;
+      ap_evloop_timer_start(&ts->wait_timer, n * 1000);
+      ap_tcp_conn_idle_stop(tcp_conn_idx); // wait timer answers it anyway
+
+      tcp_update_events(tcp_conn_idx); // no more input until answered
+      return 0;
     }
     //++++++++++++++++++++++++++++++++++++++++++++
     else if ( tc->cmdcode == CMDCODE_DEVSTATE )
     {
-      if (0 != devices[dev_index].device_type->func_get_state(devices[dev_index].id))
-      {
-        exec_status = SA_PRINTERERROR;
-        answer_len = sprintf(answer, "device state: %d\n", devices[dev_index].state);
-      }
-      else
+      s = strsep(&nexttokenptr, " \t"); // optional max age of snapshot
+
+      if ( s != NULL && 0 < (n = atoi(s)) && -1 != (answer_len = cached_status_answer(dev_index, n, answer)) )
+        break;
+
+      answer_len = 0;
+
+      if ( devices[dev_index].init_queued )
       {
-        answer_len = sprintf(answer, "%d\n%s\n", devices[dev_index].state, devices[dev_index].buf);
+        exec_status = SA_DEVINIT;
+        break;
       }
+
+      submit_status_job(tcp_conn_idx, dev_index);
+      return 0;
     }
     //++++++++++++++++++++++++++++++++++++++++++++
     // returns device type code
@@ -342,30 +1364,30 @@ struct ap_tcp_connection_t *tc;
     // saves php class state in case of errors with page reload needed
     else if ( tc->cmdcode == CMDCODE_SVPSTATE )
     {
-      tc->state = TC_ST_DATAIN;
+      if ( tc->state != TC_ST_DATAIN ) // first lines of data. new state replaces the old one
+      {
+        tc->state = TC_ST_DATAIN;
+        devices[dev_index].psbuf_ptr = 0;
+      }
 
       while ( tc->needlines ) // lines count that peer requested to send
       {
-        if ( NULL == tcp_get_line(tc) )
-          return; // no data/incomplete line
+        if ( NULL == (line = tcp_get_line(tc, &line_len)) )
+          return 0; // no data/incomplete line
 
         tc->needlines--;
 
         // check for small buffer. reserve space for LF
-        if ( devices[dev_index].psbuf_size - devices[dev_index].psbuf_ptr < tc->bufptr + 1)
+        if ( ! check_buf_size((char**)&devices[dev_index].psbuf, &devices[dev_index].psbuf_size, &devices[dev_index].psbuf_ptr, line_len + 1) )
         {
-          if ( NULL == realloc(devices[dev_index].psbuf, tc->bufptr + 1) )
-          {
-            dosyslog(LOG_ERR, "gtcpanswer: realloc fail on %d + %d", devices[dev_index].psbuf_size, tc->bufptr + 1);
-            exit(1);
-          }
-        } // small buf
-
-        memcpy(devices[dev_index].psbuf + devices[dev_index].psbuf_ptr, tc->buf, tc->bufptr);
-        devices[dev_index].psbuf_ptr += tc->bufptr;
-
-        memcpy(devices[dev_index].psbuf + devices[dev_index].psbuf_ptr, "\n", 1);
-        devices[dev_index].psbuf_ptr += 1;
+          dosyslog(LOG_ERR, "gtcpanswer: realloc fail on %d + %d", devices[dev_index].psbuf_size, line_len + 1);
+          exit(1);
+        }
+
+        memcpy(devices[dev_index].psbuf + devices[dev_index].psbuf_ptr, line, line_len);
+        devices[dev_index].psbuf_ptr += line_len;
+
+        devices[dev_index].psbuf[devices[dev_index].psbuf_ptr++] = '\n';
       }// while(needlines)
 
       answer_len = 0;
@@ -379,42 +1401,229 @@ struct ap_tcp_connection_t *tc;
       answer_ptr = (char*)devices[dev_index].psbuf;
     }
     //++++++++++++++++++++++++++++++++++++++++++++
-    else if ( tc->cmdcode == CMDCODE_MONITOR )
+    else if ( tc->cmdcode == CMDCODE_KEEPALIVE )
     {
-      add_debug_handle(ap_tcp_connections[tcp_conn_idx].fd);
       s = strsep(&nexttokenptr, " \t");
 
-      if ( s != NULL )
-        debug_level = atoi(s);
+      if ( s == NULL || 0 == strcasecmp(s, "on") )
+        ts->keepalive = 1;
+      else if ( 0 == strcasecmp(s, "off") )
+        ts->keepalive = 0;
+      else
+        exec_status = SA_BADPARAM;
     }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_LEASE )
+    {
+      s = strsep(&nexttokenptr, " \t");
+
+      if ( s == NULL || 0 == strcasecmp(s, "normal") )
+        n = SCHED_PRIO_NORMAL;
+      else if ( 0 == strcasecmp(s, "fiscal") )
+        n = SCHED_PRIO_FISCAL;
+      else if ( 0 == strcasecmp(s, "report") )
+        n = SCHED_PRIO_REPORT;
+      else
+      {
+        exec_status = SA_BADPARAM;
+        break;
+      }
 
+      ts->keepalive = 1; // lease lasts while connection does
 
-    break;
-  } //for(;;)
+      if ( devsched_lease(&devices[dev_index], tcp_conn_idx, n) )
+        break;
 
-  tc->state = TC_ST_OUTPUT;
+      ts->lease_wait = 1;
+      tcp_update_events(tcp_conn_idx); // no more input until answered
+      ap_tcp_conn_idle_stop(tcp_conn_idx); // holder's lease timeout bounds the wait
+      return 0; // answered from tcp_lease_granted()
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_RELEASE )
+    {
+      if ( ! devsched_release(&devices[dev_index], tcp_conn_idx) )
+        exec_status = SA_NOTAVAIL;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    // whole fiscal document as single job
+    else if ( tc->cmdcode == CMDCODE_TRANSACTION )
+    {
+      if ( tc->state != TC_ST_DATAIN ) // first lines of document
+      {
+        s = strsep(&nexttokenptr, " \t");
 
-  ap_tcp_conn_send(tcp_conn_idx, std_answers[exec_status], strlen(std_answers[exec_status]));
+        if ( s == NULL || 0 >= (n = atoi(s)) || n > 2 * FDOC_LINES_MAX + FDOC_POS_MAX + FDOC_PAY_KINDS + 3 )
+        {
+          dosyslog(LOG_ERR, "TCP Conn %d: TRANSACTION: bad lines count", tcp_conn_idx);
+          exec_status = SA_BADPARAM;
+          break;
+        }
 
-  if (debug_level)
-    debuglog("* debug: standard answer: %s\n", std_answers[exec_status]);
+        tc->state = TC_ST_DATAIN;
+        tc->needlines = n;
+        ts->doc = fdoc_new();
+        ts->doc_bad = 0;
+      }
 
-  if (exec_status == SA_OK && answer_len > 0)
-  {
-    ap_tcp_conn_send(tcp_conn_idx, answer_ptr, answer_len);
-    if(debug_level > 9)
+      while ( tc->needlines ) // lines count that peer requested to send
+      {
+        if ( NULL == (line = tcp_get_line(tc, &line_len)) )
+          return 0; // no data/incomplete line
+
+        tc->needlines--;
+
+        if ( ! ts->doc_bad && ! fdoc_parse_line(&ts->doc, line) )
+        {
+          dosyslog(LOG_ERR, "TCP Conn %d: TRANSACTION: bad %s line", tcp_conn_idx, line); // keyword only, the rest is parsed already
+          ts->doc_bad = 1;
+        }
+      }
+
+      job = devjob_new(DEVJOB_TRANSACTION, &devices[dev_index]);
+      job->data = (char*)ts->doc;
+      job->data_size = sizeof(t_fiscal_doc) + ts->doc->pos_size * sizeof(t_fiscal_pos);
+      ts->doc = NULL;
+
+      if ( ts->doc_bad || ! fdoc_validate((t_fiscal_doc *)job->data) )
+        exec_status = SA_BADPARAM;
+      else if ( devices[dev_index].device_type->func_transaction == NULL )
+        exec_status = SA_NOTAVAIL;
+      else if ( devices[dev_index].init_queued )
+        exec_status = SA_DEVINIT;
+      else
+      {
+        submit_job(tcp_conn_idx, job);
+        return 0;
+      }
+
+      devjob_free(job);
+      break;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_HELLO )
     {
-      debuglog("* debug: answer2:");
-      memdump(answer_ptr, answer_len); debuglog("\n");
+      s = strsep(&nexttokenptr, " \t");
+
+      if ( s == NULL )
+        answer_len = sprintf(answer, "KEEPALIVE SUBMIT BINARY LEASE TRANSACTION\n");
+      else if ( 0 == strcasecmp(s, "BINARY") )
+      {
+        // answered in text. the next input is binary
+        ts->binary = 1;
+        ts->keepalive = 1;
+      }
+      else
+        exec_status = SA_BADPARAM;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_STATS )
+    {
+      s = strsep(&nexttokenptr, " \t");
+
+      if ( s != NULL && ( 0 == (n = atoi(s)) || -1 == (dev_index = dev_idx_by_id(n)) ) )
+      {
+        exec_status = SA_BADIDX;
+        break;
+      }
+
+      answer_len = cmdstats_format(( s == NULL ? NULL : &devices[dev_index] ), &ts->outbuf, &ts->outbuf_size, 0);
+      answer_ptr = ts->outbuf;
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_FLIGHTREC )
+    {
+      if ( ! flightrec_dump(&devices[dev_index], answer, sizeof(answer) - 1) )
+      {
+        exec_status = SA_NOTAVAIL; // recorder is off or file can't be written. see the log
+        break;
+      }
+
+      answer_len = strlen(answer);
+      answer[answer_len++] = '\n';
+    }
+    //++++++++++++++++++++++++++++++++++++++++++++
+    else if ( tc->cmdcode == CMDCODE_MONITOR )
+    {
+      int level = ( debug_level > 0 ? debug_level : 1 ), mon_devid = 0;
+      unsigned categories = 0;
+
+      s = strsep(&nexttokenptr, " \t");
+
+      if ( s != NULL && *s != '\0' )
+        level = atoi(s);
+
+      // filter: comma separated categories and/or device id
+      while ( NULL != (s = strsep(&nexttokenptr, " \t,")) )
+      {
+        if ( *s == '\0' )
+          continue;
+        else if ( 0 == strcasecmp(s, "tcp") )
+          categories |= LOGCAT_TCP;
+        else if ( 0 == strcasecmp(s, "serial") )
+          categories |= LOGCAT_SERIAL;
+        else if ( 0 == strcasecmp(s, "driver") )
+          categories |= LOGCAT_DRIVER;
+        else if ( 0 == strcasecmp(s, "all") )
+          categories |= LOGCAT_ALL;
+        else if ( isdigit(*s) && -1 != dev_idx_by_id(atoi(s)) )
+          mon_devid = atoi(s);
+        else
+        {
+          exec_status = SA_BADPARAM;
+          break;
+        }
+      }
+
+      if ( exec_status != SA_OK )
+        break;
+
+      if ( categories == 0 )
+        categories = LOGCAT_ALL;
+      else
+        categories |= LOGCAT_GENERAL;
+
+      if ( ! add_debug_subscriber(ap_tcp_connections[tcp_conn_idx].fd, level, categories, mon_devid) )
+        exec_status = SA_NOTAVAIL;
     }
+
+
+    break;
+  } //for(;;)
+
+  // failed command's data lines are not read yet. they would be taken for commands, as the stream can't be re-synced
+  if ( exec_status != SA_OK && tc->needlines != 0 && ts->keepalive )
+  {
+    dosyslog(LOG_ERR, "TCP Conn %d: data lines of failed command are unread. closing after answer", tcp_conn_idx);
+    ts->keepalive = 0;
   }
 
-  fsync(tc->fd);
+  tcp_send_answer(tcp_conn_idx, exec_status, answer_ptr, answer_len);
+
+  return 1;
+}
+
+//=============================================================================
+/** \brief Answers all complete commands of the connection. See tcp_answer_command() for the protocol
+ *
+ * \param tcp_conn_idx int - index of connection to check
+ * \return void
+ *
+ * Keep-alive peer can send several commands at once. They are answered in order, one at a time:
+ * the next one is not started until the previous one is answered.
+*/
+void tcp_answer(int tcp_conn_idx) // answering web side inquiries
+{
+  struct ap_tcp_connection_t *tc;
 
-  if ( ! is_debug_handle(ap_tcp_connections[tcp_conn_idx].fd) )
-    ap_tcp_close_connection(tcp_conn_idx, NULL);
+  tc = &ap_tcp_connections[tcp_conn_idx];
 
-  devices[dev_index].tcpconn = NULL;
+  while ( tcp_answer_command(tcp_conn_idx) && tc->fd != 0 && ! tc->close_pending );
 
-  tc->state = TC_ST_READY;
+  // half-closed peer will not send anything more. closing after the last answer is out
+  if ( tc->fd != 0 && sessions[tcp_conn_idx].peer_closed && ! tcp_answer_pending(tcp_conn_idx) )
+  {
+    ap_tcp_close_when_sent(tcp_conn_idx);
+    tcp_update_events(tcp_conn_idx);
+  }
 }
@@ -0,0 +1,387 @@
+/*
+  ap_evloop.c: epoll based event loop with timers on single timerfd. written by Andrej Pakhutin for his own use primarily.
+*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define AP_EVLOOP_C
+#include "ap_evloop.h"
+#include "ap_log.h"
+#include "ap_str.h"
+
+#define AP_EVLOOP_MAX_EVENTS 32
+
+typedef struct ap_evloop_watch_t
+{
+  ap_evloop_handler_t handler; // NULL = fd is not watched
+  void *data;
+} ap_evloop_watch_t;
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+
+static ap_evloop_watch_t *watches = NULL; // indexed by fd
+static int watches_size = 0;
+
+/* armed timers. binary min-heap by due time: heap[0] is the nearest one and timerfd is armed to it.
+   arming, disarming and firing are O(log n), so expiration costs nothing for the idle timers
+*/
+static ap_evloop_timer_t **heap = NULL;
+static int heap_count = 0;
+static int heap_size = 0;
+static uint64_t timerfd_due = 0; // what timerfd is armed to. 0 - disarmed
+static int in_timers = 0; // timer handlers are being called. timerfd is re-armed after all of them
+
+//=================================================================
+// makes sure that watches[] can be indexed by fd
+static int grow_watches(int fd)
+{
+  int n;
+  ap_evloop_watch_t *p;
+
+
+  if ( fd < watches_size )
+    return 1;
+
+  n = watches_size == 0 ? 64 : watches_size;
+
+  while ( n <= fd )
+    n *= 2;
+
+  if ( NULL == (p = realloc(watches, n * sizeof(ap_evloop_watch_t))) )
+  {
+    dosyslog(LOG_ERR, "ap_evloop: realloc for %d watches: %m", n);
+    return 0;
+  }
+
+  memset(p + watches_size, 0, (n - watches_size) * sizeof(ap_evloop_watch_t));
+  watches = p;
+  watches_size = n;
+
+  return 1;
+}
+
+//=================================================================
+uint64_t ap_evloop_now(void)
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//=================================================================
+// internal. puts timer to heap position. pos is 0-based
+static void heap_set(int pos, ap_evloop_timer_t *timer)
+{
+  heap[pos] = timer;
+  timer->heap_pos = pos + 1;
+}
+
+//=================================================================
+// internal. moves timer at pos up to its place
+static void heap_up(int pos)
+{
+  ap_evloop_timer_t *timer;
+  int parent;
+
+
+  timer = heap[pos];
+
+  for ( ; pos > 0; pos = parent )
+  {
+    parent = (pos - 1) / 2;
+
+    if ( heap[parent]->due <= timer->due )
+      break;
+
+    heap_set(pos, heap[parent]);
+  }
+
+  heap_set(pos, timer);
+}
+
+//=================================================================
+// internal. moves timer at pos down to its place
+static void heap_down(int pos)
+{
+  ap_evloop_timer_t *timer;
+  int child;
+
+
+  timer = heap[pos];
+
+  for(;;)
+  {
+    child = pos * 2 + 1;
+
+    if ( child >= heap_count )
+      break;
+
+    if ( child + 1 < heap_count && heap[child + 1]->due < heap[child]->due )
+      ++child;
+
+    if ( timer->due <= heap[child]->due )
+      break;
+
+    heap_set(pos, heap[child]);
+    pos = child;
+  }
+
+  heap_set(pos, timer);
+}
+
+//=================================================================
+// internal. arms timerfd to the nearest timer if it is not armed so already
+static void timerfd_update(void)
+{
+  struct itimerspec its;
+  uint64_t due;
+
+
+  if ( in_timers )
+    return;
+
+  due = ( heap_count > 0 ? heap[0]->due : 0 );
+
+  if ( due == timerfd_due )
+    return;
+
+  memset(&its, 0, sizeof(its));
+
+  if ( due != 0 )
+  {
+    its.it_value.tv_sec = due / 1000000;
+    its.it_value.tv_nsec = (due % 1000000) * 1000;
+  }
+
+  // absolute time: the past one fires at once
+  if ( -1 == timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) )
+    dosyslog(LOG_ERR, "ap_evloop: timerfd_settime(): %m");
+
+  timerfd_due = due;
+}
+
+//=================================================================
+void ap_evloop_timer_init(ap_evloop_timer_t *timer, ap_evloop_timer_handler_t handler, void *data)
+{
+  timer->heap_pos = 0;
+  timer->handler = handler;
+  timer->data = data;
+}
+
+//=================================================================
+void ap_evloop_timer_stop(ap_evloop_timer_t *timer)
+{
+  ap_evloop_timer_t *last;
+  int pos;
+
+
+  if ( timer->heap_pos == 0 )
+    return;
+
+  pos = timer->heap_pos - 1;
+  timer->heap_pos = 0;
+
+  if ( --heap_count > pos ) // the last one takes the hole
+  {
+    last = heap[heap_count];
+    heap_set(pos, last);
+    heap_up(pos);
+    heap_down(last->heap_pos - 1);
+  }
+
+  timerfd_update();
+}
+
+//=================================================================
+void ap_evloop_timer_at(ap_evloop_timer_t *timer, uint64_t due)
+{
+  ap_evloop_timer_t **p;
+  int n;
+
+
+  if ( due == 0 )
+    due = 1; // 0 means disarmed timerfd
+
+  if ( timer->heap_pos != 0 ) // re-arming in place
+  {
+    timer->due = due;
+    heap_up(timer->heap_pos - 1);
+    heap_down(timer->heap_pos - 1);
+    timerfd_update();
+    return;
+  }
+
+  if ( heap_count == heap_size )
+  {
+    n = heap_size == 0 ? 64 : heap_size * 2;
+
+    if ( NULL == (p = realloc(heap, n * sizeof(ap_evloop_timer_t *))) )
+    {
+      dosyslog(LOG_ERR, "ap_evloop: realloc for %d timers: %m", n);
+      return;
+    }
+
+    heap = p;
+    heap_size = n;
+  }
+
+  timer->due = due;
+  heap_set(heap_count++, timer);
+  heap_up(heap_count - 1);
+  timerfd_update();
+}
+
+//=================================================================
+void ap_evloop_timer_start(ap_evloop_timer_t *timer, unsigned msec)
+{
+  ap_evloop_timer_at(timer, ap_evloop_now() + (uint64_t)msec * 1000);
+}
+
+//=================================================================
+// calls handlers of all due timers
+static void timer_event(int fd, uint32_t events, void *data)
+{
+  ap_evloop_timer_t *timer;
+  uint64_t expirations, now;
+
+
+  if ( sizeof(expirations) != read(timer_fd, &expirations, sizeof(expirations)) )
+    return; // EAGAIN - was disarmed or re-armed already
+
+  timerfd_due = 0; // it is one-shot
+  now = ap_evloop_now();
+  in_timers = 1;
+
+  while ( heap_count > 0 && heap[0]->due <= now )
+  {
+    timer = heap[0];
+    ap_evloop_timer_stop(timer);
+    timer->handler(timer, timer->data);
+  }
+
+  in_timers = 0;
+  timerfd_update();
+}
+
+//=================================================================
+int ap_evloop_init(void)
+{
+  if ( -1 == (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) )
+  {
+    dosyslog(LOG_ERR, "ap_evloop: epoll_create1(): %m");
+    return 0;
+  }
+
+  if ( -1 == (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) )
+  {
+    dosyslog(LOG_ERR, "ap_evloop: timerfd_create(): %m");
+    return 0;
+  }
+
+  return ap_evloop_add(timer_fd, EPOLLIN, timer_event, NULL);
+}
+
+//=================================================================
+int ap_evloop_add(int fd, uint32_t events, ap_evloop_handler_t handler, void *data)
+{
+  struct epoll_event ev;
+
+
+  if ( ! grow_watches(fd) )
+    return 0;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if ( -1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) )
+  {
+    if ( errno != EEXIST || -1 == epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) )
+    {
+      dosyslog(LOG_ERR, "ap_evloop: epoll_ctl(ADD, %d): %m", fd);
+      return 0;
+    }
+  }
+
+  watches[fd].handler = handler;
+  watches[fd].data = data;
+
+  return 1;
+}
+
+//=================================================================
+int ap_evloop_mod(int fd, uint32_t events)
+{
+  struct epoll_event ev;
+
+
+  if ( fd < 0 || fd >= watches_size || watches[fd].handler == NULL )
+    return 0;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if ( -1 == epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) )
+  {
+    dosyslog(LOG_ERR, "ap_evloop: epoll_ctl(MOD, %d): %m", fd);
+    return 0;
+  }
+
+  return 1;
+}
+
+//=================================================================
+int ap_evloop_del(int fd)
+{
+  if ( epoll_fd == -1 || fd < 0 || fd >= watches_size || watches[fd].handler == NULL )
+    return 0;
+
+  watches[fd].handler = NULL;
+  watches[fd].data = NULL;
+
+  // fd may be closed already. kernel drops it from epoll set by itself then
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+  return 1;
+}
+
+//=================================================================
+int ap_evloop_run(int timeout)
+{
+  struct epoll_event events[AP_EVLOOP_MAX_EVENTS];
+  int i, n, fd;
+
+
+  n = epoll_wait(epoll_fd, events, AP_EVLOOP_MAX_EVENTS, timeout);
+
+  if ( n == -1 )
+  {
+    if ( errno == EINTR )
+      return 0;
+
+    dosyslog(LOG_ERR, "ap_evloop: epoll_wait(): %m");
+    return -1;
+  }
+
+  for ( i = 0; i < n; ++i )
+  {
+    fd = events[i].data.fd;
+
+    // handler of previous event could have dropped this fd
+    if ( fd >= watches_size || watches[fd].handler == NULL )
+      continue;
+
+    watches[fd].handler(fd, events[i].events, watches[fd].data);
+  }
+
+  return n;
+}
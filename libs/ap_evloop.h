@@ -0,0 +1,40 @@
+#ifndef AP_EVLOOP_H
+#define AP_EVLOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+
+// called from ap_evloop_run() when fd is ready. events is a mask of EPOLL* flags
+typedef void (*ap_evloop_handler_t)(int fd, uint32_t events, void *data);
+
+struct ap_evloop_timer_t;
+
+// called from ap_evloop_run() when timer is due. timer is disarmed already, so handler may re-arm it
+typedef void (*ap_evloop_timer_handler_t)(struct ap_evloop_timer_t *timer, void *data);
+
+/* one-shot timer. embedded into owner's data, so there is no allocation per arming. zeroed one is disarmed.
+   armed timers are kept in min-heap by due time on CLOCK_MONOTONIC, so wall clock changes do not affect them
+*/
+typedef struct ap_evloop_timer_t
+{
+  uint64_t due; // ap_evloop_now() based usec
+  int heap_pos; // 1-based position in heap. 0 if not armed
+  ap_evloop_timer_handler_t handler;
+  void *data;
+} ap_evloop_timer_t;
+
+extern int  ap_evloop_init(void); // creates epoll and timerfd instances. returns boolean success
+extern int  ap_evloop_add(int fd, uint32_t events, ap_evloop_handler_t handler, void *data); // starts watching fd. re-registers if fd is known already
+extern int  ap_evloop_mod(int fd, uint32_t events); // changes events mask of watched fd. 0 mask pauses watching
+extern int  ap_evloop_del(int fd); // stops watching fd. should be called before close() to drop stale events
+extern int  ap_evloop_run(int timeout); // waits up to timeout ms (-1 = forever) and dispatches ready events. returns events count or -1 on error
+
+// timers. event loop's thread only, except ap_evloop_now()
+extern uint64_t ap_evloop_now(void); // CLOCK_MONOTONIC usec. thread safe
+extern void ap_evloop_timer_init(ap_evloop_timer_t *timer, ap_evloop_timer_handler_t handler, void *data); // sets the handler. timer stays disarmed
+extern void ap_evloop_timer_at(ap_evloop_timer_t *timer, uint64_t due); // (re-)arms timer to ap_evloop_now() based time
+extern void ap_evloop_timer_start(ap_evloop_timer_t *timer, unsigned msec); // (re-)arms timer to msec from now
+extern void ap_evloop_timer_stop(ap_evloop_timer_t *timer); // disarms timer if it is armed
+#define ap_evloop_timer_armed(timer) ((timer)->heap_pos != 0)
+#endif
@@ -1,120 +1,255 @@
 #define AP_LOG_C
+#define _GNU_SOURCE // recursive mutex initializer
 
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 
 #include "ap_error.h"
 #include "ap_log.h"
-#include "ap_tcp.h"
 
 int debug_to_tty = 0;
-int debug_level = 0;
+int debug_level = 0; // stderr's verbosity. subscribers have their own
 
-#define max_debug_handles 5
-static int debug_handles[max_debug_handles];
-static int debug_handles_count = 0;
-static int debug_mutex = 0;
+/* debug subscribers (MON connections).
+   each one has its own verbosity and filter and the output buffer, that is written without blocking.
+   if buffer is full the messages are skipped and counted. subscriber that has not taken anything for DEBUG_SUB_STALL seconds is dropped
+*/
+#define DEBUG_SUB_BUF_SIZE 65536
+#define DEBUG_SUB_STALL 30
+
+typedef struct t_debug_sub
+{
+  int fd;
+  int level; // verbosity
+  unsigned categories; // LOGCAT_* mask
+  int dev_id; // 0 - any device
+  char *buf; // not yet sent output
+  int buf_len;
+  unsigned long skipped; // messages lost on full buffer. reported when there is room again
+  time_t stalled_since; // 0 - peer takes the output
+} t_debug_sub;
+
+static t_debug_sub *debug_subs = NULL;
+static int debug_subs_count = 0;
+static int debug_subs_size = 0;
+static int debug_subs_max_level = 0; // the most verbose of subscribers. for debug_want()
+static int debug_subs_pending = 0; // some subscriber has unsent output. logger thread retries it often then
+
+// subscribers list and error string. only non-blocking writes are done under it
+static pthread_mutex_t debug_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+// the output itself and repeats folding state. recursive, as the output code can log too
+static pthread_mutex_t output_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 char ap_error_str[ap_error_str_maxlen]; // string representation of error
 
+// what the message is about. used by subscribers' filters
+typedef struct t_log_ctx
+{
+  int level; // verbosity of message. from the last debug_want() of thread
+  unsigned category; // LOGCAT_*
+  int dev_id; // 0 - not device related
+} t_log_ctx;
+
+static __thread unsigned log_thread_category = LOGCAT_GENERAL; // set by ap_log_context()
+static __thread t_log_ctx log_ctx = { 1, LOGCAT_GENERAL, 0 }; // current message's
+static const t_log_ctx syslog_ctx = { 1, LOGCAT_ALL, 0 }; // syslog messages pass all filters
+
+/* asynchronous mode. see ap_log_async_start()
+   producers put records into bounded lock-free MPSC ring, logger thread writes them out.
+   each slot's seq tells whose turn it is: == pos - free for producer at pos, == pos + 1 - filled, for consumer
+*/
+#define LOG_RING_SLOTS 512 // power of 2
+#define LOG_SLOT_DATA 1024
+
+#define LOGREC_DEBUG    1 // text to debug channel(s)
+#define LOGREC_SYSLOG   2 // text to syslog. and to debug channel(s) if anyone wants level 1
+#define LOGREC_MEMDUMP  3 // raw bytes. hexdump is made by logger thread
+#define LOGREC_MEMDUMPB 4 // raw bytes. bitdump --"--
+
+#define LOG_DUMP_CHUNK (LOG_SLOT_DATA - LOG_SLOT_DATA % 16 - 16) // longer dumps are split into several records. whole lines each
+
+typedef struct t_log_slot
+{
+  unsigned seq;
+  int kind; // LOGREC_*
+  int priority; // syslog's
+  int also_debug; // syslog record goes to debug channel(s) too
+  t_log_ctx ctx;
+  int len;
+  int dump_addr; // memdump's offset of data in the whole dump
+  int dump_total; // memdump's whole length
+  char data[LOG_SLOT_DATA];
+} t_log_slot;
+
+static t_log_slot *log_ring = NULL; // NULL - synchronous mode
+static unsigned log_enqueue_pos; // producers' CAS target
+static unsigned log_dequeue_pos; // logger thread only
+static unsigned long log_dropped; // records lost on full ring. reported and cleared by logger thread
+static unsigned long log_dropped_total;
+static int log_wake_fd = -1; // eventfd to wake sleeping logger thread
+static int log_sleeping; // logger thread is going to sleep. producer that clears it wakes it up
+static pthread_t log_thread;
+
 //=======================================================================
+// log functions are called from several threads. guards the subscribers list
 static int getlock(void)
 {
-  int i;
+  pthread_mutex_lock(&debug_mutex);
 
+  return 1;
+}
 
-  for(i = 0; debug_mutex; ++i)
-  {
-    usleep(100000);//100ms
-
-    if (i == 3)
-    {
-      if ( debug_to_tty )
-        fputs("? WARNING! stale debug mutex!\n", stderr);
-
-      return 0;
-    }
-  }
+//=======================================================================
+static void releaselock(void)
+{
+  pthread_mutex_unlock(&debug_mutex);
+}
 
-  ++debug_mutex;
+//=======================================================================
+// serializes the writes to debug channel(s)
+static void output_lock(void)
+{
+  pthread_mutex_lock(&output_mutex);
+}
 
-  return 1;
+//=======================================================================
+static void output_unlock(void)
+{
+  pthread_mutex_unlock(&output_mutex);
 }
 
 //=================================================================
-int is_debug_handle_internal(int fd)
+// internal. index of subscriber or -1. under lock
+static int debug_sub_find(int fd)
 {
   int i;
 
 
-  for ( i = 0; i < debug_handles_count; ++i )
-    if ( debug_handles[i] == fd )
-      return 1;
+  for ( i = 0; i < debug_subs_count; ++i )
+    if ( debug_subs[i].fd == fd )
+      return i;
 
-  return 0;
+  return -1;
 }
 
 //=================================================================
-int add_debug_handle(int fd)
+// internal. recalculates the most verbose level of subscribers. under lock
+static void debug_subs_update(void)
 {
-  if ( !getlock() )
-    return 0;
+  int i, max, pending;
 
-  if ( is_debug_handle_internal(fd) )
-  {
-    debug_mutex = 0;
-    return 1;
-  }
 
-  if ( debug_handles_count == max_debug_handles )
+  max = pending = 0;
+
+  for ( i = 0; i < debug_subs_count; ++i )
   {
-    debug_mutex = 0;
-    return 0;
+    if ( max < debug_subs[i].level )
+      max = debug_subs[i].level;
+
+    if ( debug_subs[i].buf_len > 0 )
+      pending = 1;
   }
 
-  debug_handles[debug_handles_count++] = fd;
-  debug_mutex = 0;
+  __atomic_store_n(&debug_subs_max_level, max, __ATOMIC_RELAXED);
+  debug_subs_pending = pending;
+}
 
-  return 1;
+//=================================================================
+// internal. removes subscriber by index. under lock
+static void debug_sub_remove(int idx)
+{
+  free(debug_subs[idx].buf);
+
+  for ( ++idx; idx < debug_subs_count; ++idx )
+    debug_subs[idx - 1] = debug_subs[idx];
+
+  --debug_subs_count;
+  debug_subs_update();
 }
 
 //=================================================================
-static int remove_debug_handle_internal(int fd)
+int add_debug_subscriber(int fd, int level, unsigned categories, int dev_id)
 {
-  int i, ii;
+  t_debug_sub *sub;
+  int i;
 
 
-  for ( i = 0; i < debug_handles_count; ++i )
+  if ( !getlock() )
+    return 0;
+
+  if ( -1 == (i = debug_sub_find(fd)) )
   {
-    if ( debug_handles[i] == fd )
+    if ( debug_subs_count == debug_subs_size )
     {
-      for ( ii = i+1; ii < debug_handles_count; ++ii )
-        debug_handles[ii - 1] = debug_handles[ii];
+      sub = realloc(debug_subs, (debug_subs_size + 4) * sizeof(t_debug_sub));
+
+      if ( sub == NULL )
+      {
+        releaselock();
+        return 0;
+      }
 
-      --debug_handles_count;
+      debug_subs = sub;
+      debug_subs_size += 4;
+    }
 
-      return 1;
+    sub = &debug_subs[debug_subs_count];
+    memset(sub, 0, sizeof(t_debug_sub));
+
+    if ( NULL == (sub->buf = malloc(DEBUG_SUB_BUF_SIZE)) )
+    {
+      releaselock();
+      return 0;
     }
+
+    sub->fd = fd;
+    ++debug_subs_count;
   }
-  return 0;
+  else
+    sub = &debug_subs[i];
+
+  sub->level = level;
+  sub->categories = categories;
+  sub->dev_id = dev_id;
+
+  debug_subs_update();
+  releaselock();
+
+  return 1;
+}
+
+//=================================================================
+int add_debug_handle(int fd)
+{
+  return add_debug_subscriber(fd, ( debug_level > 0 ? debug_level : 1 ), LOGCAT_ALL, 0);
 }
 
 //=================================================================
 int remove_debug_handle(int fd)
 {
-  int retcode;
+  int i;
 
 
   if ( !getlock() )
     return 0;
 
-  retcode = remove_debug_handle_internal(fd);
-  debug_mutex = 0;
+  if ( -1 != (i = debug_sub_find(fd)) )
+    debug_sub_remove(i);
 
-  return retcode;
+  releaselock();
+
+  return i != -1;
 }
 
 //=================================================================
@@ -126,49 +261,155 @@ int is_debug_handle(int fd)
   if ( !getlock() )
     return 0;
 
-  retcode = is_debug_handle_internal(fd);
-  debug_mutex = 0;
+  retcode = ( -1 != debug_sub_find(fd) );
+  releaselock();
 
   return retcode;
 }
 
 //=================================================================
-void debuglog_output(char *buf, int buflen) // internal. outputs ready message to debug channel(s)
+// internal. sends what the socket takes right now. returns false if subscriber should be dropped. under lock
+static int debug_sub_flush(t_debug_sub *sub)
 {
-  int i;
+  int n;
 
-  if ( debug_to_tty )
-    fputs(buf, stderr);
 
-  for ( i = 0; i < debug_handles_count; ++i )
+  while ( sub->buf_len > 0 )
   {
-    int n = ap_tcp_check_state(debug_handles[i]);
+    n = send(sub->fd, sub->buf, sub->buf_len, MSG_DONTWAIT | MSG_NOSIGNAL);
 
-    if ( n == -1 || (n & 4) != 0 )
-      remove_debug_handle_internal(debug_handles[i]);
-    else
-      write(debug_handles[i], buf, buflen); //don't use tcpsend,etc, as it is may try to show some debug and do the loop
+    if ( n > 0 )
+    {
+      sub->buf_len -= n;
+      memmove(sub->buf, sub->buf + n, sub->buf_len);
+      sub->stalled_since = 0;
+      continue;
+    }
+
+    if ( n == -1 && errno == EINTR )
+      continue;
+
+    if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    {
+      if ( sub->stalled_since == 0 )
+        sub->stalled_since = time(NULL);
+
+      return sub->stalled_since + DEBUG_SUB_STALL > time(NULL);
+    }
+
+    return 0; // peer is gone
   }
+
+  return 1;
 }
 
 //=================================================================
-void debuglog(char *fmt, ...)
+// internal. appends message to subscriber's buffer or skips it if there is no room. under lock
+static void debug_sub_put(t_debug_sub *sub, const char *buf, int buflen)
 {
-  va_list vl;
-  int buflen;
-  char buf[1024];
-  static int repeats = 0;    //this statics is for syslog-like "last msg repeated N times..."
-  static char lastmsg[1024];
-  static int lastlen = 0;
-  static time_t last_time;
+  char note[64];
+  int n;
 
 
-  if ( ! getlock() )
+  if ( sub->skipped > 0 )
+  {
+    n = sprintf(note, "... %lu message(s) skipped\n", sub->skipped);
+
+    if ( n + buflen > DEBUG_SUB_BUF_SIZE - sub->buf_len )
+    {
+      ++sub->skipped;
+      return;
+    }
+
+    memcpy(sub->buf + sub->buf_len, note, n);
+    sub->buf_len += n;
+    sub->skipped = 0;
+  }
+
+  if ( buflen > DEBUG_SUB_BUF_SIZE - sub->buf_len )
+  {
+    ++sub->skipped;
     return;
+  }
+
+  memcpy(sub->buf + sub->buf_len, buf, buflen);
+  sub->buf_len += buflen;
+}
+
+//=================================================================
+// internal. drops the stalled or disconnected subscriber. under lock
+static void debug_sub_drop(int idx)
+{
+  // connection itself belongs to the event loop. it will see the hang up and close it
+  shutdown(debug_subs[idx].fd, SHUT_RDWR);
+  syslog(LOG_NOTICE, "ap_log: debug subscriber on fd %d dropped: %s", debug_subs[idx].fd,
+         ( debug_subs[idx].stalled_since ? "does not take the output" : "disconnected" ));
+  debug_sub_remove(idx);
+}
+
+//=================================================================
+// internal. tries to send the pending output of all subscribers
+static void debug_subs_flush(void)
+{
+  int i;
+
+
+  getlock();
+
+  for ( i = 0; i < debug_subs_count; ++i )
+    if ( ! debug_sub_flush(&debug_subs[i]) )
+      debug_sub_drop(i--);
+
+  debug_subs_update();
+  releaselock();
+}
+
+//=================================================================
+// internal. subscriber wants the message
+static int debug_sub_match(t_debug_sub *sub, const t_log_ctx *ctx)
+{
+  if ( ctx->level > sub->level || 0 == (ctx->category & sub->categories) )
+    return 0;
+
+  return sub->dev_id == 0 || ctx->dev_id == 0 || sub->dev_id == ctx->dev_id;
+}
+
+//=================================================================
+// internal. outputs ready message to stderr and the matching subscribers. under output lock
+static void debuglog_output(const char *buf, int buflen, const t_log_ctx *ctx)
+{
+  int i;
+
+
+  if ( debug_to_tty && ctx->level <= debug_level )
+    fwrite(buf, 1, buflen, stderr);
+
+  getlock();
+
+  for ( i = 0; i < debug_subs_count; ++i )
+  {
+    if ( ! debug_sub_match(&debug_subs[i], ctx) )
+      continue;
+
+    debug_sub_put(&debug_subs[i], buf, buflen);
+
+    if ( ! debug_sub_flush(&debug_subs[i]) )
+      debug_sub_drop(i--);
+  }
+
+  debug_subs_update();
+  releaselock();
+}
+
+//=================================================================
+// internal. debug message with syslog-like "last msg repeated N times..." folding. under output lock
+static void debuglog_text(char *buf, int buflen, const t_log_ctx *ctx)
+{
+  static int repeats = 0;
+  static char lastmsg[LOG_SLOT_DATA];
+  static int lastlen = 0;
+  static time_t last_time;
 
-  va_start(vl, fmt);
-  buflen = vsnprintf(buf, 1023, fmt, vl);
-  va_end(vl);
 
   if ( lastlen == buflen && 0 == strncmp(lastmsg, buf, lastlen) ) // repeat ?
   {
@@ -177,18 +418,18 @@ void debuglog(char *fmt, ...)
     if ( last_time + 3 >= time(NULL) ) // 3 sec delay between reposts
     {
       buflen = sprintf(buf, "... Last message repeated %d time(s)\n", repeats);
-      debuglog_output(buf, buflen);
+      debuglog_output(buf, buflen, ctx);
       repeats = 0;
       last_time = time(NULL);
 
-      goto end;
+      return;
     }
   }
 
   if ( repeats > 0 ) // should we repost final N repeats for previous message?
   {
     lastlen = sprintf(lastmsg, "... and finally repeated %d time(s)\n", repeats);
-    debuglog_output(lastmsg, lastlen);
+    debuglog_output(lastmsg, lastlen, ctx);
   }
 
   strcpy(lastmsg, buf);
@@ -196,47 +437,453 @@ void debuglog(char *fmt, ...)
   last_time = time(NULL);
   repeats = 0;
 
-  debuglog_output(buf, buflen);
+  debuglog_output(buf, buflen, ctx);
+}
+
+//=================================================================
+// internal. one line of hex dump with printable characters. returns text length
+static int memdump_line(char *out, unsigned char *s, int linelen, int addr, int showaddr)
+{
+  int i, n;
+
+
+  n = 0;
+
+  if (showaddr)
+    n += sprintf(out, "%04x(%4d):  ", addr, addr);
+
+  for (i = 0; i < linelen; ++i)
+    n += sprintf(out + n, "%02x %c ", s[i], isprint(s[i]) ? s[i] : '.');
+
+  out[n++] = '\n';
+  out[n] = '\0';
 
-end:
-  debug_mutex = 0;
+  return n;
 }
 
 //=================================================================
-void dosyslog(int priority, char *fmt, ...)
+// internal. one line of bits dump. returns text length
+static int memdumpb_line(char *out, unsigned char *s, int size)
+{
+  int i, n, mask;
+
+
+  out[0] = '\t';
+  n = 1;
+
+  for(i = 0; i < size; ++i)
+  {
+    n += sprintf(out + n, "0x%02x: ", s[i]);
+
+    for (mask = 128; mask != 0; mask >>= 1)
+      out[n++] = ( s[i] & mask ? '1' : '0' );
+
+    memcpy(out + n, "   ", 3);
+    n += 3;
+  }
+
+  out[n++] = '\n';
+  out[n] = '\0';
+
+  return n;
+}
+
+//=================================================================
+// internal. dumps memory line by line into file handle or to debug channel(s) if ctx is not NULL. the latter is under output lock
+// addr is the offset of p in the whole dump of total bytes, as it could be split into several parts
+static void memdump_lines(int fh, void *p, int len, int bits, const t_log_ctx *ctx, int addr, int total)
+{
+  char line[128];
+  unsigned char *s;
+  int n, showaddr, linelen;
+
+
+  s = (unsigned char*)p;
+  showaddr = ( ! bits && total > 48 ); // > 3 lines of data
+
+  for ( ; len > 0; len -= linelen, addr += linelen, s += linelen )
+  {
+    if ( bits )
+    {
+      linelen = len > 4 ? 4 : len;
+      n = memdumpb_line(line, s, linelen);
+    }
+    else
+    {
+      linelen = len > 16 ? 16 : len;
+      n = memdump_line(line, s, linelen, addr, showaddr);
+    }
+
+    if ( ctx == NULL )
+      write(fh, line, n);
+    else
+      debuglog_output(line, n, ctx);
+  }
+}
+
+//=================================================================
+// internal. gets free slot of ring for producer. NULL if ring is full. pos gets the slot's position
+static t_log_slot *log_slot_get(unsigned *pos)
+{
+  t_log_slot *slot;
+  unsigned seq;
+  int dif;
+
+
+  *pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+
+  for(;;)
+  {
+    slot = &log_ring[*pos & (LOG_RING_SLOTS - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    dif = (int)(seq - *pos);
+
+    if ( dif == 0 ) // free. trying to take it
+    {
+      if ( __atomic_compare_exchange_n(&log_enqueue_pos, pos, *pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        return slot;
+    }
+    else if ( dif < 0 ) // consumer has not freed it yet: full
+    {
+      __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    else // other producer took it
+      *pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+  }
+}
+
+//=================================================================
+// internal. makes filled slot visible to logger thread and wakes it up if it sleeps
+static void log_slot_put(t_log_slot *slot, unsigned pos)
+{
+  uint64_t one = 1;
+
+
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  if ( __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_ACQ_REL) )
+    write(log_wake_fd, &one, sizeof(one));
+}
+
+//=================================================================
+// internal. queues record. returns false if it is not in async mode, so the caller should do the output itself
+static int log_enqueue(int kind, int priority, int also_debug, const t_log_ctx *ctx, const void *data, int len)
+{
+  t_log_slot *slot;
+  unsigned pos;
+
+
+  if ( log_ring == NULL )
+    return 0;
+
+  if ( NULL == (slot = log_slot_get(&pos)) )
+    return 1; // dropped and counted
+
+  if ( len > LOG_SLOT_DATA - 1 )
+    len = LOG_SLOT_DATA - 1;
+
+  slot->kind = kind;
+  slot->priority = priority;
+  slot->also_debug = also_debug;
+  slot->ctx = *ctx;
+  slot->len = len;
+  memcpy(slot->data, data, len);
+  slot->data[len] = '\0';
+
+  log_slot_put(slot, pos);
+
+  return 1;
+}
+
+//=================================================================
+// internal. queues memory dump as several records if it does not fit the slot. returns false if it is not in async mode
+static int log_enqueue_dump(int kind, const void *p, int len)
+{
+  t_log_slot *slot;
+  unsigned pos;
+  int addr, chunk;
+
+
+  if ( log_ring == NULL )
+    return 0;
+
+  for ( addr = 0; addr < len; addr += chunk )
+  {
+    chunk = ( len - addr > LOG_DUMP_CHUNK ) ? LOG_DUMP_CHUNK : len - addr;
+
+    if ( NULL == (slot = log_slot_get(&pos)) )
+      return 1; // the rest is dropped and counted. logger reports it
+
+    slot->kind = kind;
+    slot->ctx = log_ctx;
+    slot->len = chunk;
+    slot->dump_addr = addr;
+    slot->dump_total = len;
+    memcpy(slot->data, (const char*)p + addr, chunk);
+
+    log_slot_put(slot, pos);
+  }
+
+  return 1;
+}
+
+//=================================================================
+// internal. writes out queued record
+static void log_write_record(t_log_slot *slot)
+{
+  switch ( slot->kind )
+  {
+    case LOGREC_SYSLOG:
+      syslog(slot->priority, "%s", slot->data);
+
+      if ( ! slot->also_debug )
+        break;
+      // fall through
+    case LOGREC_DEBUG:
+      output_lock();
+      debuglog_text(slot->data, slot->len, &slot->ctx);
+      output_unlock();
+      break;
+
+    case LOGREC_MEMDUMP:
+    case LOGREC_MEMDUMPB:
+      output_lock();
+      memdump_lines(-1, slot->data, slot->len, slot->kind == LOGREC_MEMDUMPB, &slot->ctx, slot->dump_addr, slot->dump_total);
+      output_unlock();
+      break;
+  }
+}
+
+//=================================================================
+// internal. takes all the ready records out of ring. logger thread only. returns count of records
+static int log_drain(void)
+{
+  t_log_slot *slot;
+  unsigned long dropped;
+  char buf[128];
+  int count, len;
+
+
+  for ( count = 0; ; ++count )
+  {
+    slot = &log_ring[log_dequeue_pos & (LOG_RING_SLOTS - 1)];
+
+    if ( __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_dequeue_pos + 1 )
+      break; // empty or the producer is not done with it yet
+
+    log_write_record(slot);
+
+    __atomic_store_n(&slot->seq, log_dequeue_pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    ++log_dequeue_pos;
+  }
+
+  if ( 0 != (dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED)) )
+  {
+    log_dropped_total += dropped;
+    len = snprintf(buf, sizeof(buf), "ap_log: %lu record(s) dropped on full queue (%lu total)\n", dropped, log_dropped_total);
+    syslog(LOG_WARNING, "%s", buf);
+
+    output_lock();
+    debuglog_output(buf, len, &syslog_ctx);
+    output_unlock();
+  }
+
+  return count;
+}
+
+//=================================================================
+// logger thread
+static void *log_thread_main(void *arg)
+{
+  struct pollfd pfd;
+  uint64_t n;
+
+
+  pfd.fd = log_wake_fd;
+  pfd.events = POLLIN;
+
+  for(;;)
+  {
+    if ( log_drain() )
+      continue;
+
+    __atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if ( log_drain() ) // producer could put the record before the flag was seen
+      continue;
+
+    // slow subscribers' output is retried, even if there is nothing new. idle daemon is not woken up otherwise
+    poll(&pfd, 1, ( debug_subs_pending ? 100 : -1 ));
+    read(log_wake_fd, &n, sizeof(n));
+
+    if ( debug_subs_pending )
+      debug_subs_flush();
+  }
+
+  return NULL;
+}
+
+//=================================================================
+// internal. atexit handler. lets logger thread write out the queue
+static void log_flush_at_exit(void)
+{
+  int i;
+
+
+  for ( i = 0; i < 1000 && __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED) != __atomic_load_n(&log_dequeue_pos, __ATOMIC_RELAXED); ++i )
+    usleep(1000);
+}
+
+//=================================================================
+int ap_log_async_start(void)
+{
+  unsigned i;
+  int errcode;
+
+
+  if ( log_ring != NULL )
+    return 1;
+
+  if ( -1 == (log_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) )
+  {
+    syslog(LOG_ERR, "ap_log_async_start: eventfd(): %m");
+    return 0;
+  }
+
+  if ( NULL == (log_ring = malloc(LOG_RING_SLOTS * sizeof(t_log_slot))) )
+  {
+    syslog(LOG_ERR, "ap_log_async_start: malloc: %m");
+    return 0;
+  }
+
+  for ( i = 0; i < LOG_RING_SLOTS; ++i )
+    log_ring[i].seq = i;
+
+  log_enqueue_pos = log_dequeue_pos = 0;
+
+  if ( 0 != (errcode = pthread_create(&log_thread, NULL, log_thread_main, NULL)) )
+  {
+    syslog(LOG_ERR, "ap_log_async_start: pthread_create(): %s", strerror(errcode));
+    free(log_ring);
+    log_ring = NULL;
+    return 0;
+  }
+
+  atexit(log_flush_at_exit);
+
+  return 1;
+}
+
+//=================================================================
+unsigned long ap_log_dropped(void)
+{
+  return log_dropped_total + __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+//=================================================================
+// internal. someone wants the messages of this verbosity
+static int level_wanted(int level)
+{
+  return level <= debug_level || level <= __atomic_load_n(&debug_subs_max_level, __ATOMIC_RELAXED);
+}
+
+//=================================================================
+int debug_want(int level)
+{
+  log_ctx.level = level;
+  log_ctx.category = log_thread_category;
+
+  return level_wanted(level);
+}
+
+//=================================================================
+int debug_want_cat(unsigned category, int level)
+{
+  log_ctx.level = level;
+  log_ctx.category = category;
+
+  return level_wanted(level);
+}
+
+//=================================================================
+void ap_log_context(unsigned category, int dev_id)
+{
+  log_thread_category = category;
+  log_ctx.category = category;
+  log_ctx.dev_id = dev_id;
+}
+
+//=================================================================
+void debuglog(char *fmt, ...)
 {
   va_list vl;
-  char buf[1024];
+  int buflen;
+  char buf[LOG_SLOT_DATA];
 
 
   va_start(vl, fmt);
-  vsnprintf(buf, 1023, fmt, vl);
+  buflen = vsnprintf(buf, LOG_SLOT_DATA - 1, fmt, vl);
   va_end(vl);
 
-  syslog(priority, buf);
+  if ( buflen > LOG_SLOT_DATA - 2 )
+    buflen = LOG_SLOT_DATA - 2;
 
-  if ( debug_level )
-    debuglog(buf);
+  if ( log_enqueue(LOGREC_DEBUG, 0, 0, &log_ctx, buf, buflen) )
+    return;
+
+  output_lock();
+  debuglog_text(buf, buflen, &log_ctx);
+  output_unlock();
 }
 
 //=================================================================
-void ap_error_set(char *fmt, ...)
+void dosyslog(int priority, char *fmt, ...)
 {
   va_list vl;
-  int msg_len;
+  int buflen;
+  char buf[LOG_SLOT_DATA];
 
 
-  if ( ! getlock() )
+  va_start(vl, fmt);
+  buflen = vsnprintf(buf, LOG_SLOT_DATA - 1, fmt, vl);
+  va_end(vl);
+
+  if ( buflen > LOG_SLOT_DATA - 2 )
+    buflen = LOG_SLOT_DATA - 2;
+
+  if ( log_enqueue(LOGREC_SYSLOG, priority, level_wanted(1), &syslog_ctx, buf, buflen) )
     return;
 
+  syslog(priority, "%s", buf);
+
+  if ( level_wanted(1) )
+  {
+    output_lock();
+    debuglog_text(buf, buflen, &syslog_ctx);
+    output_unlock();
+  }
+}
+
+//=================================================================
+void ap_error_set(char *fmt, ...)
+{
+  va_list vl;
+  char buf[ap_error_str_maxlen];
+
+
   va_start(vl, fmt);
-  msg_len = vsnprintf(ap_error_str, ap_error_str_maxlen, fmt, vl);
+  vsnprintf(buf, ap_error_str_maxlen, fmt, vl);
   va_end(vl);
 
-  if (debug_level)
-    debuglog_output(ap_error_str, msg_len);
+  if ( ! getlock() )
+    return;
+
+  strcpy(ap_error_str, buf);
+  releaselock();
 
-  debug_mutex = 0;
+  if ( debug_want(1) )
+    debuglog("%s", buf); // out of the list lock: output lock is always taken first
 }
 
 //=================================================================
@@ -285,96 +932,34 @@ int hputc(char c, int fh)
 // memory hex dump with printable characters shown
 void memdumpfd(int fh, void *p, int len)
 {
-  int i, addr, showaddr;
-  unsigned char *s;
-
-
-  if (len == 0)
-     return;
-
-  showaddr = (len > 48);// > 3 lines of data
-  addr = 0;
-
-  s = (unsigned char*)p;
-
-  for (; len > 0; len -= 16, addr += 16)
-  {
-    if (showaddr)
-      hprintf(fh, "%04x(%4d):  ", addr, addr);
-
-    int linelen = len > 16 ? 16 : len;
-
-    for (i = 0; i < linelen; ++i)
-      hprintf(fh, "%02x %c ", s[i], isprint(s[i]) ? s[i] : '.');
-
-    /*
-    for(i = 0; i < linelen; ++i) hprintf(fh, "%02x ", s[i]);
-    for(i = 16 - linelen; i > 0; --i) hputs("   ", fh);
-
-    hprintf(fh, "\n\t");
-    for(i = 0; i < linelen; ++i) hprintf(fh, " %c ", isprint(s[i]) ? s[i] : '.');
-    */
-    hputc('\n', fh);
-    s += linelen;
-  }
+  memdump_lines(fh, p, len, 0, NULL, 0, len);
 }
 
-// dumps to debug channel if any
+// dumps to debug channel if any. in async mode it is formatted by logger thread, long dump in several parts
 void memdump(void *p, int len)
 {
-  int i;
-
-
-  if (debug_to_tty)
-    memdumpfd(fileno(stderr), p, len);
+  if ( log_enqueue_dump(LOGREC_MEMDUMP, p, len) )
+    return;
 
-  for ( i = 0; i < debug_handles_count; ++i )
-    if (debug_handles[i] != 0)
-      memdumpfd(debug_handles[i], p, len);
+  output_lock();
+  memdump_lines(-1, p, len, 0, &log_ctx, 0, len);
+  output_unlock();
 }
 
 //==========================================================
 // memory bits dump
 void memdumpbfd(int fh, void *p, int len)
 {
-  int i, mask;
-  unsigned char *s;
-
-
-  if (len == 0)
-    return;
-
-  s = (unsigned char*)p;
-
-  for (; len > 0; len -= 4)
-  {
-    hputs("\t", fh);
-    int size = len > 4 ? 4 : len;
-
-    for(i = 0; i < size; ++i)
-    {
-      hprintf(fh, "0x%02x: ", s[i]);
-
-      for (mask = 128; mask != 0; mask >>= 1)
-        hputc( s[i] & mask ? '1' : '0', fh );
-
-      hputs("   ", fh);
-    }
-    hputs("\n", fh);
-  }
+  memdump_lines(fh, p, len, 1, NULL, 0, len);
 }
 
-// dumps to debug channel if any
+// dumps to debug channel if any. in async mode it is formatted by logger thread, long dump in several parts
 void memdumpb(void *p, int len)
 {
-  int i;
-
-
-  if (debug_to_tty)
-    memdumpbfd(fileno(stderr), p, len);
+  if ( log_enqueue_dump(LOGREC_MEMDUMPB, p, len) )
+    return;
 
-  for ( i = 0; i < debug_handles_count; ++i )
-    if (debug_handles[i] != 0)
-      memdumpbfd(debug_handles[i], p, len);
+  output_lock();
+  memdump_lines(-1, p, len, 1, &log_ctx, 0, len);
+  output_unlock();
 }
-
@@ -9,7 +9,20 @@ extern int debug_to_tty;
 extern int debug_level;
 #endif
 
-//register file/stream handle for debug output
+// message categories for debug subscribers' filters
+#define LOGCAT_GENERAL 1
+#define LOGCAT_TCP     2
+#define LOGCAT_SERIAL  4
+#define LOGCAT_DRIVER  8
+#define LOGCAT_ALL     0x0f
+
+/* registers socket as debug channel with its own verbosity and filter: LOGCAT_* mask and device id (0 - any).
+   output is buffered for each subscriber and sent without blocking. messages are skipped if the buffer is full
+   and subscriber that does not take anything for long is dropped. re-registering changes the settings
+*/
+extern int add_debug_subscriber(int fd, int level, unsigned categories, int dev_id);
+
+//register socket for debug output with current debug_level and no filter
 extern int add_debug_handle(int fd);
 
 //removes handle from debug output
@@ -18,12 +31,32 @@ extern int remove_debug_handle(int fd);
 //checks if handle is registered for debug output
 extern int is_debug_handle(int fd);
 
+/* true if messages of this verbosity are wanted by stderr (debug_level) or any subscriber.
+   the following messages of the thread are tagged with the level, so use it as the guard: if ( debug_want(5) ) debuglog(...);
+*/
+extern int debug_want(int level);
+
+// the same, but tags the following messages with category other than thread's one
+extern int debug_want_cat(unsigned category, int level);
+
+// sets category (LOGCAT_*) and device id (0 - none) for the messages of calling thread
+extern void ap_log_context(unsigned category, int dev_id);
+
 //logs message to debug channel(s)
 extern void debuglog(char *fmt, ...);
 
 //syslog wrapper. also call debuglog if level is set
 extern void dosyslog(int priority, char *fmt, ...);
 
+/* switches logging to asynchronous mode: debuglog(), dosyslog() and memdump*() only queue the records
+   and logger thread writes them out. records are dropped and counted if the queue is full, so callers never wait.
+   call after fork(), as threads do not survive it. returns boolean success. logging stays synchronous on failure
+*/
+extern int ap_log_async_start(void);
+
+// count of records dropped on full queue so far
+extern unsigned long ap_log_dropped(void);
+
 // returns string with info on last error occured within ap_* function calls
 extern const char *ap_error_get(void);
 
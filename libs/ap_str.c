@@ -60,15 +60,20 @@ void *getmem(int size, char *errmsg)
 int check_buf_size(char **buf, int *bufsize, int *bufpos, int needbytes)
 {
   int n;
+  char *p;
 
 
   if ( *bufsize - *bufpos < needbytes )
   {
     n = *bufsize + needbytes - (*bufsize - *bufpos);
 
-    if ( NULL == realloc(*buf, n) )
+    if ( n < *bufsize * 2 ) // geometric growth keeps the long series of appends linear
+      n = *bufsize * 2;
+
+    if ( NULL == (p = realloc(*buf, n)) )
       return 0;
 
+    *buf = p;
     *bufsize = n;
   }
 
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -18,9 +19,36 @@ int ap_tcp_max_connections = 3;   // default max tcp connections to maintain
 struct timeval max_tcp_conn_time;   // max tcp connection stall time. forced close after that)
 ap_tcp_connection_t *ap_tcp_connections = NULL; // malloc'd on config read when 'ap_tcp_max_connections' is known
 int ap_tcp_conn_count = 0; // current connections count
+void (*ap_tcp_close_hook)(int conn_idx) = NULL; // called before the socket is closed
+void (*ap_tcp_output_hook)(int conn_idx, int pending) = NULL; // called when output is queued or queue is emptied
+int ap_tcp_nodelay = 1; // answers are sent with single call, so there is nothing to gain from Nagle
+int ap_tcp_max_bufsize = 1048576; // input buffer growth cap
+void (*ap_tcp_open_hook)(int conn_idx) = NULL; // called when connection gets a slot
+int ap_tcp_queue_size = 16; // accepted connections waiting for a free slot
+int ap_tcp_retry_after = 1000; // msec. advised to the refused peers
+
+/* connections accepted while all slots are busy. FIFO ring, admitted as slots are freed.
+   peer that waits longer than max_tcp_conn_time is refused with busy answer, as well as the one that does not fit
+*/
+typedef struct ap_tcp_queued_t
+{
+  int fd;
+  struct sockaddr_in addr;
+  uint64_t deadline; // ap_evloop_now() based
+} ap_tcp_queued_t;
+
+static ap_tcp_queued_t *admit_queue = NULL;
+static int admit_head = 0, admit_count = 0;
+static ap_evloop_timer_t admit_timer; // due now if there is a free slot, or at the head's deadline
+
+static int *free_slots = NULL; // stack of free ap_tcp_connections[] indexes
+static int free_count = 0;
+
 
 struct ap_tcp_stat_t ap_tcp_stat; // statistics companion
 
+static void ap_tcp_admit(ap_evloop_timer_t *timer, void *data);
+
 //=================================================================
 void ap_tcp_connection_module_init(void)
 {
@@ -28,45 +56,44 @@ void ap_tcp_connection_module_init(void)
 
 
   ap_tcp_connections = getmem(ap_tcp_max_connections * sizeof(struct ap_tcp_connection_t), "malloc on ap_tcp_connections");
+  free_slots = getmem(ap_tcp_max_connections * sizeof(int), "malloc on free_slots");
+
+  if ( ap_tcp_queue_size > 0 )
+    admit_queue = getmem(ap_tcp_queue_size * sizeof(ap_tcp_queued_t), "malloc on admit_queue");
+
+  ap_evloop_timer_init(&admit_timer, ap_tcp_admit, NULL);
 
   for (i = 0; i < ap_tcp_max_connections; ++i)
   {
+    free_slots[free_count++] = ap_tcp_max_connections - 1 - i; // lower ones are taken first
+
     ap_tcp_connections[i].fd = 0;
-    ap_tcp_connections[i].bufptr = 0;
+    ap_tcp_connections[i].bufptr = ap_tcp_connections[i].bufstart = ap_tcp_connections[i].scanpos = 0;
     ap_tcp_connections[i].bufsize = 1024;
     ap_tcp_connections[i].buf = getmem(ap_tcp_connections[i].bufsize, "malloc on ap_tcp_connections.buf");
+    ap_tcp_connections[i].obuf = NULL; // allocated on the first partial write
+    ap_tcp_connections[i].obufsize = 0;
   }
 
   ap_tcp_stat.conn_count = 0;
   ap_tcp_stat.active_conn_count = 0;
   ap_tcp_stat.timedout = 0;
   ap_tcp_stat.queue_full_count = 0;
+  ap_tcp_stat.queued_count = 0;
   ap_tcp_stat.total_time.tv_sec = 0;
   ap_tcp_stat.total_time.tv_usec = 0;
 }
 
 //=================================================================
+// sockets are non-blocking since accept, and closed fd is reported by recv/send with EBADF anyway
 static int tcprecv(int sh, void *buf, int size)
 {
-  if ( -1 != fcntl(sh, F_GETFL) )
-    return recv(sh, buf, size, MSG_DONTWAIT);
+  int n;
 
-  if (debug_level > 9)
+  if ( -1 == (n = recv(sh, buf, size, MSG_DONTWAIT)) && debug_want(10) && errno != EAGAIN )
     debuglog("! tcprecv: sock %d recv error: %m\n", sh);
 
-  return -1;
-}
-
-//=================================================================
-static int tcpsend(int sh, void *buf, int size)
-{
-  if ( -1 != fcntl(sh, F_GETFL) )
-    return send(sh, buf, size, MSG_DONTWAIT);
-
-  if (debug_level > 9)
-    debuglog("! tcpsend: sock %d send error: %m\n", sh);
-
-  return -1;
+  return n;
 }
 
 //=================================================================
@@ -86,7 +113,7 @@ int ap_tcp_conn_recv(int conn_idx, void *buf, int size)
 
   if ( (n == -1 && errno == EPIPE) || n == 0)
   {
-    if (debug_level)
+    if (debug_want(1))
       debuglog("? TCP Connection [%d] is dead prematurely\n", conn_idx);
 
     ap_tcp_close_connection(conn_idx, NULL);
@@ -98,24 +125,143 @@ int ap_tcp_conn_recv(int conn_idx, void *buf, int size)
 //=================================================================
 int ap_tcp_conn_send(int conn_idx, void *buf, int size)
 {
-  int n;
+  struct iovec iov;
 
-  if ( 0 == ap_tcp_connections[conn_idx].fd )
-  {
-    dosyslog(LOG_ERR, "! connrecv() on closed fd");
+  iov.iov_base = buf;
+  iov.iov_len = size;
+
+  return ap_tcp_conn_sendv(conn_idx, &iov, 1);
+}
+
+//=================================================================
+// closes connection on fatal send error. returns -1 then
+static int send_error(int conn_idx)
+{
+  if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
     return 0;
+
+  if (debug_want(1))
+    debuglog("? TCP Connection #%d is dead prematurely: %m\n", conn_idx);
+
+  ap_tcp_close_connection(conn_idx, NULL);
+
+  return -1;
+}
+
+//=================================================================
+// single sendmsg() for all parts, which is writev() with flags. whatever socket did not accept is queued to obuf
+// and sent by ap_tcp_conn_flush() later. if there is queued output already, then all goes to the queue to keep the order
+int ap_tcp_conn_sendv(int conn_idx, struct iovec *iov, int iovcnt)
+{
+  ap_tcp_connection_t *tc;
+  struct msghdr msg;
+  int i, n, total, skip, len;
+
+  tc = &ap_tcp_connections[conn_idx];
+
+  if ( 0 == tc->fd )
+  {
+    dosyslog(LOG_ERR, "! connsend() on closed fd");
+    return -1;
   }
 
-  n = tcpsend(ap_tcp_connections[conn_idx].fd, buf, size);
+  for ( i = total = 0; i < iovcnt; ++i )
+    total += iov[i].iov_len;
 
-  if ( (n == -1 && errno == EPIPE) || n == 0)
+  n = 0;
+
+  if ( tc->obufptr == 0 ) // nothing queued. trying to send right away
   {
-    if (debug_level)
-      debuglog("? TCP Connection #%d is dead prematurely: %m\n", conn_idx);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    if ( -1 == (n = sendmsg(tc->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) )
+    {
+      if ( -1 == send_error(conn_idx) )
+        return -1;
+
+      n = 0;
+    }
+
+    if ( n == total )
+      return total;
+  }
+
+  // queueing the rest
+  if ( ! check_buf_size(&tc->obuf, &tc->obufsize, &tc->obufptr, total - n) )
+  {
+    dosyslog(LOG_ERR, "! connsend: realloc for +%d: %m", total - n);
+    exit(1);
+  }
+
+  for ( i = 0, skip = n; i < iovcnt; ++i )
+  {
+    len = iov[i].iov_len;
+
+    if ( skip >= len )
+    {
+      skip -= len;
+      continue;
+    }
+
+    memcpy(tc->obuf + tc->obufptr, (char*)(iov[i].iov_base) + skip, len - skip);
+    tc->obufptr += len - skip;
+    skip = 0;
+  }
+
+  if ( debug_want(10) )
+    debuglog("* TCP conn [%d]: %d bytes queued\n", conn_idx, tc->obufptr - tc->obufsent);
 
+  if ( ap_tcp_output_hook != NULL )
+    ap_tcp_output_hook(conn_idx, 1);
+
+  return total;
+}
+
+//=================================================================
+int ap_tcp_conn_flush(int conn_idx)
+{
+  ap_tcp_connection_t *tc;
+  int n;
+
+  tc = &ap_tcp_connections[conn_idx];
+
+  if ( 0 == tc->fd )
+    return -1;
+
+  if ( tc->obufptr > tc->obufsent )
+  {
+    if ( -1 == (n = send(tc->fd, tc->obuf + tc->obufsent, tc->obufptr - tc->obufsent, MSG_DONTWAIT | MSG_NOSIGNAL)) )
+      return send_error(conn_idx) == -1 ? -1 : tc->obufptr - tc->obufsent;
+
+    tc->obufsent += n;
+
+    if ( tc->obufptr > tc->obufsent )
+      return tc->obufptr - tc->obufsent;
+  }
+
+  tc->obufptr = tc->obufsent = 0;
+
+  if ( ap_tcp_output_hook != NULL )
+    ap_tcp_output_hook(conn_idx, 0);
+
+  if ( tc->close_pending )
+  {
     ap_tcp_close_connection(conn_idx, NULL);
+    return -1;
   }
-  return n;
+
+  return 0;
+}
+
+//=================================================================
+void ap_tcp_close_when_sent(int conn_idx)
+{
+  if ( ap_tcp_connections[conn_idx].obufptr == 0 )
+    ap_tcp_close_connection(conn_idx, NULL);
+  else
+    ap_tcp_connections[conn_idx].close_pending = 1;
 }
 
 //=======================================================================
@@ -129,14 +275,22 @@ void ap_tcp_close_connection(int conn_idx, char *msg) // close tcp connection by
 
   dh = is_debug_handle(ap_tcp_connections[conn_idx].fd);
   remove_debug_handle(ap_tcp_connections[conn_idx].fd);
+  ap_evloop_timer_stop(&ap_tcp_connections[conn_idx].idle_timer);
 
   if ( msg != NULL )
     ap_tcp_conn_send(conn_idx, msg, strlen(msg));
 
+  if ( ap_tcp_close_hook != NULL )
+    ap_tcp_close_hook(conn_idx);
+
   close(ap_tcp_connections[conn_idx].fd);
 
   ap_tcp_connections[conn_idx].fd = 0;
   --ap_tcp_conn_count;
+  free_slots[free_count++] = conn_idx;
+
+  if ( admit_count > 0 ) // admitted from event loop, so caller does not find its slot re-used
+    ap_evloop_timer_start(&admit_timer, 0);
 
   if ( ! dh ) // debug connections will not count for execution time
   {
@@ -145,59 +299,166 @@ void ap_tcp_close_connection(int conn_idx, char *msg) // close tcp connection by
     timeradd(&ap_tcp_stat.total_time, &tv, &ap_tcp_stat.total_time);
   }
 
-  if ( debug_level > 0 )
+  if ( debug_want(1) )
     debuglog("* TCP conn [%d] closed\n", conn_idx);
 }
 
 //=======================================================================
-int ap_tcp_accept_connection(int list_sock) // accepts new connection and adds it to the list
+// idle timer handler. connection was silent for too long
+static void ap_tcp_idle_expired(ap_evloop_timer_t *timer, void *data)
 {
-  int tcpci, n, new_sock;
+  int conn_idx = ((ap_tcp_connection_t *)data)->idx;
+
+
+  ap_tcp_close_connection(conn_idx, NULL/*"\n401 Session Expired\n"*/);
+  ++ap_tcp_stat.timedout;
+
+  if (debug_want(1))
+    debuglog("\n%d Session Expired\n", conn_idx);
+}
+
+//=======================================================================
+void ap_tcp_conn_idle_restart(int conn_idx)
+{
+  ap_evloop_timer_start(&ap_tcp_connections[conn_idx].idle_timer, max_tcp_conn_time.tv_sec * 1000 + max_tcp_conn_time.tv_usec / 1000);
+}
+
+//=======================================================================
+void ap_tcp_conn_idle_stop(int conn_idx)
+{
+  ap_evloop_timer_stop(&ap_tcp_connections[conn_idx].idle_timer);
+}
+
+//=======================================================================
+// internal. puts accepted socket to the free slot. returns index
+static int ap_tcp_conn_setup(int fd, struct sockaddr_in *addr)
+{
+  int tcpci;
+
+
+  tcpci = free_slots[--free_count];
+
+  ap_tcp_connections[tcpci].fd = fd;
+  ap_tcp_connections[tcpci].idx = tcpci;
+  ap_tcp_connections[tcpci].addr = *addr;
+
+  gettimeofday(&ap_tcp_connections[tcpci].created_time, NULL);
+  ap_evloop_timer_init(&ap_tcp_connections[tcpci].idle_timer, ap_tcp_idle_expired, &ap_tcp_connections[tcpci]);
+  ap_tcp_conn_idle_restart(tcpci);
+
+  ap_tcp_connections[tcpci].bufptr = ap_tcp_connections[tcpci].bufstart = ap_tcp_connections[tcpci].scanpos = 0;
+  ap_tcp_connections[tcpci].obufptr = ap_tcp_connections[tcpci].obufsent = 0;
+  ap_tcp_connections[tcpci].close_pending = 0;
+  ap_tcp_connections[tcpci].state = TC_ST_READY;
+  ++ap_tcp_conn_count;
+
+  ++ap_tcp_stat.conn_count;
+  ap_tcp_stat.active_conn_count += ap_tcp_conn_count;
 
+  if (debug_want(1)) debuglog("* Got connected ([%d])\n", tcpci);
 
-  for (tcpci = 0; tcpci < ap_tcp_max_connections; ++tcpci) // finding free slot
-    if (ap_tcp_connections[tcpci].fd == 0)
-      break;
+  if ( ap_tcp_open_hook != NULL )
+    ap_tcp_open_hook(tcpci);
 
-  if (tcpci == ap_tcp_max_connections)
+  return tcpci;
+}
+
+//=======================================================================
+// internal. answers that we are busy and closes the socket. peer is not waited for
+static void ap_tcp_refuse(int fd)
+{
+  char msg[64];
+  int n;
+
+
+  n = sprintf(msg, "409 busy, retry after %d ms\r\n", ap_tcp_retry_after);
+  send(fd, msg, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+
+  ++ap_tcp_stat.queue_full_count;
+
+  if (debug_want(1))
+    debuglog("? Conn list is full. refused incoming\n");
+}
+
+//=======================================================================
+// admit timer handler. gives the freed slots to the queued connections and refuses the ones waiting for too long
+static void ap_tcp_admit(ap_evloop_timer_t *timer, void *data)
+{
+  ap_tcp_queued_t q;
+  uint64_t now;
+
+
+  now = ap_evloop_now();
+
+  while ( admit_count > 0 )
   {
-     ++ap_tcp_stat.queue_full_count;
+    q = admit_queue[admit_head];
 
-     if (debug_level)
-       debuglog("? Conn list is full. dumping new incoming\n");
+    if ( free_count == 0 && q.deadline > now )
+    {
+      ap_evloop_timer_at(&admit_timer, q.deadline);
+      return;
+    }
 
-     return 0;
+    admit_head = (admit_head + 1) % ap_tcp_queue_size;
+    --admit_count;
+
+    if ( free_count > 0 )
+      ap_tcp_conn_setup(q.fd, &q.addr);
+    else
+      ap_tcp_refuse(q.fd);
   }
+}
+
+//=======================================================================
+int ap_tcp_accept_connection(int list_sock) // accepts new connection. returns index, AP_TCP_NOSLOT if it was queued or refused, -1 if nothing to accept
+{
+  struct sockaddr_in addr;
+  int n, new_sock;
 
-  n = sizeof(ap_tcp_connections[tcpci].addr);
 
-  if ( -1 == (new_sock = accept(list_sock, (struct sockaddr *)&ap_tcp_connections[tcpci].addr, (socklen_t*)&n)) )
+  n = sizeof(addr);
+
+  if ( -1 == (new_sock = accept(list_sock, (struct sockaddr *)&addr, (socklen_t*)&n)) )
   {
-    dosyslog(LOG_ERR, "! accept: %m");
-    return 0;
+    if ( errno != EAGAIN && errno != EWOULDBLOCK )
+      dosyslog(LOG_ERR, "! accept: %m");
+
+    return -1;
   }
 
   /* setting non-blocking connection.
-     data exchange will be performed in the timer_event() called by alarm handler
+     data exchange will be performed by event loop handlers on readiness
   */
   fcntl(new_sock, F_SETFL, fcntl(new_sock, F_GETFL) | O_NONBLOCK);
 
-  ap_tcp_connections[tcpci].fd = new_sock;
-  ap_tcp_connections[tcpci].idx = tcpci;
+  n = ap_tcp_nodelay;
+  setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n));
 
-  gettimeofday(&ap_tcp_connections[tcpci].created_time, NULL);
-  timeradd(&ap_tcp_connections[tcpci].created_time, &max_tcp_conn_time, &ap_tcp_connections[tcpci].expire);
+  if ( free_count > 0 && admit_count == 0 ) // queued ones go first
+    return ap_tcp_conn_setup(new_sock, &addr);
 
-  ap_tcp_connections[tcpci].bufptr = 0;
-  ap_tcp_connections[tcpci].state = TC_ST_READY;
-  ++ap_tcp_conn_count;
+  if ( admit_count == ap_tcp_queue_size )
+  {
+    ap_tcp_refuse(new_sock);
+    return AP_TCP_NOSLOT;
+  }
 
-  ++ap_tcp_stat.conn_count;
-  ap_tcp_stat.active_conn_count += ap_tcp_conn_count;
+  admit_queue[(admit_head + admit_count) % ap_tcp_queue_size].fd = new_sock;
+  admit_queue[(admit_head + admit_count) % ap_tcp_queue_size].addr = addr;
+  admit_queue[(admit_head + admit_count) % ap_tcp_queue_size].deadline = ap_evloop_now()
+    + max_tcp_conn_time.tv_sec * 1000000ULL + max_tcp_conn_time.tv_usec;
 
-  if (debug_level) debuglog("* Got connected ([%d])\n", tcpci);
+  if ( ++admit_count == 1 )
+    ap_evloop_timer_at(&admit_timer, admit_queue[admit_head].deadline);
 
-  return 1;
+  ++ap_tcp_stat.queued_count;
+
+  if (debug_want(1))
+    debuglog("? Conn list is full. queued new incoming, %d waiting\n", admit_count);
+
+  return AP_TCP_NOSLOT;
 }
 
 //=======================================================================
@@ -220,7 +481,7 @@ int ap_tcp_check_state(int conn_idx)
 
   if ( n == -1 && errno == EPIPE )
   {
-    if (debug_level > 10)
+    if (debug_want(11))
       debuglog("- ap_tcp_check_state(%d): send(): %d/%m\n", fd, n);
 
     return 4;
@@ -248,7 +509,7 @@ int ap_tcp_check_state(int conn_idx)
   if ( FD_ISSET(fd, &fdr) ) n = 1;
   if ( FD_ISSET(fd, &fdw) ) n |= 2;
   if ( FD_ISSET(fd, &fde) ) n |= 4;
-  //if (debug_level > 10 && debug_to_tty) fprintf(stderr, "- ap_tcp_check_state(%d): %d\n", fd, n);
+  //if (debug_want(11) && debug_to_tty) fprintf(stderr, "- ap_tcp_check_state(%d): %d\n", fd, n);
 
   return n;
 }
@@ -282,7 +543,7 @@ void ap_tcp_check_conns(int a)
 
     ap_tcp_close_connection(i, NULL);
 
-    if (debug_level)
+    if (debug_want(1))
       debuglog("\n? [%d] Session dropped/error\n", i);
   }
 }
@@ -294,8 +555,8 @@ void ap_tcp_print_stat(void)
 
   n = ap_tcp_stat.active_conn_count * 100u / ap_tcp_stat.conn_count;
 
-  debuglog("\n# aptcp: total conns: %u, avg: %u.%02u, t/o count: %u, queue full: %u times\n",
-    ap_tcp_stat.conn_count, n/100u, n%100u, ap_tcp_stat.timedout, ap_tcp_stat.queue_full_count);
+  debuglog("\n# aptcp: total conns: %u, avg: %u.%02u, t/o count: %u, queued: %u, refused: %u times\n",
+    ap_tcp_stat.conn_count, n/100u, n%100u, ap_tcp_stat.timedout, ap_tcp_stat.queued_count, ap_tcp_stat.queue_full_count);
 
   n = ap_tcp_stat.total_time.tv_sec * 1000000000u + ap_tcp_stat.total_time.tv_usec;
 
@@ -13,6 +13,9 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ap_evloop.h"
 
 // tcp conn statuses (mostly internal for tcp_answer() func)
 #define TC_ST_READY  0
@@ -25,10 +28,15 @@ typedef struct ap_tcp_connection_t
   int fd; // file descriptor (0 = unused slot)
   int idx; // index in array
   struct sockaddr_in addr;
-  struct timeval created_time, expire;
+  struct timeval created_time;
+  ap_evloop_timer_t idle_timer; // closes stalled connection. armed on accept, see ap_tcp_conn_idle_restart()
   char *buf; // IO buffer
-  int nextline; // next line offset if last read() got too much. -1 if none, 0 if incomplete line
-  int bufsize, bufptr; // buf size/current index
+  int bufstart; // start of the data not processed yet
+  int scanpos; // EOL search resumes from here, so the incomplete line is not rescanned
+  int bufsize, bufptr; // buf size/data end
+  char *obuf; // output that socket did not accept at once. sent on writability
+  int obufsize, obufptr, obufsent; // obuf size/data end/sent so far
+  int close_pending; // close connection as soon as obuf is sent
   // should this be an pointer to user-data...
   int state, cmdcode, needlines; // tcp_answer() internals
 } ap_tcp_connection_t;
@@ -37,7 +45,8 @@ typedef struct ap_tcp_stat_t
 {
   unsigned conn_count; // all time connections count
   unsigned timedout;   // how many timed out
-  unsigned queue_full_count; // how many was dropped because of queue full
+  unsigned queue_full_count; // how many was refused because of admission queue full or waiting too long
+  unsigned queued_count; // how many waited in admission queue for a free slot
   unsigned active_conn_count; // a sum of active connections for the each new created. use for avg_conn_count = active_conn_count / conn_count
   struct timeval total_time; // total time for all closed connections
 } ap_tcp_stat_t;
@@ -48,9 +57,18 @@ extern struct timeval max_tcp_conn_time;   // max tcp connection stall time. for
 extern struct ap_tcp_connection_t *ap_tcp_connections; // malloc'd on config read when 'max_tCPConnections' is known
 extern int ap_tcp_conn_count;
 extern struct ap_tcp_stat_t ap_tcp_stat;
+extern void (*ap_tcp_close_hook)(int conn_idx); // if set, called before the socket is closed. e.g. to drop it from event loop
+extern void (*ap_tcp_output_hook)(int conn_idx, int pending); // if set, called when connection gets or gets rid of pending output. e.g. to watch for writability
+extern int ap_tcp_nodelay; // set TCP_NODELAY on accepted connections. default on
+extern int ap_tcp_max_bufsize; // input buffer does not grow beyond that. longer line is an error
+extern void (*ap_tcp_open_hook)(int conn_idx); // if set, called when connection gets a slot, either at once or from admission queue. e.g. to add it to event loop
+extern int ap_tcp_queue_size; // accepted connections that wait for a free slot. the rest is refused with "409 busy" answer. 0 - refuse at once
+extern int ap_tcp_retry_after; // msec to advise in "409 busy, retry after N ms" answer
 #endif
 
-extern int  ap_tcp_accept_connection(int list_sock); // accepts new connection and adds it to the list
+#define AP_TCP_NOSLOT -2 // ap_tcp_accept_connection(): connection was queued or refused
+
+extern int  ap_tcp_accept_connection(int list_sock); // accepts new connection and adds it to the list. returns index, AP_TCP_NOSLOT or -1 if there is nothing to accept
 extern void ap_tcp_check_conns(int dummy); // used as sigaction() EPIPE handler to prevent dumping when connection dropped unexpectedly
 extern int  ap_tcp_check_state(int fd);
 extern void ap_tcp_close_connection(int conn_idx, char *msg); // close tcp connection by index, msg !=NULL to post some answer before close
@@ -58,5 +76,10 @@ extern int ap_tcp_connection_is_alive(int conn_idx); // returns true if alive
 extern void ap_tcp_connection_module_init(void);
 extern int  ap_tcp_conn_recv(int conn_idx, void *buf, int size);
 extern int  ap_tcp_conn_send(int conn_idx, void *buf, int size);
+extern int  ap_tcp_conn_sendv(int conn_idx, struct iovec *iov, int iovcnt); // gathers all into single send. the rest is queued if socket is full. returns bytes accepted or -1
+extern int  ap_tcp_conn_flush(int conn_idx); // sends queued output. returns bytes left or -1 if connection is closed
+extern void ap_tcp_close_when_sent(int conn_idx); // closes connection now or after queued output is sent
+extern void ap_tcp_conn_idle_restart(int conn_idx); // connection is closed after max_tcp_conn_time of inactivity from now
+extern void ap_tcp_conn_idle_stop(int conn_idx); // connection is not closed for inactivity until restarted. e.g. it waits for some job
 extern void ap_tcp_print_stat(void); // print stats to debug channel
 #endif
@@ -1,8 +1,15 @@
-#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
-static char encoding_table[] = {
+#include "b64.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_SIMD
+#include <immintrin.h>
+#endif
+
+static const char encoding_table[64] = {
   'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
   'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
   'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
@@ -12,90 +19,373 @@ static char encoding_table[] = {
   'w', 'x', 'y', 'z', '0', '1', '2', '3',
   '4', '5', '6', '7', '8', '9', '+', '/'
 };
-static char *decoding_table = NULL;
-static int mod_table[] = {0, 2, 1};
 
+// 0xff - not a base64 alphabet char
+static const uint8_t decoding_table[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+#ifdef B64_SIMD
 //================================================================================
-void build_decoding_table()
+// vectorized paths. each one processes as many whole blocks as it can and returns the count of input bytes consumed.
+// the rest is done by scalar code. used only for payloads of B64_SIMD_MIN bytes and more, as short ones are not worth it
+#define B64_SIMD_MIN 64
+
+#define SIMD_NONE  0
+#define SIMD_SSSE3 1
+#define SIMD_AVX2  2
+static int simd_level = -1; // not detected yet
+
+static int simd_detect(void)
 {
-int i;
+  if ( simd_level == -1 )
+  {
+    __builtin_cpu_init();
 
-  decoding_table = malloc(256);
-  for (i = 0; i < 0x40; i++) decoding_table[(int)encoding_table[i]] = i;
+    if ( __builtin_cpu_supports("avx2") )
+      simd_level = SIMD_AVX2;
+    else if ( __builtin_cpu_supports("ssse3") )
+      simd_level = SIMD_SSSE3;
+    else
+      simd_level = SIMD_NONE;
+  }
+
+  return simd_level;
 }
 
 //================================================================================
-void base64_cleanup()
+// 16 bytes of 3-bytes groups, already spread to 4 bytes each -> 16 ascii chars
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i in)
 {
-  if(decoding_table != NULL) free(decoding_table);
+  __m128i t0, t1, t2, t3, idx, res, less;
+
+
+  // split to 6-bit indexes
+  t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  idx = _mm_or_si128(t1, t3);
+
+  // index -> char offset range, then add the range's shift
+  res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+  res = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                       '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), res);
+
+  return _mm_add_epi8(res, idx);
 }
 
 //================================================================================
-char *base64_encode(const char *data, size_t input_length, size_t *output_length)
+__attribute__((target("ssse3")))
+static size_t enc_ssse3(const uint8_t *in, size_t len, char *out)
 {
-int i,j;
-char *encoded_data;
-uint32_t octet_a, octet_b, octet_c, triple;
+  const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  size_t i;
+
+
+  // reads 16 bytes, uses 12
+  for ( i = 0; len - i >= 16; i += 12, out += 16 )
+    _mm_storeu_si128((__m128i*)out, enc_translate_ssse3(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i)), spread)));
 
-  *output_length = (size_t) (4.0 * ceil((double) input_length / 3.0));
+  return i;
+}
+
+//================================================================================
+__attribute__((target("avx2")))
+static size_t enc_avx2(const uint8_t *in, size_t len, char *out)
+{
+  const __m256i spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                          1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                             'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m256i v, t0, t1, t2, t3, idx, res, less;
+  size_t i;
 
-  encoded_data = malloc(*output_length);
-  if (encoded_data == NULL) return NULL;
 
-  for (i = 0, j = 0; i < input_length;)
+  // each lane gets its own 12 bytes. reads 28 bytes, uses 24
+  for ( i = 0; len - i >= 28; i += 24, out += 32 )
   {
-    octet_a = i < input_length ? data[i++] : 0;
-    octet_b = i < input_length ? data[i++] : 0;
-    octet_c = i < input_length ? data[i++] : 0;
+    v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+                                _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+    v = _mm256_shuffle_epi8(v, spread);
+
+    t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    idx = _mm256_or_si256(t1, t3);
 
-    triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
+    res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    res = _mm256_or_si256(res, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    res = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, res), idx);
 
-    encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-    encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-    encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-    encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
+    _mm256_storeu_si256((__m256i*)out, res);
   }
 
-  for (i = 0; i < mod_table[input_length % 3]; i++) encoded_data[*output_length - 1 - i] = '=';
+  return i;
+}
+
+//================================================================================
+// validation and translation tables are indexed by nibbles of the input char. see Wojciech Mula's base64 papers
+#define DEC_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define DEC_LUT_HI 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define DEC_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define DEC_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
 
-  return encoded_data;
+// stops at the first block with non-alphabet char, including padding
+__attribute__((target("ssse3")))
+static size_t dec_ssse3(const char *in, size_t len, uint8_t *out)
+{
+  const __m128i lut_lo = _mm_setr_epi8(DEC_LUT_LO);
+  const __m128i lut_hi = _mm_setr_epi8(DEC_LUT_HI);
+  const __m128i lut_roll = _mm_setr_epi8(DEC_LUT_ROLL);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i str, hi_nibbles, lo_nibbles, lo, hi, roll;
+  size_t i;
+
+
+  // writes 16 bytes, uses 12. 24 chars keep the store within the output
+  for ( i = 0; len - i >= 24; i += 16, out += 12 )
+  {
+    str = _mm_loadu_si128((const __m128i*)(in + i));
+
+    hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    lo_nibbles = _mm_and_si128(str, mask_2f);
+    hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+    if ( _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0 )
+      break;
+
+    roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f), hi_nibbles));
+    str = _mm_add_epi8(str, roll);
+
+    str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(str, _mm_setr_epi8(DEC_PACK)));
+  }
+
+  return i;
 }
 
+//================================================================================
+__attribute__((target("avx2")))
+static size_t dec_avx2(const char *in, size_t len, uint8_t *out)
+{
+  const __m256i lut_lo = _mm256_setr_epi8(DEC_LUT_LO, DEC_LUT_LO);
+  const __m256i lut_hi = _mm256_setr_epi8(DEC_LUT_HI, DEC_LUT_HI);
+  const __m256i lut_roll = _mm256_setr_epi8(DEC_LUT_ROLL, DEC_LUT_ROLL);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  __m256i str, hi_nibbles, lo_nibbles, lo, hi, roll;
+  size_t i;
+
+
+  // writes 32 bytes, uses 24. 48 chars keep the store within the output
+  for ( i = 0; len - i >= 48; i += 32, out += 24 )
+  {
+    str = _mm256_loadu_si256((const __m256i*)(in + i));
+
+    hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    lo_nibbles = _mm256_and_si256(str, mask_2f);
+    hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+    if ( ! _mm256_testz_si256(lo, hi) )
+      break;
+
+    roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2f), hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+
+    str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+    str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(DEC_PACK, DEC_PACK));
+    str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256((__m256i*)out, str);
+  }
+
+  return i;
+}
+#endif // B64_SIMD
 
 //================================================================================
-char *base64_decode(const char *data, size_t input_length, size_t *output_length)
+// encodes into out, which should have at least BASE64_ENCODED_LEN(input_length) bytes. no terminating zero added
+// returns the length of encoded data
+size_t base64_encode_buf(const void *data, size_t input_length, char *out)
+{
+  const uint8_t *in;
+  size_t i, j;
+  uint32_t triple;
+
+
+  in = (const uint8_t *)data;
+  i = j = 0;
+
+#ifdef B64_SIMD
+  if ( input_length >= B64_SIMD_MIN )
+  {
+    if ( simd_detect() == SIMD_AVX2 )
+      i = enc_avx2(in, input_length, out);
+    else if ( simd_level == SIMD_SSSE3 )
+      i = enc_ssse3(in, input_length, out);
+
+    j = i / 3 * 4;
+  }
+#endif
+
+  for ( ; input_length - i >= 3; i += 3 )
+  {
+    triple = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+    out[j++] = encoding_table[(triple >> 18) & 0x3F];
+    out[j++] = encoding_table[(triple >> 12) & 0x3F];
+    out[j++] = encoding_table[(triple >> 6) & 0x3F];
+    out[j++] = encoding_table[triple & 0x3F];
+  }
+
+  if ( i < input_length ) // 1 or 2 bytes tail
+  {
+    triple = in[i] << 16;
+
+    if ( i + 1 < input_length )
+      triple |= in[i + 1] << 8;
+
+    out[j++] = encoding_table[(triple >> 18) & 0x3F];
+    out[j++] = encoding_table[(triple >> 12) & 0x3F];
+    out[j++] = ( i + 1 < input_length ? encoding_table[(triple >> 6) & 0x3F] : '=' );
+    out[j++] = '=';
+  }
+
+  return j;
+}
+
+//================================================================================
+// decodes into out, which should have at least BASE64_DECODED_MAXLEN(input_length) bytes
+// returns the length of decoded data or -1 if input is not a valid base64.
+// BASE64_STRICT flag: input should be padded and contain nothing but the alphabet and padding.
+// without it whitespace is skipped and missing padding is tolerated
+ssize_t base64_decode_buf(const char *data, size_t input_length, void *out, int flags)
+{
+  const uint8_t *in;
+  uint8_t *o, v;
+  size_t i;
+  uint32_t acc;
+  int bits, quad, pad;
+
+
+  in = (const uint8_t *)data;
+  o = (uint8_t *)out;
+  i = 0;
+
+#ifdef B64_SIMD
+  if ( input_length >= B64_SIMD_MIN )
+  {
+    if ( simd_detect() == SIMD_AVX2 )
+      i = dec_avx2(data, input_length, o);
+    else if ( simd_level == SIMD_SSSE3 )
+      i = dec_ssse3(data, input_length, o);
+
+    o += i / 4 * 3;
+  }
+#endif
+
+  acc = 0;
+  bits = quad = pad = 0;
+
+  for ( ; i < input_length; ++i )
+  {
+    v = decoding_table[in[i]];
+
+    if ( v != 0xff )
+    {
+      if ( pad ) // data after padding
+        return -1;
+
+      acc = (acc << 6) | v;
+      bits += 6;
+
+      if ( bits >= 8 )
+      {
+        bits -= 8;
+        *o++ = (acc >> bits) & 0xFF;
+      }
+    }
+    else if ( in[i] == '=' )
+    {
+      if ( quad < 2 ) // only the last 2 chars of quad can be padding
+        return -1;
+
+      ++pad;
+    }
+    else if ( ! (flags & BASE64_STRICT) && (in[i] == ' ' || in[i] == '\t' || in[i] == '\r' || in[i] == '\n') )
+      continue;
+    else
+      return -1;
+
+    quad = (quad + 1) & 3;
+
+    if ( quad == 0 ) // leftover bits of the padded quad are dropped
+      bits = 0;
+  }
+
+  if ( quad != 0 && (quad == 1 || (flags & BASE64_STRICT)) )
+    return -1;
+
+  return o - (uint8_t *)out;
+}
+
+//================================================================================
+// malloc'ing wrappers. result should be free()'d
+char *base64_encode(const char *data, size_t input_length, size_t *output_length)
 {
-char *decoded_data;
-int i,j;
-uint32_t sextet_a, sextet_b, sextet_c, sextet_d, triple;
+  char *encoded_data;
+
+
+  if ( NULL == (encoded_data = malloc(BASE64_ENCODED_LEN(input_length) + 1)) )
+    return NULL;
+
+  *output_length = base64_encode_buf(data, input_length, encoded_data);
 
-  if (decoding_table == NULL) build_decoding_table();
+  return encoded_data;
+}
 
-  if (input_length % 4 != 0) return NULL;
+//================================================================================
+char *base64_decode(const char *data, size_t input_length, size_t *output_length)
+{
+  char *decoded_data;
+  ssize_t n;
 
-  *output_length = input_length / 4 * 3;
-  if (data[input_length - 1] == '=') (*output_length)--;
-  if (data[input_length - 2] == '=') (*output_length)--;
 
-  decoded_data = malloc(*output_length);
-  if (decoded_data == NULL) return NULL;
+  if ( NULL == (decoded_data = malloc(BASE64_DECODED_MAXLEN(input_length) + 1)) )
+    return NULL;
 
-  for (i = 0, j = 0; i < input_length;)
+  if ( -1 == (n = base64_decode_buf(data, input_length, decoded_data, 0)) )
   {
-    sextet_a = data[i] == '=' ? 0 & i++ : decoding_table[(int)data[i++]];
-    sextet_b = data[i] == '=' ? 0 & i++ : decoding_table[(int)data[i++]];
-    sextet_c = data[i] == '=' ? 0 & i++ : decoding_table[(int)data[i++]];
-    sextet_d = data[i] == '=' ? 0 & i++ : decoding_table[(int)data[i++]];
-
-    triple = (sextet_a << 3 * 6)
-      + (sextet_b << 2 * 6)
-      + (sextet_c << 1 * 6)
-      + (sextet_d << 0 * 6);
-
-    if (j < *output_length) decoded_data[j++] = (triple >> 2 * 8) & 0xFF;
-    if (j < *output_length) decoded_data[j++] = (triple >> 1 * 8) & 0xFF;
-    if (j < *output_length) decoded_data[j++] = (triple >> 0 * 8) & 0xFF;
+    free(decoded_data);
+    return NULL;
   }
 
+  *output_length = n;
+
   return decoded_data;
 }
@@ -1,2 +1,16 @@
-extern char *base64_encode(const char *data, size_t input_length, size_t *output_length);
-extern char *base64_decode(const char *data, size_t input_length, size_t *output_length);
+#ifndef B64_H
+#define B64_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4) // exact encoded length of n bytes
+#define BASE64_DECODED_MAXLEN(n) (((n) + 3) / 4 * 3) // enough room to decode n chars
+
+#define BASE64_STRICT 1 // base64_decode_buf() flag. reject whitespace and unpadded input
+
+extern size_t base64_encode_buf(const void *data, size_t input_length, char *out); // no allocation. returns encoded length
+extern ssize_t base64_decode_buf(const char *data, size_t input_length, void *out, int flags); // no allocation. returns decoded length or -1 on bad input
+extern char *base64_encode(const char *data, size_t input_length, size_t *output_length); // malloc'ed result
+extern char *base64_decode(const char *data, size_t input_length, size_t *output_length); // malloc'ed result. NULL on bad input
+#endif